@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+#
+# List or reconstitute the flows in a chunk store written with -S chunk_store=1
+#
+#   tcpflow_chunks.py list    outdir
+#   tcpflow_chunks.py extract outdir destdir [flow_id ...]
+#
+# See src/chunk_store.h for the format.
+#
+import os
+import struct
+
+def read_recipes(outdir):
+    """Yield (flow_id, filesize, name, chunks); chunks are (pack_offset, len)"""
+    with open(os.path.join(outdir, "chunks", "recipes"), "rb") as f:
+        data = f.read()
+    pos = 0
+    while pos < len(data):
+        (flow_id, filesize, name_len, chunk_count) = struct.unpack_from("<QQII", data, pos)
+        pos += 24
+        name = data[pos:pos+name_len].decode("utf-8", "replace")
+        pos += name_len
+        chunks = []
+        for i in range(chunk_count):
+            chunks.append(struct.unpack_from("<QI", data, pos))
+            pos += 12
+        yield (flow_id, filesize, name, chunks)
+
+def extract(pack, flow_id, filesize, name, chunks, destdir):
+    path = os.path.join(destdir, "{}-{}".format(flow_id, os.path.basename(name)))
+    with open(path, "wb") as out:
+        for (pack_offset, length) in chunks:
+            pack.seek(pack_offset)
+            out.write(pack.read(length))
+    return path
+
+if __name__=="__main__":
+    import sys
+    if len(sys.argv) < 3 or sys.argv[1] not in ("list", "extract") or (sys.argv[1]=="extract" and len(sys.argv) < 4):
+        print("usage: {} list outdir | extract outdir destdir [flow_id ...]".format(sys.argv[0]))
+        sys.exit(1)
+    outdir = sys.argv[2]
+    if sys.argv[1]=="list":
+        for (flow_id, filesize, name, chunks) in read_recipes(outdir):
+            print("{:8d} {:12d} {:6d} {}".format(flow_id, filesize, len(chunks), name))
+    else:
+        destdir = sys.argv[3]
+        wanted = set(int(x) for x in sys.argv[4:])
+        os.makedirs(destdir, exist_ok=True)
+        with open(os.path.join(outdir, "chunks", "pack"), "rb") as pack:
+            for (flow_id, filesize, name, chunks) in read_recipes(outdir):
+                if wanted and flow_id not in wanted:
+                    continue
+                print(extract(pack, flow_id, filesize, name, chunks, destdir))
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+#
+# List or extract the flows in a container written with -S container=1
+#
+#   tcpflow_container.py list    outdir
+#   tcpflow_container.py extract outdir destdir [flow_id ...]
+#
+# See src/container_store.h for the format.
+#
+import os
+import struct
+
+def read_index(outdir):
+    """Yield (flow_id, filesize, name, extents); extents are (segment, len, segment_offset, flow_offset)"""
+    with open(os.path.join(outdir, "container", "index"), "rb") as f:
+        data = f.read()
+    pos = 0
+    while pos < len(data):
+        (flow_id, filesize, name_len, extent_count) = struct.unpack_from("<QQII", data, pos)
+        pos += 24
+        name = data[pos:pos+name_len].decode("utf-8", "replace")
+        pos += name_len
+        extents = []
+        for i in range(extent_count):
+            extents.append(struct.unpack_from("<IIQQ", data, pos))
+            pos += 24
+        yield (flow_id, filesize, name, extents)
+
+def extract(outdir, flow_id, filesize, name, extents, destdir):
+    path = os.path.join(destdir, "{}-{}".format(flow_id, os.path.basename(name)))
+    segments = {}
+    with open(path, "wb") as out:
+        out.truncate(filesize)
+        for (segment, length, segment_offset, flow_offset) in extents:
+            if segment not in segments:
+                segments[segment] = open(os.path.join(outdir, "container", "segment-{:06d}".format(segment)), "rb")
+            seg = segments[segment]
+            seg.seek(segment_offset)
+            out.seek(flow_offset)
+            out.write(seg.read(length))
+    for seg in segments.values():
+        seg.close()
+    return path
+
+if __name__=="__main__":
+    import sys
+    if len(sys.argv) < 3 or sys.argv[1] not in ("list", "extract") or (sys.argv[1]=="extract" and len(sys.argv) < 4):
+        print("usage: {} list outdir | extract outdir destdir [flow_id ...]".format(sys.argv[0]))
+        sys.exit(1)
+    outdir = sys.argv[2]
+    if sys.argv[1]=="list":
+        for (flow_id, filesize, name, extents) in read_index(outdir):
+            print("{:8d} {:12d} {:6d} {}".format(flow_id, filesize, len(extents), name))
+    else:
+        destdir = sys.argv[3]
+        wanted = set(int(x) for x in sys.argv[4:])
+        os.makedirs(destdir, exist_ok=True)
+        for (flow_id, filesize, name, extents) in read_index(outdir):
+            if wanted and flow_id not in wanted:
+                continue
+            print(extract(outdir, flow_id, filesize, name, extents, destdir))
@@ -0,0 +1,373 @@
+/*
+ * arrow_writer.cpp:
+ *
+ * See arrow_writer.h. The layout is the Arrow IPC file format, version 5:
+ *
+ *   "ARROW1\0\0"
+ *   the Schema message
+ *   a RecordBatch message for each batch
+ *   the end-of-stream marker
+ *   the Footer, its length, "ARROW1"
+ *
+ * Each message is 0xFFFFFFFF, the length of its metadata, the metadata (a
+ * FlatBuffer, padded to 8 bytes), and the body the metadata describes.
+ * Every number is little-endian.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "arrow_writer.h"
+
+#include <assert.h>
+
+/* Message.fbs, Schema.fbs and File.fbs, as far as they are used here */
+enum { METADATA_V5=4,
+       HEADER_SCHEMA=1, HEADER_RECORD_BATCH=3,
+       TYPE_INT=2, TYPE_UTF8=5, TYPE_TIMESTAMP=10,
+       UNIT_MICROSECOND=2 };
+
+/* A FlatBuffer field: size bytes of value, or an offset to patch once its target is built. 0 if absent */
+struct fb_field {
+    size_t   size;
+    uint64_t value;
+};
+
+/*
+ * Builds a FlatBuffer front to back. Each table's vtable comes just
+ * before it, and everything a table refers to comes after it, so every
+ * offset points forward and is patched when its target is built.
+ * Scalars are aligned to their size from the start of the buffer.
+ */
+class fb_builder {
+public:
+    fb_builder():b(){}
+    std::string b;
+
+    void put(uint64_t v,size_t size){
+        for(size_t i=0;i<size;i++){
+            b += (char)(v & 0xff);
+            v >>= 8;
+        }
+    }
+    void pad(size_t align){
+        while(b.size()%align) b += '\0';
+    }
+    size_t offset(){                    // to patch
+        pad(4);
+        put(0,4);
+        return b.size()-4;
+    }
+    void patch(size_t at,size_t target){
+        uint32_t v = target-at;
+        for(size_t i=0;i<4;i++) b[at+i] = (char)((v>>(i*8)) & 0xff);
+    }
+    /* at[i] is where field i is, to patch an offset */
+    size_t table(const fb_field *fields,size_t n,size_t *at){
+        pad(4);
+        size_t vt = b.size();
+        size_t vtsize = 4+2*n;
+        size_t tbl = (vt+vtsize+3) & ~(size_t)3;
+        size_t p = tbl+4;               // after the offset to the vtable
+        std::vector<size_t> where(n);
+        for(size_t i=0;i<n;i++){
+            if(fields[i].size==0){
+                where[i] = 0;
+                continue;
+            }
+            p = (p+fields[i].size-1)/fields[i].size*fields[i].size;
+            where[i] = p-tbl;
+            p += fields[i].size;
+        }
+        put(vtsize,2);
+        put(p-tbl,2);
+        for(size_t i=0;i<n;i++) put(where[i],2);
+        pad(4);
+        put(tbl-vt,4);
+        for(size_t i=0;i<n;i++){
+            if(at) at[i] = tbl+where[i];
+            if(fields[i].size==0) continue;
+            while(b.size()<tbl+where[i]) b += '\0';
+            put(fields[i].value,fields[i].size);
+        }
+        return tbl;
+    }
+    size_t string(const std::string &s){
+        pad(4);
+        size_t pos = b.size();
+        put(s.size(),4);
+        b += s;
+        b += '\0';
+        return pos;
+    }
+    /* the elements follow, aligned to align */
+    size_t vector(size_t n,size_t align){
+        pad(4);
+        if((b.size()+4)%align) put(0,4);
+        size_t pos = b.size();
+        put(n,4);
+        return pos;
+    }
+};
+
+arrow_writer::arrow_writer(size_t rows_per_batch_):
+    rows(0),batches(0),columns(),rows_per_batch(rows_per_batch_>0 ? rows_per_batch_ : 1),batch_rows(0),next(0),
+    fname(),f(0),file_pos(0),failed(false),blocks()
+{
+}
+
+arrow_writer::~arrow_writer()
+{
+    close();
+}
+
+void arrow_writer::add_column(const std::string &name,type_t type)
+{
+    assert(f==0);
+    columns.push_back(column(name,type));
+    column &c = columns.back();
+    if(type==UTF8) c.offsets.push_back(0);
+    else c.data.reserve(rows_per_batch*c.width());
+}
+
+/* Field.type: an Int, Utf8 or Timestamp table */
+static size_t type_table(fb_builder &fb,arrow_writer::type_t type,uint8_t &type_type)
+{
+    switch(type){
+    case arrow_writer::UTF8: {
+        type_type = TYPE_UTF8;
+        return fb.table(0,0,0);
+    }
+    case arrow_writer::TIMESTAMP_US: {
+        type_type = TYPE_TIMESTAMP;
+        fb_field tf[] = {{2,UNIT_MICROSECOND},{4,0}};
+        size_t at[2];
+        size_t tbl = fb.table(tf,2,at);
+        fb.patch(at[1],fb.string("UTC"));
+        return tbl;
+    }
+    default: {
+        type_type = TYPE_INT;
+        uint64_t bits = type==arrow_writer::UINT8 ? 8 : type==arrow_writer::UINT16 ? 16 : 64;
+        fb_field tf[] = {{4,bits},{1,0}}; // unsigned
+        return fb.table(tf,2,0);
+    }
+    }
+}
+
+size_t arrow_writer::schema_table(fb_builder &fb) const
+{
+    fb_field sf[] = {{0,0},{4,0}};      // little-endian; fields
+    size_t sat[2];
+    size_t schema = fb.table(sf,2,sat);
+    fb.patch(sat[1],fb.vector(columns.size(),4));
+    std::vector<size_t> slots;
+    for(size_t i=0;i<columns.size();i++) slots.push_back(fb.offset());
+    for(size_t i=0;i<columns.size();i++){
+        /* name, nullable, type_type, type, dictionary, children */
+        uint8_t type_type = 0;
+        size_t fat[6];
+        fb_field ff[] = {{4,0},{1,1},{1,0},{4,0},{0,0},{4,0}};
+        size_t field = fb.table(ff,6,fat);
+        fb.patch(slots[i],field);
+        fb.patch(fat[0],fb.string(columns[i].name));
+        size_t type = type_table(fb,columns[i].type,type_type);
+        fb.b[fat[2]] = (char)type_type;
+        fb.patch(fat[3],type);
+        fb.patch(fat[5],fb.vector(0,4));
+    }
+    return schema;
+}
+
+/* Message: version, header_type, header, bodyLength; the header table is returned in header */
+static size_t message_table(fb_builder &fb,uint8_t header_type,uint64_t body_length,size_t &header)
+{
+    size_t root = fb.offset();
+    fb_field mf[] = {{2,METADATA_V5},{1,header_type},{4,0},{8,body_length}};
+    size_t at[4];
+    size_t msg = fb.table(mf,4,at);
+    fb.patch(root,msg);
+    header = at[2];
+    return msg;
+}
+
+bool arrow_writer::open(const std::string &fname_,std::string &err)
+{
+    fname = fname_;
+    f = fopen(fname.c_str(),"wb");
+    if(f==0){
+        err = fname + ": " + strerror(errno);
+        return false;
+    }
+    write_bytes("ARROW1\0\0",8);
+    fb_builder fb;
+    size_t header = 0;
+    message_table(fb,HEADER_SCHEMA,0,header);
+    fb.patch(header,schema_table(fb));
+    write_message(fb.b,"",false);
+    return true;
+}
+
+void arrow_writer::write_bytes(const void *p,size_t len)
+{
+    if(len>0 && fwrite(p,1,len,f)!=len && !failed){
+        DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+        failed = true;
+    }
+    file_pos += len;
+}
+
+void arrow_writer::write_message(const std::string &meta,const std::string &body,bool record)
+{
+    uint64_t start = file_pos;
+    std::string prefix;
+    size_t padded = (meta.size()+7) & ~(size_t)7;
+    for(size_t i=0;i<4;i++) prefix += (char)0xff;  // continuation
+    for(size_t i=0;i<4;i++) prefix += (char)((padded>>(i*8)) & 0xff);
+    write_bytes(prefix.data(),prefix.size());
+    write_bytes(meta.data(),meta.size());
+    static const char zeros[8] = {0};
+    write_bytes(zeros,padded-meta.size());
+    write_bytes(body.data(),body.size());
+    if(record) blocks.push_back(block(start,8+padded,body.size()));
+}
+
+void arrow_writer::set_valid(column &c,bool valid)
+{
+    if(valid && c.nulls==0) return;     // no bitmap until there is a null
+    if(c.nulls==0){
+        c.validity.assign(rows_per_batch/8+1,0);
+        for(size_t i=0;i<batch_rows;i++) c.validity[i/8] |= 1<<(i%8);
+    }
+    if(valid) c.validity[batch_rows/8] |= 1<<(batch_rows%8);
+    else c.nulls++;
+}
+
+void arrow_writer::put(uint64_t v)
+{
+    assert(next<columns.size() && columns[next].type!=UTF8);
+    column &c = columns[next++];
+    set_valid(c,true);
+    for(size_t i=0;i<c.width();i++){
+        c.data.push_back(v & 0xff);
+        v >>= 8;
+    }
+}
+
+void arrow_writer::put(const struct timeval &tv)
+{
+    put((uint64_t)((int64_t)tv.tv_sec*1000000 + tv.tv_usec));
+}
+
+void arrow_writer::put(const char *s,size_t len)
+{
+    assert(next<columns.size() && columns[next].type==UTF8);
+    column &c = columns[next++];
+    set_valid(c,true);
+    c.data.insert(c.data.end(),s,s+len);
+    c.offsets.push_back(c.data.size());
+}
+
+void arrow_writer::put_null()
+{
+    assert(next<columns.size());
+    column &c = columns[next++];
+    set_valid(c,false);
+    if(c.type==UTF8) c.offsets.push_back(c.data.size());
+    else c.data.insert(c.data.end(),c.width(),0);
+}
+
+void arrow_writer::end_row()
+{
+    while(next<columns.size()) put_null(); // the columns that were not given
+    next = 0;
+    rows++;
+    if(++batch_rows==rows_per_batch) write_batch();
+}
+
+/* The columns as a RecordBatch message, each buffer padded to 8 bytes; then empty them */
+void arrow_writer::write_batch()
+{
+    if(batch_rows==0 || f==0) return;
+    std::string body;
+    std::vector<uint64_t> buffers;      // offset and length of each
+    for(std::vector<column>::iterator it=columns.begin();it!=columns.end();it++){
+        /* validity, the offsets of a UTF8 column, data */
+        buffers.push_back(body.size());
+        buffers.push_back(it->nulls ? (batch_rows+7)/8 : 0);
+        if(it->nulls) body.append(reinterpret_cast<const char *>(&it->validity[0]),(batch_rows+7)/8);
+        while(body.size()%8) body += '\0';
+        if(it->type==UTF8){
+            buffers.push_back(body.size());
+            buffers.push_back(it->offsets.size()*4);
+            for(std::vector<int32_t>::const_iterator o=it->offsets.begin();o!=it->offsets.end();o++){
+                for(size_t i=0;i<4;i++) body += (char)((*o>>(i*8)) & 0xff);
+            }
+            while(body.size()%8) body += '\0';
+        }
+        buffers.push_back(body.size());
+        buffers.push_back(it->data.size());
+        body.append(it->data.begin(),it->data.end());
+        while(body.size()%8) body += '\0';
+    }
+
+    fb_builder fb;
+    size_t header = 0;
+    message_table(fb,HEADER_RECORD_BATCH,body.size(),header);
+    fb_field rf[] = {{8,batch_rows},{4,0},{4,0}}; // length, nodes, buffers
+    size_t at[3];
+    fb.patch(header,fb.table(rf,3,at));
+    fb.patch(at[1],fb.vector(columns.size(),8));
+    for(std::vector<column>::const_iterator it=columns.begin();it!=columns.end();it++){
+        fb.put(batch_rows,8);           // FieldNode: length, null_count
+        fb.put(it->nulls,8);
+    }
+    fb.patch(at[2],fb.vector(buffers.size()/2,8));
+    for(size_t i=0;i<buffers.size();i++) fb.put(buffers[i],8); // Buffer: offset, length
+    write_message(fb.b,body,true);
+    batches++;
+
+    for(std::vector<column>::iterator it=columns.begin();it!=columns.end();it++){
+        it->data.clear();
+        it->nulls = 0;
+        it->validity.clear();
+        if(it->type==UTF8){
+            it->offsets.clear();
+            it->offsets.push_back(0);
+        }
+    }
+    batch_rows = 0;
+}
+
+void arrow_writer::close()
+{
+    if(f==0) return;
+    if(next>0) end_row();               // a row that was begun
+    write_batch();
+    static const char eos[8] = {(char)0xff,(char)0xff,(char)0xff,(char)0xff,0,0,0,0};
+    write_bytes(eos,sizeof(eos));
+
+    /* Footer: version, schema, dictionaries, recordBatches */
+    fb_builder fb;
+    size_t root = fb.offset();
+    fb_field ff[] = {{2,METADATA_V5},{4,0},{4,0},{4,0}};
+    size_t at[4];
+    fb.patch(root,fb.table(ff,4,at));
+    fb.patch(at[1],schema_table(fb));
+    fb.patch(at[2],fb.vector(0,8));
+    fb.patch(at[3],fb.vector(blocks.size(),8));
+    for(std::vector<block>::const_iterator it=blocks.begin();it!=blocks.end();it++){
+        fb.put(it->offset,8);           // Block: offset, metaDataLength, padding, bodyLength
+        fb.put(it->meta,4);
+        fb.put(0,4);
+        fb.put(it->body,8);
+    }
+    write_bytes(fb.b.data(),fb.b.size());
+    std::string trailer;
+    for(size_t i=0;i<4;i++) trailer += (char)((fb.b.size()>>(i*8)) & 0xff);
+    trailer += "ARROW1";
+    write_bytes(trailer.data(),trailer.size());
+    if(fclose(f) && !failed) DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+    f = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * arrow_writer.h:
+ *
+ * Rows written to an Apache Arrow IPC file (Feather v2), which pyarrow,
+ * DuckDB, Polars and Spark read directly, without a library: the few
+ * FlatBuffers tables the format needs are built by hand. The columns are
+ * filled a row at a time, and every rows_per_batch rows they are written
+ * as one record batch (a row group), so memory stays bounded and the
+ * reader can skip batches. Nothing is compressed.
+ *
+ * Columns are declared before the first row; each row then gives one
+ * value for each column, in the order they were declared.
+ *
+ * tcpip::dump_arrow() writes a row per flow to -S arrow_report=FILE.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef ARROW_WRITER_H
+#define ARROW_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+class arrow_writer {
+    /* These are not implemented */
+    arrow_writer(const arrow_writer &);
+    arrow_writer &operator=(const arrow_writer &);
+
+public:
+    enum { DEFAULT_BATCH_ROWS=65536 };
+    enum type_t { UINT8, UINT16, UINT64, TIMESTAMP_US, UTF8 };
+
+    arrow_writer(size_t rows_per_batch);
+    virtual ~arrow_writer();
+    void add_column(const std::string &name,type_t type); // every column may be null
+    bool open(const std::string &fname,std::string &err); // after the columns
+    void close();                       // the last batch and the footer
+
+    /* the next column of the row */
+    void put(uint64_t v);
+    void put(const struct timeval &tv);
+    void put(const std::string &s){ put(s.data(),s.size()); }
+    void put(const char *s,size_t len);
+    void put_null();
+    void end_row();
+
+    uint64_t rows;                      // statistics
+    uint64_t batches;
+
+private:
+    struct column {
+        column(const std::string &name_,type_t type_):name(name_),type(type_),data(),offsets(),validity(),nulls(0){}
+        std::string name;
+        type_t type;
+        std::vector<uint8_t> data;      // the values, or the bytes of the strings
+        std::vector<int32_t> offsets;   // UTF8: where each string starts, and one past the last
+        std::vector<uint8_t> validity;  // one bit per row; only filled in once there is a null
+        size_t nulls;
+        size_t width() const { return type==UINT8 ? 1 : type==UINT16 ? 2 : 8; }
+    };
+    std::vector<column> columns;
+    size_t rows_per_batch;
+    size_t batch_rows;                  // rows in the columns now
+    size_t next;                        // column of the row to put next
+    std::string fname;
+    FILE *f;
+    uint64_t file_pos;
+    bool failed;                        // a write failed; it was reported
+    struct block {
+        block(uint64_t offset_,int32_t meta_,uint64_t body_):offset(offset_),meta(meta_),body(body_){}
+        uint64_t offset;
+        int32_t  meta;
+        uint64_t body;
+    };
+    std::vector<block> blocks;          // the record batches, for the footer
+
+    void set_valid(column &c,bool valid);
+    void write_batch();
+    void write_bytes(const void *p,size_t len);
+    void write_message(const std::string &meta,const std::string &body,bool record);
+    size_t schema_table(class fb_builder &fb) const;
+};
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * async_io.cpp:
+ *
+ * io_uring backend for flow files. See async_io.h.
+ *
+ * Notes:
+ * - Writes on an fd are tracked so that its close is only submitted
+ *   after every write on it has completed; the ring does not order
+ *   unlinked submissions.
+ * - io_uring has no futimes() opcode, so the timestamp is applied by
+ *   name with utimes() when the close completes. This happens while
+ *   reaping, not in the packet path.
+ * - A flow that is about to be deleted (tcpdemux::post_process) is
+ *   drained first, so no operation ever outlives its tcpip.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "async_io.h"
+
+#include <sys/uio.h>
+
+async_io::async_io(unsigned int depth_):
+    ops_submitted(0),max_inflight(0),
+    initialized(false),fixed_buffers(false),depth(depth_),arena(0),
+    free_buffers(),free_ops(),fd_writes(),pending_closes(),
+    unsubmitted(0),inflight(0)
+#ifdef USE_IO_URING
+    ,ring()
+#endif
+{
+#ifdef USE_IO_URING
+    if(depth<8) depth=8;
+    int r = io_uring_queue_init(depth,&ring,0);
+    if(r<0){
+        DEBUG(1)("io_uring_queue_init(%d) failed: %s",depth,strerror(-r));
+        return;
+    }
+    arena = (uint8_t *)malloc((size_t)depth * BUFSIZE);
+    if(arena==0){
+        io_uring_queue_exit(&ring);
+        return;
+    }
+    std::vector<struct iovec> iov(depth);
+    for(unsigned int i=0;i<depth;i++){
+        iov[i].iov_base = arena + (size_t)i * BUFSIZE;
+        iov[i].iov_len  = BUFSIZE;
+        free_buffers.push_back(depth-1-i);
+    }
+    /* Registration pins the pages; it fails under a small RLIMIT_MEMLOCK.
+     * Plain writes from the same buffers still work, so keep going.
+     */
+    r = io_uring_register_buffers(&ring,&iov[0],depth);
+    if(r==0){
+        fixed_buffers = true;
+    } else {
+        DEBUG(1)("io_uring_register_buffers failed (%s); using unregistered buffers",strerror(-r));
+    }
+    initialized = true;
+    DEBUG(10)("io_uring output enabled; depth=%d",depth);
+#endif
+}
+
+async_io::~async_io()
+{
+#ifdef USE_IO_URING
+    if(initialized){
+        drain_all();
+        if(fixed_buffers) io_uring_unregister_buffers(&ring);
+        io_uring_queue_exit(&ring);
+    }
+#endif
+    for(std::vector<aio_op *>::iterator it=free_ops.begin();it!=free_ops.end();it++){
+        delete *it;
+    }
+    if(arena) free(arena);
+}
+
+aio_op *async_io::new_op(aio_op::op_t type,tcpip *tcp)
+{
+    aio_op *o = 0;
+    if(free_ops.size()>0){
+        o = free_ops.back();
+        free_ops.pop_back();
+    } else {
+        o = new aio_op();
+    }
+    o->type = type;
+    o->tcp  = tcp;
+    o->fd   = -1;
+    o->buf_index = -1;
+    o->len  = 0;
+    o->offset = 0;
+    o->path.clear();
+    o->flags = 0;
+    if(tcp) tcp->aio_inflight++;
+    return o;
+}
+
+void async_io::free_op(aio_op *o)
+{
+    if(o->buf_index>=0) free_buffers.push_back(o->buf_index);
+    if(o->tcp) o->tcp->aio_inflight--;
+    o->buf_index = -1;
+    o->tcp = 0;
+    free_ops.push_back(o);
+}
+
+#ifdef USE_IO_URING
+/* Get a submission queue entry, submitting what we have if the queue is full */
+struct io_uring_sqe *async_io::get_sqe()
+{
+    while(true){
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if(sqe){
+            unsubmitted++;
+            return sqe;
+        }
+        reap(false);
+    }
+}
+#endif
+
+/* Get a free buffer, waiting for writes to complete if there are none */
+int async_io::get_buffer()
+{
+    while(free_buffers.size()==0){
+        reap(true);
+    }
+    int i = free_buffers.back();
+    free_buffers.pop_back();
+    return i;
+}
+
+void async_io::submit_open(aio_op *o)
+{
+#ifdef USE_IO_URING
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_openat(sqe,AT_FDCWD,o->path.c_str(),o->flags,0666);
+    io_uring_sqe_set_data(sqe,o);
+#endif
+}
+
+void async_io::submit_write(aio_op *o)
+{
+#ifdef USE_IO_URING
+    fd_writes[o->fd]++;
+    struct io_uring_sqe *sqe = get_sqe();
+    uint8_t *buf = arena + (size_t)o->buf_index * BUFSIZE;
+    if(fixed_buffers){
+        io_uring_prep_write_fixed(sqe,o->fd,buf,o->len,o->offset,o->buf_index);
+    } else {
+        io_uring_prep_write(sqe,o->fd,buf,o->len,o->offset);
+    }
+    io_uring_sqe_set_data(sqe,o);
+    if(unsubmitted >= depth/4) reap(false);
+#endif
+}
+
+void async_io::submit_close(aio_op *o)
+{
+#ifdef USE_IO_URING
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_close(sqe,o->fd);
+    io_uring_sqe_set_data(sqe,o);
+#endif
+}
+
+/* Close fd once the writes on it have completed */
+void async_io::schedule_close(int fd,const std::string &path,const struct timeval &tstart)
+{
+    aio_op *o = new_op(aio_op::CLOSE,0);
+    o->fd     = fd;
+    o->path   = path;
+    o->tstart = tstart;
+    if(fd_writes.find(fd)!=fd_writes.end()){
+        pending_closes[fd] = o;
+    } else {
+        submit_close(o);
+    }
+}
+
+/* Forget the writes that were waiting for an open that failed */
+void async_io::drop_waiting(tcpip *tcp)
+{
+    for(std::vector<aio_op *>::iterator it=tcp->aio_waiting.begin();it!=tcp->aio_waiting.end();it++){
+        free_op(*it);
+    }
+    tcp->aio_waiting.clear();
+}
+
+/* Start opening the flow's file. flags are as for open(2). */
+void async_io::open(tcpip *tcp,const std::string &path,int flags)
+{
+    /* Respect the fd budget just as retrying_open() does */
+    tcpdemux &demux = tcp->demux;
+    while(demux.open_flows.size()>0 &&
+          demux.open_flows.size() >= demux.max_fds){
+        demux.close_oldest_fd();
+    }
+    aio_op *o = new_op(aio_op::OPEN,tcp);
+    o->path  = path;
+    o->flags = flags;
+    tcp->aio_opening = true;
+    tcp->aio_close_pending = false;
+    submit_open(o);
+}
+
+/* Queue len bytes of data to be written at offset. The data is copied. */
+void async_io::write(tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset)
+{
+    while(len>0){
+        uint32_t n = len < (uint32_t)BUFSIZE ? len : (uint32_t)BUFSIZE;
+        int b = get_buffer();           // may reap, which may complete tcp's open
+        aio_op *o = new_op(aio_op::WRITE,tcp);
+        o->buf_index = b;
+        o->len       = n;
+        o->offset    = offset;
+        memcpy(arena + (size_t)b * BUFSIZE,data,n);
+        if(tcp->aio_opening){
+            tcp->aio_waiting.push_back(o);
+        } else if(tcp->fd>=0){
+            o->fd = tcp->fd;
+            submit_write(o);
+        } else {
+            free_op(o);                 // open failed; the synchronous path drops it too
+        }
+        data   += n;
+        len    -= n;
+        offset += n;
+    }
+}
+
+/* Close the flow's file. If the open is still in flight, close it when it completes. */
+void async_io::close(tcpip *tcp)
+{
+    if(tcp->aio_opening){
+        tcp->aio_close_pending = true;
+        return;
+    }
+    if(tcp->fd>=0) schedule_close(tcp->fd,tcp->flow_pathname,tcp->myflow.tstart);
+}
+
+/* Handle one completion */
+void async_io::complete(aio_op *o,int res)
+{
+    tcpip *tcp = o->tcp;
+    switch(o->type){
+    case aio_op::OPEN:
+        if(res==-EEXIST && (o->flags & O_EXCL)){
+            /* same search as flow::new_filename(): try the next connection count */
+            tcp->aio_connection_count++;
+            o->path = tcp->myflow.filename(tcp->aio_connection_count);
+            if(o->path.find('/')!=std::string::npos) mkdirs_for_path(o->path);
+            tcp->flow_pathname = o->path;
+            submit_open(o);
+            return;
+        }
+        if(res==-EMFILE || res==-ENFILE){
+            DEBUG(5)("too many open files -- contracting FD ring (size=%d)",(int)tcp->demux.open_flows.size());
+            if(tcp->demux.open_flows.size()>0) tcp->demux.close_oldest_fd();
+            submit_open(o);
+            return;
+        }
+        tcp->aio_opening = false;
+        if(res<0){
+            errno = -res;
+            perror(o->path.c_str());
+            drop_waiting(tcp);
+            tcp->demux.open_flows.erase(tcp);
+            tcp->aio_close_pending = false;
+            break;
+        }
+        for(std::vector<aio_op *>::iterator it=tcp->aio_waiting.begin();it!=tcp->aio_waiting.end();it++){
+            (*it)->fd = res;
+            submit_write(*it);
+        }
+        tcp->aio_waiting.clear();
+        if(tcp->aio_close_pending){
+            tcp->aio_close_pending = false;
+            schedule_close(res,o->path,tcp->myflow.tstart);
+        } else {
+            tcp->fd = res;
+        }
+        DEBUG(5)("%s: opened fd=%d",o->path.c_str(),res);
+        break;
+
+    case aio_op::WRITE:
+        if(res<0 || (uint32_t)res!=o->len){
+            DEBUG(1)("write to %s failed: %s",tcp->flow_pathname.c_str(),
+                     res<0 ? strerror(-res) : "short write");
+        }
+        if(--fd_writes[o->fd]==0){
+            fd_writes.erase(o->fd);
+            std::map<int,aio_op *>::iterator it = pending_closes.find(o->fd);
+            if(it!=pending_closes.end()){
+                submit_close(it->second);
+                pending_closes.erase(it);
+            }
+        }
+        break;
+
+    case aio_op::CLOSE:
+        if(res<0){
+            errno = -res;
+            perror(o->path.c_str());
+        }
+        {
+            struct timeval times[2];
+            times[0] = o->tstart;
+            times[1] = o->tstart;
+            if(utimes(o->path.c_str(),times)){
+                fprintf(stderr,"%s: utimes(%s)\n",strerror(errno),o->path.c_str());
+            }
+        }
+        break;
+    }
+    free_op(o);
+}
+
+/* Submit everything that has been prepared and handle whatever has completed.
+ * If wait is true, block until at least one operation completes.
+ */
+void async_io::reap(bool wait)
+{
+#ifdef USE_IO_URING
+    if(unsubmitted>0){
+        int r = io_uring_submit(&ring);
+        if(r>0){
+            ops_submitted += r;
+            inflight      += r;
+            unsubmitted   -= r;
+        }
+        if(inflight>max_inflight) max_inflight = inflight;
+    }
+    if(inflight==0) return;
+    if(wait){
+        struct io_uring_cqe *cqe = 0;
+        int r = io_uring_wait_cqe(&ring,&cqe);
+        if(r<0 && r!=-EINTR) die("io_uring_wait_cqe: %s",strerror(-r));
+    }
+    /* Completions can submit more work (closes, retried opens, parked writes),
+     * so copy the batch out of the ring before handling it.
+     */
+    struct io_uring_cqe *cqes[64];
+    unsigned int n = io_uring_peek_batch_cqe(&ring,cqes,64);
+    std::vector<std::pair<aio_op *,int> > done;
+    for(unsigned int i=0;i<n;i++){
+        done.push_back(std::pair<aio_op *,int>((aio_op *)io_uring_cqe_get_data(cqes[i]),cqes[i]->res));
+    }
+    io_uring_cq_advance(&ring,n);
+    inflight -= n;
+    for(std::vector<std::pair<aio_op *,int> >::iterator it=done.begin();it!=done.end();it++){
+        complete(it->first,it->second);
+    }
+#endif
+}
+
+void async_io::drain(tcpip *tcp)
+{
+    while(tcp->aio_inflight>0){
+        if(inflight==0 && unsubmitted==0 && pending_closes.size()==0) break; // nothing left that could finish
+        reap(true);
+    }
+}
+
+void async_io::drain_all()
+{
+    while(inflight>0 || unsubmitted>0){
+        reap(true);
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * async_io.h:
+ *
+ * An optional io_uring backend for writing flow files.
+ *
+ * When it is selected (-S io_uring=1) the demultiplexer no longer
+ * blocks in open(), write(), close() and futimes(). Each operation is
+ * queued on the ring and the completions are reaped in batches. Data
+ * is copied into one of a fixed set of registered buffers, which is
+ * returned to the free list when its write completes.
+ *
+ * The synchronous path in tcpip.cpp remains the default.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#if defined(HAVE_LIBURING_H) && defined(HAVE_LIBURING)
+#define USE_IO_URING
+#include <liburing.h>
+#endif
+
+/**
+ * A single open, write or close. Writes created before the flow's
+ * openat() has completed are parked on tcpip::aio_waiting.
+ */
+class aio_op {
+    /* These are not implemented */
+    aio_op(const aio_op &);
+    aio_op &operator=(const aio_op &);
+public:
+    typedef enum { OPEN, WRITE, CLOSE } op_t;
+    aio_op():type(WRITE),tcp(0),fd(-1),buf_index(-1),len(0),offset(0),
+             path(),flags(0),tstart(){}
+    op_t        type;
+    class tcpip *tcp;                   // flow that owns the operation; 0 for CLOSE
+    int         fd;
+    int         buf_index;              // WRITE: which buffer holds the data
+    uint32_t    len;                    // WRITE: bytes in the buffer
+    uint64_t    offset;                 // WRITE: absolute position in the file
+    std::string path;                   // OPEN, CLOSE
+    int         flags;                  // OPEN
+    struct timeval tstart;              // CLOSE: time to give the closed file
+};
+
+class async_io {
+    /* These are not implemented */
+    async_io(const async_io &);
+    async_io &operator=(const async_io &);
+
+public:
+    enum { DEFAULT_DEPTH=256,           // submission queue entries and number of buffers
+           BUFSIZE=65536 };             // size of each buffer; one SNAPLEN
+
+    async_io(unsigned int depth);
+    virtual ~async_io();
+    bool ok() const { return initialized; }
+
+    void open(class tcpip *tcp,const std::string &path,int flags);
+    void write(class tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset);
+    void close(class tcpip *tcp);
+    void drain(class tcpip *tcp);       // wait until none of tcp's operations are outstanding
+    void drain_all();                   // wait until the ring is empty
+
+    uint64_t ops_submitted;             // statistics
+    uint64_t max_inflight;
+
+private:
+    bool        initialized;
+    bool        fixed_buffers;          // buffers were registered with the kernel
+    unsigned int depth;
+    uint8_t     *arena;                 // depth buffers of BUFSIZE bytes each
+    std::vector<int>      free_buffers;
+    std::vector<aio_op *> free_ops;
+    std::map<int,uint32_t> fd_writes;   // writes outstanding on each fd
+    std::map<int,aio_op *> pending_closes; // closes waiting for those writes
+    unsigned int unsubmitted;           // prepared but not yet submitted
+    unsigned int inflight;              // submitted but not yet reaped
+#ifdef USE_IO_URING
+    struct io_uring ring;
+    struct io_uring_sqe *get_sqe();
+#endif
+
+    aio_op *new_op(aio_op::op_t type,class tcpip *tcp);
+    void    free_op(aio_op *o);
+    int     get_buffer();
+    void    submit_open(aio_op *o);
+    void    submit_write(aio_op *o);
+    void    submit_close(aio_op *o);
+    void    schedule_close(int fd,const std::string &path,const struct timeval &tstart);
+    void    drop_waiting(class tcpip *tcp);
+    void    reap(bool wait);
+    void    complete(aio_op *o,int res);
+};
+
+#endif
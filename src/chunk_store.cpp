@@ -0,0 +1,225 @@
+/*
+ * chunk_store.cpp:
+ *
+ * Content-defined chunking output store. See chunk_store.h for the layout.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "chunk_store.h"
+
+/* The gear table maps each byte to a random 64-bit value. It is generated
+ * with splitmix64 from a fixed seed so that every run cuts the same chunks.
+ */
+static uint64_t gear[256];
+
+static void init_gear()
+{
+    uint64_t x = 0x7463706666c6f77ULL;
+    for(int i=0;i<256;i++){
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* little-endian encoding for the recipes */
+static void put32(std::string &s,uint32_t v)
+{
+    for(int i=0;i<4;i++) s.push_back((char)((v >> (i*8)) & 0xff));
+}
+
+static void put64(std::string &s,uint64_t v)
+{
+    for(int i=0;i<8;i++) s.push_back((char)((v >> (i*8)) & 0xff));
+}
+
+/* Find the boundaries in the data and hand each finished chunk to the store.
+ * The gear hash only depends on the last 64 bytes, so hashing starts 64 bytes
+ * before the minimum chunk size.
+ */
+void chunk_flow::consume(const uint8_t *data,size_t len)
+{
+    const uint32_t min_chunk = store.min_chunk;
+    const uint32_t max_chunk = store.max_chunk;
+    const uint64_t mask      = store.mask;
+    while(len>0){
+        const size_t have = chunk.size();
+        size_t i = 0;
+        bool cut = false;
+        for(;i<len;i++){
+            size_t n = have+i+1;        // chunk length including this byte
+            if(n+64 <= min_chunk) continue;
+            hash = (hash << 1) + gear[data[i]];
+            if((n>=min_chunk && (hash & mask)==0) || n>=max_chunk){
+                i++;
+                cut = true;
+                break;
+            }
+        }
+        chunk.insert(chunk.end(),data,data+i);
+        if(cut){
+            store.put_chunk(this);
+            chunk.clear();
+            hash = 0;
+        }
+        data += i;
+        len  -= i;
+    }
+}
+
+chunk_store::chunk_store(const std::string &outdir,uint32_t avg_chunk):
+    dir(outdir + "/chunks"),min_chunk(),max_chunk(),mask(),
+    logical_bytes(0),stored_bytes(0),chunks(0),unique_chunks(0),
+    index(),pack_tail(0),pack(0),recipes(0)
+{
+    /* round the average down to a power of two; the mask has that many low bits */
+    uint32_t avg = 64;
+    while(avg*2 <= avg_chunk && avg < (1U<<24)) avg *= 2;
+    mask      = avg-1;
+    min_chunk = avg/4;
+    max_chunk = avg*8;
+    init_gear();
+
+    if(MKDIR(dir.c_str(),0777) && errno!=EEXIST){
+        die("cannot create %s: %s",dir.c_str(),strerror(errno));
+    }
+    std::string pack_name = dir + "/pack";
+    pack = fopen(pack_name.c_str(),"w+b");
+    if(pack==0) die("cannot create %s: %s",pack_name.c_str(),strerror(errno));
+    setvbuf(pack,0,_IOFBF,1024*1024);
+    std::string recipes_name = dir + "/recipes";
+    recipes = fopen(recipes_name.c_str(),"wb");
+    if(recipes==0) die("cannot create %s: %s",recipes_name.c_str(),strerror(errno));
+}
+
+chunk_store::~chunk_store()
+{
+    close();
+}
+
+chunk_flow *chunk_store::state(tcpip *tcp)
+{
+    if(tcp->chunk_state==0) tcp->chunk_state = new chunk_flow(*this);
+    return tcp->chunk_state;
+}
+
+void chunk_store::put_chunk(chunk_flow *cf)
+{
+    const uint32_t len = cf->chunk.size();
+    if(len==0) return;
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    const sha256_t digest = sha256_generator::hash_buf(&cf->chunk[0],len);
+    const std::string key(reinterpret_cast<const char *>(digest.digest),sizeof(digest.digest));
+#else
+    assert(0);                          // tcpflow.cpp refuses -S chunk_store=1 without a digest
+    return;
+#endif
+
+    chunks++;
+    logical_bytes += len;
+    chunk_map_t::const_iterator it = index.find(key);
+    if(it!=index.end()){
+        cf->refs.push_back(chunk_ref(it->second,len));
+        return;
+    }
+    /* A new chunk; always appended, so the file position is the tail. If it
+     * can't be written, neither can what was buffered before it, and the
+     * recipes would rebuild flows with bytes missing, so give up.
+     */
+    if(fwrite(&cf->chunk[0],1,len,pack)!=len){
+        die("write to %s/pack failed: %s",dir.c_str(),strerror(errno));
+    }
+    index[key] = pack_tail;
+    cf->refs.push_back(chunk_ref(pack_tail,len));
+    pack_tail     += len;
+    stored_bytes  += len;
+    unique_chunks++;
+}
+
+void chunk_store::write(tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset)
+{
+    state(tcp)->sequence(data,len,offset);
+}
+
+void chunk_store::shift(tcpip *tcp,uint32_t inslen)
+{
+    state(tcp)->shift(inslen);
+}
+
+void chunk_store::complete(tcpip *tcp)
+{
+    chunk_flow *cf = tcp->chunk_state;
+    if(cf==0) return;
+    cf->drain(true);
+    put_chunk(cf);                      // the tail of the flow is the last chunk
+    cf->chunk.clear();
+    cf->hash = 0;
+}
+
+/* Read the flow back out of the pack; the sbuf owns the buffer */
+sbuf_t *chunk_store::read_flow(tcpip *tcp)
+{
+    chunk_flow *cf = tcp->chunk_state;
+    if(cf==0) return 0;
+    complete(tcp);
+    if(fflush(pack)) die("write to %s/pack failed: %s",dir.c_str(),strerror(errno));
+
+    uint64_t size = 0;
+    for(std::vector<chunk_ref>::const_iterator it=cf->refs.begin();it!=cf->refs.end();it++){
+        size += it->len;
+    }
+    if(size==0) return 0;
+    uint8_t *buf = (uint8_t *)malloc(size);
+    if(buf==0) return 0;
+
+    uint64_t pos = 0;
+    int fd = fileno(pack);
+    for(std::vector<chunk_ref>::const_iterator it=cf->refs.begin();it!=cf->refs.end();it++){
+        if(pread(fd,buf+pos,it->len,it->pack_offset)!=(ssize_t)it->len){
+            DEBUG(1)("short read from %s/pack",dir.c_str());
+        }
+        pos += it->len;
+    }
+    return new sbuf_t(pos0_t(tcp->flow_pathname),buf,size,size,true);
+}
+
+void chunk_store::finish(tcpip *tcp)
+{
+    chunk_flow *cf = tcp->chunk_state;
+    if(cf==0) return;
+    complete(tcp);
+    std::string rec;
+    put64(rec,tcp->myflow.id);
+    put64(rec,tcp->last_byte);
+    put32(rec,tcp->flow_pathname.size());
+    put32(rec,cf->refs.size());
+    rec.append(tcp->flow_pathname);
+    for(std::vector<chunk_ref>::const_iterator it=cf->refs.begin();it!=cf->refs.end();it++){
+        put64(rec,it->pack_offset);
+        put32(rec,it->len);
+    }
+    if(fwrite(rec.data(),1,rec.size(),recipes)!=rec.size()){
+        DEBUG(1)("write to %s/recipes failed: %s",dir.c_str(),strerror(errno));
+    }
+    delete cf;
+    tcp->chunk_state = 0;
+}
+
+void chunk_store::close()
+{
+    if(pack){
+        FILE *f = pack;
+        pack = 0;
+        if(fclose(f)) die("write to %s/pack failed: %s",dir.c_str(),strerror(errno));
+    }
+    if(recipes){
+        fclose(recipes);
+        recipes = 0;
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * chunk_store.h:
+ *
+ * A deduplicating output store (-S chunk_store=1). The contiguous data
+ * of each flow is cut into chunks at content-defined boundaries found
+ * with a gear rolling hash, so the same payload produces the same chunks
+ * wherever it starts in a flow. Each distinct chunk, identified by its
+ * SHA-256, is stored once (so chunk_store needs OpenSSL):
+ *
+ *    outdir/chunks/pack        the distinct chunks, back to back
+ *    outdir/chunks/recipes     one record per finished flow
+ *
+ * A recipe record is:
+ *
+ *    uint64 flow_id            same as flow_id= in the DFXML <tcpflow> element
+ *    uint64 filesize           as reported in the DFXML <filesize>
+ *    uint32 name_len
+ *    uint32 chunk_count
+ *    char   name[name_len]     the name the flow file would have had
+ *    chunk_count times:
+ *       uint64 pack_offset
+ *       uint32 len
+ *
+ * All integers are little-endian. The chunks, concatenated, are the flow.
+ * python/tcpflow_chunks.py lists the recipes and reconstitutes flows.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "flow_sequencer.h"
+
+#if defined(HAVE_UNORDERED_MAP)
+# include <unordered_map>
+#elif defined(HAVE_TR1_UNORDERED_MAP)
+# include <tr1/unordered_map>
+#endif
+
+class chunk_ref {
+public:
+    chunk_ref(uint64_t pack_offset_,uint32_t len_):pack_offset(pack_offset_),len(len_){}
+    uint64_t pack_offset;
+    uint32_t len;
+};
+
+/* Per-flow chunker; hangs off tcpip::chunk_state */
+class chunk_flow : public flow_sequencer {
+    /* These are not implemented */
+    chunk_flow(const chunk_flow &);
+    chunk_flow &operator=(const chunk_flow &);
+
+public:
+    chunk_flow(class chunk_store &store_):store(store_),chunk(),hash(0),refs(){}
+    class chunk_store &store;
+    std::vector<uint8_t> chunk;         // the chunk being accumulated
+    uint64_t hash;                      // gear hash of the end of chunk
+    std::vector<chunk_ref> refs;        // the flow so far
+
+protected:
+    virtual void consume(const uint8_t *data,size_t len);
+};
+
+class chunk_store {
+    /* These are not implemented */
+    chunk_store(const chunk_store &);
+    chunk_store &operator=(const chunk_store &);
+
+#ifdef HAVE_TR1_UNORDERED_MAP
+    typedef std::tr1::unordered_map<std::string,uint64_t> chunk_map_t; // digest -> pack offset
+#else
+    typedef std::unordered_map<std::string,uint64_t> chunk_map_t;
+#endif
+
+public:
+    enum { DEFAULT_AVG_CHUNK=8192 };    // min is 1/4 of it and max 8 times it
+
+    chunk_store(const std::string &outdir,uint32_t avg_chunk);
+    virtual ~chunk_store();
+
+    void write(class tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset);
+    void shift(class tcpip *tcp,uint32_t inslen); // bytes were inserted before the start of the flow
+    void complete(class tcpip *tcp);    // chunk everything staged, filling gaps with zeros
+    class sbuf_t *read_flow(class tcpip *tcp); // reassemble the flow in memory for post-processing
+    void finish(class tcpip *tcp);      // write the recipe and forget the flow
+    void put_chunk(chunk_flow *cf);     // called by the chunker at each boundary
+    void close();
+
+    std::string dir;                    // where the pack and recipes are written
+    uint32_t min_chunk;
+    uint32_t max_chunk;
+    uint64_t mask;                      // a boundary is where (hash & mask)==0
+    uint64_t logical_bytes;             // statistics: bytes in all the flows
+    uint64_t stored_bytes;              // bytes in the pack
+    uint64_t chunks;                    // chunk references
+    uint64_t unique_chunks;             // chunks in the pack
+
+private:
+    chunk_map_t index;
+    uint64_t    pack_tail;
+    FILE        *pack;
+    FILE        *recipes;
+
+    chunk_flow *state(class tcpip *tcp);
+};
+
+#endif
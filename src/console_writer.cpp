@@ -0,0 +1,159 @@
+/*
+ * console_writer.cpp:
+ *
+ * See console_writer.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "console_writer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* printable[] is for -c/-C/-s, where newlines pass through;
+ * dump_ascii[] is for the ASCII column of -D.
+ */
+static char printable[256];
+static char dump_ascii[256];
+static char hex_pairs[256][2];
+
+static void init_tables()
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    for(int i=0;i<256;i++){
+        printable[i]  = (isprint(i) || i=='\n' || i=='\r') ? (char)i : '.';
+        dump_ascii[i] = (i>=' ' && i<='~') ? (char)i : '.';
+        hex_pairs[i][0] = hexdigits[i>>4];
+        hex_pairs[i][1] = hexdigits[i&15];
+    }
+}
+
+console_writer::console_writer(size_t batch_bytes_,uint32_t flush_ms_):
+    writes(0),buf(),batch_bytes(batch_bytes_),flush_ms(flush_ms_),last_flush()
+{
+    init_tables();
+    buf.reserve(batch_bytes + 65536);
+    gettimeofday(&last_flush,0);
+}
+
+console_writer::~console_writer()
+{
+    flush();
+}
+
+void console_writer::append_printable(const uint8_t *data,size_t len)
+{
+    size_t start = buf.size();
+    buf.resize(start+len);
+    char *out = &buf[start];
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Runs of 16 bytes in ' '..'~' are copied as they are */
+    const __m128i lo = _mm_set1_epi8(0x1f);
+    const __m128i hi = _mm_set1_epi8(0x7f);
+    for(;i+16<=len;i+=16){
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v,lo),_mm_cmplt_epi8(v,hi));
+        if(_mm_movemask_epi8(ok)==0xffff){
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out+i),v);
+        } else {
+            for(size_t j=i;j<i+16;j++) out[j] = printable[data[j]];
+        }
+    }
+#endif
+    for(;i<len;i++) out[i] = printable[data[i]];
+}
+
+void console_writer::append_hex(const uint8_t *data,size_t len)
+{
+    const size_t bytes_per_line = 32;
+    size_t max_spaces = 0;
+    char line[128];
+    for(size_t i=0;i<len;i+=bytes_per_line){
+        char *p = line;
+        /* the offset */
+        if(i<0x10000){
+            *p++ = hex_pairs[(i>>8)&0xff][0];
+            *p++ = hex_pairs[(i>>8)&0xff][1];
+            *p++ = hex_pairs[i&0xff][0];
+            *p++ = hex_pairs[i&0xff][1];
+            *p++ = ':';
+            *p++ = ' ';
+        } else {
+            p += snprintf(p,sizeof(line),"%04x: ",(int)i);
+        }
+        /* the hex bytes, a space after each pair */
+        size_t n = len-i < bytes_per_line ? len-i : bytes_per_line;
+        for(size_t j=0;j<n;j++){
+            const char *h = hex_pairs[data[i+j]];
+            *p++ = h[0];
+            *p++ = h[1];
+            if(j%2==1) *p++ = ' ';
+        }
+        /* space out to where the ASCII region is */
+        size_t spaces = p-line;
+        if(spaces>max_spaces) max_spaces=spaces;
+        for(;spaces<max_spaces;spaces++) *p++ = ' ';
+        *p++ = ' ';
+        buf.append(line,p-line);
+        /* the ascii */
+        size_t start = buf.size();
+        buf.resize(start+n+1);
+        for(size_t j=0;j<n;j++) buf[start+j] = dump_ascii[data[i+j]];
+        buf[start+n] = '\n';
+    }
+}
+
+void console_writer::end_packet()
+{
+    if(buf.size() >= batch_bytes){
+        flush();
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now,0);
+    int64_t ms = (int64_t)(now.tv_sec - last_flush.tv_sec)*1000 + (now.tv_usec - last_flush.tv_usec)/1000;
+    if(ms >= flush_ms) flush();
+}
+
+void console_writer::flush()
+{
+    gettimeofday(&last_flush,0);
+    if(buf.size()==0) return;
+    fflush(stdout);                     // anything printed with stdio goes first
+
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_wait(semlock)){
+	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+    const char *p = buf.data();
+    size_t len = buf.size();
+    while(len>0){
+        ssize_t r = ::write(fileno(stdout),p,len);
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0){
+            std::cerr << "\nwrite error to stdout: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        p   += r;
+        len -= r;
+    }
+    writes++;
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_post(semlock)){
+	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+    buf.clear();
+}
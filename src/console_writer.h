@@ -0,0 +1,50 @@
+/*
+ * console_writer.h:
+ *
+ * Console output for -c, -C, -s and -D. Packets are formatted into one
+ * buffer with table-driven (and, where available, SSE2) kernels, and the
+ * buffer is written to stdout with a single write() per batch. A batch
+ * ends when it reaches batch_bytes or when flush_ms have passed since
+ * the last write. The -L semaphore is held only around that write().
+ *
+ * tcpflow is single-threaded, so there is one writer and one buffer.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef CONSOLE_WRITER_H
+#define CONSOLE_WRITER_H
+
+#include <string>
+
+class console_writer {
+    /* These are not implemented */
+    console_writer(const console_writer &);
+    console_writer &operator=(const console_writer &);
+
+public:
+    enum { DEFAULT_BATCH=1024*1024,     // bytes; 0 writes every packet at once
+           DEFAULT_FLUSH_MS=100 };
+
+    console_writer(size_t batch_bytes,uint32_t flush_ms);
+    virtual ~console_writer();
+
+    void append(const char *s,size_t len){ buf.append(s,len); }
+    void append(const std::string &s){ buf.append(s); }
+    void append(char ch){ buf.push_back(ch); }
+    void append_printable(const uint8_t *data,size_t len); // unprintable bytes become '.'
+    void append_hex(const uint8_t *data,size_t len);       // the -D dump
+    void end_packet();                  // flush if the batch is full or old enough
+    void flush();
+
+    uint64_t writes;                    // statistics
+
+private:
+    std::string buf;
+    size_t   batch_bytes;
+    uint32_t flush_ms;
+    struct timeval last_flush;
+};
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * container_store.cpp:
+ *
+ * Log-structured output store. See container_store.h for the layout.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "container_store.h"
+
+/* little-endian encoding for the index */
+static void put32(std::string &s,uint32_t v)
+{
+    for(int i=0;i<4;i++) s.push_back((char)((v >> (i*8)) & 0xff));
+}
+
+static void put64(std::string &s,uint64_t v)
+{
+    for(int i=0;i<8;i++) s.push_back((char)((v >> (i*8)) & 0xff));
+}
+
+container_store::container_store(const std::string &outdir,uint64_t segment_size_,uint32_t buffer_size_):
+    dir(outdir + "/container"),extents_written(0),bytes_written(0),
+    segment_size(segment_size_),buffer_size(buffer_size_),
+    segment_number(0),segment_tail(0),segment(0),index(0)
+{
+    if(MKDIR(dir.c_str(),0777) && errno!=EEXIST){
+        die("cannot create %s: %s",dir.c_str(),strerror(errno));
+    }
+    std::string index_name = dir + "/index";
+    index = fopen(index_name.c_str(),"wb");
+    if(index==0) die("cannot create %s: %s",index_name.c_str(),strerror(errno));
+    open_segment(0);
+}
+
+container_store::~container_store()
+{
+    close();
+}
+
+std::string container_store::segment_name(uint32_t n) const
+{
+    return dir + ssprintf("/segment-%06u",n);
+}
+
+void container_store::open_segment(uint32_t n)
+{
+    if(segment) fclose(segment);
+    std::string name = segment_name(n);
+    segment = fopen(name.c_str(),"wb");
+    if(segment==0) die("cannot create %s: %s",name.c_str(),strerror(errno));
+    setvbuf(segment,0,_IOFBF,1024*1024); // extents are small; let stdio batch them
+    segment_number = n;
+    segment_tail   = 0;
+    DEBUG(5)("%s: new container segment",name.c_str());
+}
+
+container_flow *container_store::state(tcpip *tcp)
+{
+    if(tcp->container_state==0) tcp->container_state = new container_flow();
+    return tcp->container_state;
+}
+
+/* Append data to the current segment and record it as an extent of the flow.
+ * If it continues the flow's previous extent in the same segment, that extent grows.
+ */
+void container_store::append_extent(container_flow *cf,const uint8_t *data,uint32_t len,uint64_t flow_offset)
+{
+    if(len==0) return;
+    if(segment_tail>0 && segment_tail+len > segment_size) open_segment(segment_number+1);
+    if(fwrite(data,1,len,segment)!=len){
+        DEBUG(1)("write to %s failed: %s",segment_name(segment_number).c_str(),strerror(errno));
+        return;
+    }
+    if(cf->extents.size()>0){
+        container_extent &last = cf->extents.back();
+        if(last.segment==segment_number &&
+           last.segment_offset+last.len==segment_tail &&
+           last.flow_offset+last.len==flow_offset &&
+           (uint64_t)last.len+len <= 0xffffffffULL){
+            last.len     += len;
+            segment_tail += len;
+            bytes_written += len;
+            return;
+        }
+    }
+    cf->extents.push_back(container_extent(segment_number,len,segment_tail,flow_offset));
+    segment_tail += len;
+    bytes_written += len;
+    extents_written++;
+}
+
+void container_store::write(tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset)
+{
+    container_flow *cf = state(tcp);
+    if(cf->staged.size()>0 &&
+       offset==cf->staged_offset+cf->staged.size() &&
+       cf->staged.size()+len <= buffer_size){
+        cf->staged.insert(cf->staged.end(),data,data+len);
+        return;
+    }
+    flush(tcp);
+    if(len>=buffer_size){
+        append_extent(cf,data,len,offset);
+        return;
+    }
+    cf->staged.assign(data,data+len);
+    cf->staged_offset = offset;
+}
+
+void container_store::shift(tcpip *tcp,uint32_t inslen)
+{
+    container_flow *cf = state(tcp);
+    for(std::vector<container_extent>::iterator it=cf->extents.begin();it!=cf->extents.end();it++){
+        it->flow_offset += inslen;
+    }
+    cf->staged_offset += inslen;
+}
+
+void container_store::flush(tcpip *tcp)
+{
+    container_flow *cf = tcp->container_state;
+    if(cf==0 || cf->staged.size()==0) return;
+    append_extent(cf,&cf->staged[0],cf->staged.size(),cf->staged_offset);
+    cf->staged.clear();
+}
+
+void container_store::finish(tcpip *tcp)
+{
+    container_flow *cf = tcp->container_state;
+    if(cf==0) return;
+    flush(tcp);
+    std::string rec;
+    put64(rec,tcp->myflow.id);
+    put64(rec,tcp->last_byte);
+    put32(rec,tcp->flow_pathname.size());
+    put32(rec,cf->extents.size());
+    rec.append(tcp->flow_pathname);
+    for(std::vector<container_extent>::const_iterator it=cf->extents.begin();it!=cf->extents.end();it++){
+        put32(rec,it->segment);
+        put32(rec,it->len);
+        put64(rec,it->segment_offset);
+        put64(rec,it->flow_offset);
+    }
+    if(fwrite(rec.data(),1,rec.size(),index)!=rec.size()){
+        DEBUG(1)("write to %s/index failed: %s",dir.c_str(),strerror(errno));
+    }
+    delete cf;
+    tcp->container_state = 0;
+}
+
+/* Read the flow back out of the segments; the sbuf owns the buffer */
+sbuf_t *container_store::read_flow(tcpip *tcp)
+{
+    container_flow *cf = tcp->container_state;
+    if(cf==0) return 0;
+    flush(tcp);
+    fflush(segment);
+
+    uint64_t size = 0;
+    for(std::vector<container_extent>::const_iterator it=cf->extents.begin();it!=cf->extents.end();it++){
+        if(it->flow_offset+it->len > size) size = it->flow_offset+it->len;
+    }
+    if(size==0) return 0;
+    uint8_t *buf = (uint8_t *)calloc(size,1);
+    if(buf==0) return 0;
+
+    int fd = -1;
+    uint32_t fd_segment = 0;
+    for(std::vector<container_extent>::const_iterator it=cf->extents.begin();it!=cf->extents.end();it++){
+        if(fd<0 || it->segment!=fd_segment){
+            if(fd>=0) ::close(fd);
+            fd = ::open(segment_name(it->segment).c_str(),O_RDONLY|O_BINARY);
+            fd_segment = it->segment;
+            if(fd<0) break;
+        }
+        if(pread(fd,buf+it->flow_offset,it->len,it->segment_offset)!=(ssize_t)it->len){
+            DEBUG(1)("short read from %s",segment_name(it->segment).c_str());
+        }
+    }
+    if(fd>=0) ::close(fd);
+    return new sbuf_t(pos0_t(tcp->flow_pathname),buf,size,size,true);
+}
+
+void container_store::close()
+{
+    if(segment){
+        fclose(segment);
+        segment = 0;
+    }
+    if(index){
+        fclose(index);
+        index = 0;
+    }
+}
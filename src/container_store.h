@@ -0,0 +1,100 @@
+/*
+ * container_store.h:
+ *
+ * A log-structured output store. Instead of one file per flow, the
+ * reassembled data of every flow is appended to a small number of
+ * large segment files as extents:
+ *
+ *    outdir/container/segment-000000
+ *    outdir/container/segment-000001
+ *    ...
+ *    outdir/container/index
+ *
+ * Nothing is ever seeked or shifted. Out-of-order data simply becomes
+ * another extent, and data that arrives before the start of the flow
+ * moves the flow offsets of the extents already recorded.
+ *
+ * When a flow is finished its index record is appended to the index:
+ *
+ *    uint64 flow_id            same as flow_id= in the DFXML <tcpflow> element
+ *    uint64 filesize           as reported in the DFXML <filesize>
+ *    uint32 name_len
+ *    uint32 extent_count
+ *    char   name[name_len]     the name the flow file would have had
+ *    extent_count times:
+ *       uint32 segment
+ *       uint32 len
+ *       uint64 segment_offset
+ *       uint64 flow_offset
+ *
+ * All integers are little-endian. Later extents overwrite earlier ones.
+ * python/tcpflow_container.py lists the index and materializes flows.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef CONTAINER_STORE_H
+#define CONTAINER_STORE_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+class container_extent {
+public:
+    container_extent(uint32_t segment_,uint32_t len_,uint64_t segment_offset_,uint64_t flow_offset_):
+        segment(segment_),len(len_),segment_offset(segment_offset_),flow_offset(flow_offset_){}
+    uint32_t segment;
+    uint32_t len;
+    uint64_t segment_offset;
+    uint64_t flow_offset;
+};
+
+/* Per-flow state; hangs off tcpip::container_state */
+class container_flow {
+public:
+    container_flow():extents(),staged(),staged_offset(0){}
+    std::vector<container_extent> extents;
+    std::vector<uint8_t> staged;        // contiguous data not yet appended to a segment
+    uint64_t staged_offset;             // flow offset of staged[0]
+};
+
+class container_store {
+    /* These are not implemented */
+    container_store(const container_store &);
+    container_store &operator=(const container_store &);
+
+public:
+    enum { DEFAULT_SEGMENT_MB=1024,
+           DEFAULT_BUFFER=16384 };      // per-flow staging buffer
+
+    container_store(const std::string &outdir,uint64_t segment_size,uint32_t buffer_size);
+    virtual ~container_store();
+
+    void write(class tcpip *tcp,const uint8_t *data,uint32_t len,uint64_t offset);
+    void shift(class tcpip *tcp,uint32_t inslen); // bytes were inserted before the start of the flow
+    void flush(class tcpip *tcp);       // append the staged data to the current segment
+    void finish(class tcpip *tcp);      // write the index record and forget the flow
+    class sbuf_t *read_flow(class tcpip *tcp); // reassemble the flow in memory for post-processing
+    void close();
+
+    std::string dir;                    // where the segments and index are written
+    uint64_t extents_written;           // statistics
+    uint64_t bytes_written;
+
+private:
+    uint64_t    segment_size;
+    uint32_t    buffer_size;
+    uint32_t    segment_number;         // current segment
+    uint64_t    segment_tail;           // bytes in current segment
+    FILE        *segment;
+    FILE        *index;
+
+    container_flow *state(class tcpip *tcp);
+    std::string segment_name(uint32_t n) const;
+    void open_segment(uint32_t n);
+    void append_extent(container_flow *cf,const uint8_t *data,uint32_t len,uint64_t flow_offset);
+};
+
+#endif
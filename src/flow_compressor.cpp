@@ -0,0 +1,227 @@
+/*
+ * flow_compressor.cpp:
+ *
+ * Streaming compression of flow files. See flow_compressor.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_compressor.h"
+
+#ifdef HAVE_LIBZ
+#  ifdef GNUC_HAS_DIAGNOSTIC_PRAGMA
+#    pragma GCC diagnostic ignored "-Wundef"
+#    pragma GCC diagnostic ignored "-Wcast-qual"
+#  endif
+#  ifdef HAVE_ZLIB_H
+#    include <zlib.h>
+#  endif
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD
+#include <zstd.h>
+#endif
+
+flow_compressor::method_t flow_compressor::method_for(const std::string &name)
+{
+#ifdef HAVE_LIBZ
+    if(name=="gzip") return GZIP;
+#endif
+#ifdef USE_ZSTD
+    if(name=="zstd") return ZSTD;
+#endif
+    return NONE;
+}
+
+const char *flow_compressor::method_name(method_t m)
+{
+    switch(m){
+    case GZIP: return "gzip";
+    case ZSTD: return "zstd";
+    default:   return "none";
+    }
+}
+
+flow_compressor::flow_compressor(method_t m,int level):
+    method(m),uncompressed_bytes(0),compressed_bytes(0),
+    out_fd(-1),finished(false),outbuf(BUFSIZE),zs(0),zcs(0)
+{
+#ifdef HAVE_LIBZ
+    if(method==GZIP){
+        zs = new z_stream();
+        memset(zs,0,sizeof(*zs));
+        /* 16+MAX_WBITS asks for a gzip header and trailer */
+        if(deflateInit2(zs,level<0 ? Z_DEFAULT_COMPRESSION : level,Z_DEFLATED,16+MAX_WBITS,8,Z_DEFAULT_STRATEGY)!=Z_OK){
+            DEBUG(1)("deflateInit2 failed");
+            delete zs;
+            zs = 0;
+        }
+    }
+#endif
+#ifdef USE_ZSTD
+    if(method==ZSTD){
+        zcs = ZSTD_createCStream();
+        if(zcs) ZSTD_initCStream(zcs,level<0 ? 3 : level);
+    }
+#endif
+}
+
+flow_compressor::~flow_compressor()
+{
+#ifdef HAVE_LIBZ
+    if(zs){
+        deflateEnd(zs);
+        delete zs;
+    }
+#endif
+#ifdef USE_ZSTD
+    if(zcs) ZSTD_freeCStream(zcs);
+#endif
+}
+
+void flow_compressor::emit(const uint8_t *data,size_t len)
+{
+    while(len>0){
+        ssize_t r = ::write(out_fd,data,len);
+        if(r<=0){
+            DEBUG(1)("write of compressed data failed: %s",strerror(errno));
+            return;
+        }
+        compressed_bytes += r;
+        data += r;
+        len  -= r;
+    }
+}
+
+void flow_compressor::compress(const uint8_t *data,size_t len,bool end)
+{
+    uncompressed_bytes += len;
+#ifdef HAVE_LIBZ
+    if(zs){
+        zs->next_in  = (Bytef *)data;
+        zs->avail_in = len;
+        do {
+            zs->next_out  = &outbuf[0];
+            zs->avail_out = outbuf.size();
+            if(deflate(zs,end ? Z_FINISH : Z_NO_FLUSH)==Z_STREAM_ERROR) return;
+            emit(&outbuf[0],outbuf.size()-zs->avail_out);
+        } while(zs->avail_out==0);
+    }
+#endif
+#ifdef USE_ZSTD
+    if(zcs){
+        ZSTD_inBuffer in = {data,len,0};
+        while(true){
+            ZSTD_outBuffer out = {&outbuf[0],outbuf.size(),0};
+            size_t remaining = ZSTD_compressStream2(zcs,&out,&in,end ? ZSTD_e_end : ZSTD_e_continue);
+            if(ZSTD_isError(remaining)){
+                DEBUG(1)("zstd: %s",ZSTD_getErrorName(remaining));
+                return;
+            }
+            emit(&outbuf[0],out.pos);
+            if(end ? remaining==0 : in.pos==in.size) break;
+        }
+    }
+#endif
+}
+
+void flow_compressor::consume(const uint8_t *data,size_t len)
+{
+    compress(data,len,false);
+}
+
+void flow_compressor::write(int fd,const uint8_t *data,uint32_t len,uint64_t offset)
+{
+    if(finished) return;
+    out_fd = fd;
+    sequence(data,len,offset);
+}
+
+void flow_compressor::finish(int fd)
+{
+    if(finished) return;
+    out_fd = fd;
+    drain(true);
+    compress(0,0,true);
+    finished = true;
+}
+
+sbuf_t *flow_compressor::decompress_file(const std::string &path,int fd,method_t m)
+{
+    struct stat st;
+    if(fstat(fd,&st)) return 0;
+    std::vector<uint8_t> in(st.st_size);
+    if(st.st_size==0 || pread(fd,&in[0],in.size(),0)!=(ssize_t)in.size()) return 0;
+
+    size_t cap = in.size()*4 + BUFSIZE;
+    size_t len = 0;
+    uint8_t *buf = (uint8_t *)malloc(cap);
+    if(buf==0) return 0;
+    bool ok = false;
+
+#ifdef HAVE_LIBZ
+    if(m==GZIP){
+        z_stream z;
+        memset(&z,0,sizeof(z));
+        if(inflateInit2(&z,16+MAX_WBITS)==Z_OK){
+            z.next_in  = (Bytef *)&in[0];
+            z.avail_in = in.size();
+            int r = Z_OK;
+            while(r==Z_OK){
+                if(len==cap){
+                    uint8_t *nbuf = (uint8_t *)realloc(buf,cap*2);
+                    if(nbuf==0) break;
+                    buf = nbuf;
+                    cap *= 2;
+                }
+                z.next_out  = buf+len;
+                z.avail_out = cap-len;
+                r = inflate(&z,Z_NO_FLUSH);
+                len = cap - z.avail_out;
+            }
+            ok = (r==Z_STREAM_END);
+            inflateEnd(&z);
+        }
+    }
+#endif
+#ifdef USE_ZSTD
+    if(m==ZSTD){
+        ZSTD_DStream *zds = ZSTD_createDStream();
+        if(zds){
+            ZSTD_initDStream(zds);
+            ZSTD_inBuffer zin = {&in[0],in.size(),0};
+            ok = true;
+            /* Until the input is used up and the output has room to spare; a full output
+             * buffer may mean the decoder still holds more, even with no input left.
+             */
+            for(;;){
+                if(len==cap){
+                    uint8_t *nbuf = (uint8_t *)realloc(buf,cap*2);
+                    if(nbuf==0){ ok = false; break; }
+                    buf = nbuf;
+                    cap *= 2;
+                }
+                ZSTD_outBuffer zout = {buf+len,cap-len,0};
+                size_t r = ZSTD_decompressStream(zds,&zout,&zin);
+                if(ZSTD_isError(r)){
+                    DEBUG(1)("%s: %s",path.c_str(),ZSTD_getErrorName(r));
+                    ok = false;
+                    break;
+                }
+                len += zout.pos;
+                if(zin.pos==zin.size && zout.pos<zout.size) break;
+            }
+            ZSTD_freeDStream(zds);
+        }
+    }
+#endif
+    if(!ok || len==0){
+        DEBUG(1)("%s: cannot decompress for post-processing",path.c_str());
+        free(buf);
+        return 0;
+    }
+    return new sbuf_t(pos0_t(path),buf,len,len,true);
+}
@@ -0,0 +1,67 @@
+/*
+ * flow_compressor.h:
+ *
+ * Streaming compression of flow files (-S compress=gzip or zstd).
+ *
+ * Data is compressed as it becomes contiguous; flow_sequencer stages
+ * the out-of-order data until then.
+ *
+ * The compressed stream only needs the flow's fd while it produces
+ * output, so the file may be closed and reopened between writes.
+ * It is only ever appended to, so nothing may seek the fd.
+ *
+ * A packet that arrives after its flow was closed can't be compared with
+ * the compressed file. If it lies within the flow it is dropped as a
+ * retransmission; if it lies past the end it starts a new flow file.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef FLOW_COMPRESSOR_H
+#define FLOW_COMPRESSOR_H
+
+#include <string>
+#include <vector>
+
+#include "flow_sequencer.h"
+
+class flow_compressor : public flow_sequencer {
+    /* These are not implemented */
+    flow_compressor(const flow_compressor &);
+    flow_compressor &operator=(const flow_compressor &);
+
+public:
+    typedef enum { NONE=0, GZIP, ZSTD } method_t;
+    enum { BUFSIZE=65536 };
+
+    static method_t    method_for(const std::string &name); // NONE if unknown or not compiled in
+    static const char *method_name(method_t m);
+    /* Read and decompress a flow file into an sbuf that owns its buffer */
+    static class sbuf_t *decompress_file(const std::string &path,int fd,method_t m);
+
+    flow_compressor(method_t m,int level);
+    virtual ~flow_compressor();
+
+    void write(int fd,const uint8_t *data,uint32_t len,uint64_t offset);
+    void finish(int fd);                // compress what is staged, filling gaps with zeros, and end the stream
+
+    method_t method;
+    uint64_t uncompressed_bytes;        // statistics
+    uint64_t compressed_bytes;
+
+protected:
+    virtual void consume(const uint8_t *data,size_t len);
+
+private:
+    int      out_fd;                    // the flow's fd for the current write() or finish()
+    bool     finished;
+    std::vector<uint8_t> outbuf;
+    struct z_stream_s *zs;
+    struct ZSTD_CCtx_s *zcs;
+
+    void compress(const uint8_t *data,size_t len,bool end);
+    void emit(const uint8_t *data,size_t len);
+};
+
+#endif
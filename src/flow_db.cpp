@@ -0,0 +1,268 @@
+/*
+ * flow_db.cpp:
+ *
+ * See flow_db.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_db.h"
+
+const char *flow_db::DEFAULT_FILENAME = "flows.sqlite3";
+
+flow_db::flow_db(size_t batch_rows_,uint32_t batch_ms_,bool thread,size_t queue_max_):
+    rows(0),transactions(0),max_queued(0),stalls(0),batch(),batch_rows(batch_rows_>0 ? batch_rows_ : 1),batch_ms(batch_ms_),
+    last_flush(),fname(),failed(false)
+#ifdef USE_SQLITE3
+    ,db(0),insert(0)
+#endif
+#ifdef HAVE_PTHREAD
+    ,threaded(false),stopping(false),queue_max(queue_max_>0 ? queue_max_ : 1),queue(),M(),queued(),dequeued(),writer()
+#endif
+{
+    batch.reserve(batch_rows);
+    gettimeofday(&last_flush,0);
+#ifdef HAVE_PTHREAD
+    if(thread){
+        pthread_mutex_init(&M,NULL);
+        pthread_cond_init(&queued,NULL);
+        pthread_cond_init(&dequeued,NULL);
+        if(pthread_create(&writer,NULL,writer_main,this)){
+            DEBUG(1)("cannot create flow database writer thread: %s",strerror(errno));
+        } else {
+            threaded = true;
+        }
+    }
+#else
+    if(thread) DEBUG(1)("threads are not available; the flow database is written by the packet thread");
+#endif
+}
+
+flow_db::~flow_db()
+{
+    close();
+}
+
+bool flow_db::available()
+{
+#ifdef USE_SQLITE3
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool flow_db::exec(const char *sql)
+{
+#ifdef USE_SQLITE3
+    char *errmsg = 0;
+    if(sqlite3_exec(db,sql,0,0,&errmsg)!=SQLITE_OK){
+        DEBUG(1)("%s: %s: %s",fname.c_str(),sql,errmsg ? errmsg : sqlite3_errmsg(db));
+        sqlite3_free(errmsg);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool flow_db::open(const std::string &fname_,std::string &err)
+{
+    fname = fname_;
+#ifdef USE_SQLITE3
+    /* the writer thread is the only one that uses the connection once it is open */
+    if(sqlite3_open_v2(fname.c_str(),&db,SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX,0)!=SQLITE_OK){
+        err = fname + ": " + (db ? sqlite3_errmsg(db) : "cannot open");
+        sqlite3_close(db);
+        db = 0;
+        return false;
+    }
+    static const char *create =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=NORMAL;"
+        "CREATE TABLE IF NOT EXISTS connections ("
+        "starttime TEXT NOT NULL,"      // 2023-11-14T22:13:20.000001Z; always six digits, so they sort
+        "endtime TEXT NOT NULL,"
+        "src_ipn TEXT,"
+        "dst_ipn TEXT,"
+        "mac_daddr TEXT,"
+        "mac_saddr TEXT,"
+        "packets INTEGER,"
+        "srcport INTEGER,"
+        "dstport INTEGER,"
+        "hashdigest_md5 TEXT,"
+        "filename TEXT,"
+        "filesize INTEGER,"
+        "family INTEGER,"
+        "protocol TEXT,"
+        "flow_id INTEGER);";
+    static const char *insert_sql =
+        "INSERT INTO connections (starttime,endtime,src_ipn,dst_ipn,mac_daddr,mac_saddr,packets,srcport,dstport,"
+        "hashdigest_md5,filename,filesize,family,protocol,flow_id) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
+    if(!exec(create) || sqlite3_prepare_v2(db,insert_sql,-1,&insert,0)!=SQLITE_OK){
+        err = fname + ": " + sqlite3_errmsg(db);
+        sqlite3_close(db);
+        db = 0;
+        return false;
+    }
+    return true;
+#else
+    err = "tcpflow was built without SQLite";
+    return false;
+#endif
+}
+
+flow_db::row &flow_db::begin()
+{
+    batch.resize(batch.size()+1);
+    return batch.back();
+}
+
+void flow_db::end()
+{
+    rows++;
+    if(batch.size() >= batch_rows){
+        flush();
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now,0);
+    int64_t ms = (int64_t)(now.tv_sec - last_flush.tv_sec)*1000 + (now.tv_usec - last_flush.tv_usec)/1000;
+    if(ms >= batch_ms) flush();
+}
+
+void flow_db::flush()
+{
+    gettimeofday(&last_flush,0);
+    if(batch.size()==0) return;
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        batch_t *b = new batch_t();
+        b->reserve(batch_rows);
+        b->swap(batch);
+        pthread_mutex_lock(&M);
+        if(queue.size() >= queue_max){
+            /* Backpressure: wait for the writer thread rather than queue without limit */
+            stalls++;
+            while(queue.size() >= queue_max) pthread_cond_wait(&dequeued,&M);
+        }
+        queue.push_back(b);
+        if(queue.size()>max_queued) max_queued = queue.size();
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&M);
+        return;
+    }
+#endif
+    insert_batch(batch);
+}
+
+void flow_db::close()
+{
+    flush();
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&M);
+        stopping = true;
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&M);
+        pthread_join(writer,NULL);
+        pthread_cond_destroy(&dequeued);
+        pthread_cond_destroy(&queued);
+        pthread_mutex_destroy(&M);
+        threaded = false;
+    }
+#endif
+#ifdef USE_SQLITE3
+    if(db==0) return;
+    exec("CREATE INDEX IF NOT EXISTS connections_starttime ON connections(starttime);"
+         "CREATE INDEX IF NOT EXISTS connections_src ON connections(src_ipn,srcport);"
+         "CREATE INDEX IF NOT EXISTS connections_dst ON connections(dst_ipn,dstport);"
+         "CREATE INDEX IF NOT EXISTS connections_dstport ON connections(dstport);");
+    sqlite3_finalize(insert);
+    insert = 0;
+    if(sqlite3_close(db)!=SQLITE_OK) DEBUG(1)("%s: %s",fname.c_str(),sqlite3_errmsg(db));
+    db = 0;
+#endif
+}
+
+#ifdef USE_SQLITE3
+static void bind_text(sqlite3_stmt *s,int col,const std::string &v)
+{
+    if(v.size()==0) sqlite3_bind_null(s,col);
+    else sqlite3_bind_text(s,col,v.data(),v.size(),SQLITE_STATIC);
+}
+
+/* ISO 8601 with microseconds, as the table sorts them */
+static void bind_time(sqlite3_stmt *s,int col,const struct timeval &tv)
+{
+    char buf[64];
+    struct tm tm;
+    time_t t = tv.tv_sec;
+    gmtime_r(&t,&tm);
+    size_t len = strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%S",&tm);
+    len += snprintf(buf+len,sizeof(buf)-len,".%06dZ",(int)tv.tv_usec);
+    sqlite3_bind_text(s,col,buf,len,SQLITE_TRANSIENT);
+}
+#endif
+
+void flow_db::insert_batch(batch_t &b)
+{
+#ifdef USE_SQLITE3
+    if(db && exec("BEGIN")){
+        for(batch_t::const_iterator it=b.begin();it!=b.end();it++){
+            bind_time(insert,1,it->starttime);
+            bind_time(insert,2,it->endtime);
+            bind_text(insert,3,it->src_ipn);
+            bind_text(insert,4,it->dst_ipn);
+            bind_text(insert,5,it->mac_daddr);
+            bind_text(insert,6,it->mac_saddr);
+            sqlite3_bind_int64(insert,7,it->packets);
+            sqlite3_bind_int(insert,8,it->srcport);
+            sqlite3_bind_int(insert,9,it->dstport);
+            bind_text(insert,10,it->hashdigest_md5);
+            bind_text(insert,11,it->filename);
+            sqlite3_bind_int64(insert,12,it->filesize);
+            sqlite3_bind_int(insert,13,it->family);
+            bind_text(insert,14,it->protocol);
+            sqlite3_bind_int64(insert,15,it->flow_id);
+            if(sqlite3_step(insert)!=SQLITE_DONE && !failed){
+                DEBUG(1)("%s: insert: %s",fname.c_str(),sqlite3_errmsg(db));
+                failed = true;
+            }
+            sqlite3_reset(insert);
+        }
+        sqlite3_clear_bindings(insert);
+        if(exec("COMMIT")) transactions++;
+    }
+#endif
+    b.clear();
+}
+
+#ifdef HAVE_PTHREAD
+void *flow_db::writer_main(void *arg)
+{
+    static_cast<flow_db *>(arg)->run();
+    return 0;
+}
+
+/* Insert each batch that is handed over; the packet thread never waits for this */
+void flow_db::run()
+{
+    pthread_mutex_lock(&M);
+    for(;;){
+        while(queue.size()==0 && !stopping) pthread_cond_wait(&queued,&M);
+        if(queue.size()==0) break;      // stopping, and all inserted
+        batch_t *b = queue.front();
+        queue.pop_front();
+        pthread_cond_signal(&dequeued);
+        pthread_mutex_unlock(&M);
+        insert_batch(*b);
+        delete b;
+        pthread_mutex_lock(&M);
+    }
+    pthread_mutex_unlock(&M);
+}
+#endif
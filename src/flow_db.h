@@ -0,0 +1,116 @@
+/*
+ * flow_db.h:
+ *
+ * A row per flow in an SQLite database, the connections table, with
+ * -S flow_db=1. The packet thread only fills in a row; the rows are
+ * inserted with one prepared statement, batch_rows at a time or every
+ * batch_ms, each batch in one transaction, and the database is in WAL
+ * mode, so a crash loses at most the last batch and a reader can query
+ * the table while tcpflow writes it.
+ *
+ * With a writer thread the packet thread hands each batch over and goes
+ * on. At most queue_max batches wait for the writer; if SQLite falls that
+ * far behind, the packet thread waits for it, as post_pool does. The
+ * indexes on time, address and port are only created
+ * by close(), once every row is in, which is faster than keeping them up
+ * to date row by row.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef FLOW_DB_H
+#define FLOW_DB_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/time.h>
+
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#define USE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+class flow_db {
+    /* These are not implemented */
+    flow_db(const flow_db &);
+    flow_db &operator=(const flow_db &);
+
+public:
+    enum { DEFAULT_BATCH_ROWS=1000,
+           DEFAULT_BATCH_MS=1000,
+           DEFAULT_QUEUE_MAX=16 };        // batches
+    static const char *DEFAULT_FILENAME; // in the output directory
+
+    /* One flow; empty strings are NULL */
+    struct row {
+        row():filename(),filesize(0),starttime(),endtime(),src_ipn(),dst_ipn(),mac_daddr(),mac_saddr(),
+              packets(0),srcport(0),dstport(0),family(0),protocol(),flow_id(0),hashdigest_md5(){}
+        std::string filename;
+        uint64_t filesize;
+        struct timeval starttime;
+        struct timeval endtime;
+        std::string src_ipn;
+        std::string dst_ipn;
+        std::string mac_daddr;
+        std::string mac_saddr;
+        uint64_t packets;
+        uint16_t srcport;
+        uint16_t dstport;
+        uint8_t  family;
+        std::string protocol;
+        uint64_t flow_id;
+        std::string hashdigest_md5;
+    };
+
+    flow_db(size_t batch_rows,uint32_t batch_ms,bool thread,size_t queue_max);
+    virtual ~flow_db();                 // close()
+    static bool available();            // false if tcpflow was built without SQLite
+    bool open(const std::string &fname,std::string &err);
+
+    row &begin();                       // fill it in, then end()
+    void end();
+    void flush();                       // hand over the batch
+    void close();                       // insert the rest, create the indexes
+
+    uint64_t rows;                      // statistics
+    uint64_t transactions;
+    size_t   max_queued;                // batches waiting for the writer thread at most
+    uint64_t stalls;                    // flushes that waited for the writer thread
+
+private:
+    typedef std::vector<row> batch_t;
+    batch_t  batch;                     // the packet thread's
+    size_t   batch_rows;
+    uint32_t batch_ms;
+    struct timeval last_flush;
+    std::string fname;
+    bool     failed;                    // an insert failed; it was reported
+#ifdef USE_SQLITE3
+    sqlite3  *db;
+    sqlite3_stmt *insert;
+#endif
+    bool exec(const char *sql);         // reports any error
+    void insert_batch(batch_t &b);      // in one transaction, and empty it
+
+#ifdef HAVE_PTHREAD
+    bool threaded;
+    bool stopping;
+    size_t queue_max;
+    std::deque<batch_t *> queue;        // for the writer thread
+    pthread_mutex_t M;
+    pthread_cond_t  queued;
+    pthread_cond_t  dequeued;
+    pthread_t writer;
+    static void *writer_main(void *arg);
+    void run();
+#endif
+};
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * flow_report.cpp:
+ *
+ * See flow_report.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_report.h"
+
+flow_report::flow_report(dfxml_writer &xreport_,unsigned int depth,size_t batch_bytes_,uint32_t flush_ms_,bool thread):
+    indent(2*depth,' '),records(0),writes(0),xreport(xreport_),buf(),batch_bytes(batch_bytes_),flush_ms(flush_ms_),
+    last_flush(),cached_sec(0),cached_time()
+#ifdef HAVE_PTHREAD
+    ,threaded(false),stopping(false),pending(),out(),M(),out_ready(),out_done(),writer()
+#endif
+{
+    gettimeofday(&last_flush,0);
+#ifdef HAVE_PTHREAD
+    if(thread && batch_bytes>0){
+        pthread_mutex_init(&M,NULL);
+        pthread_cond_init(&out_ready,NULL);
+        pthread_cond_init(&out_done,NULL);
+        if(pthread_create(&writer,NULL,writer_main,this)){
+            DEBUG(1)("cannot create report writer thread: %s",strerror(errno));
+        } else {
+            threaded = true;
+            pending.reserve(batch_bytes + 65536);
+        }
+    }
+#else
+    if(thread) DEBUG(1)("threads are not available; the report is written by the packet thread");
+#endif
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        buf.reserve(65536);             // one <fileobject> at a time
+        return;
+    }
+#endif
+    buf.reserve(batch_bytes + 65536);
+}
+
+flow_report::~flow_report()
+{
+    close();
+}
+
+void flow_report::close()
+{
+    flush();
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&M);
+        stopping = true;
+        pthread_cond_signal(&out_ready);
+        pthread_mutex_unlock(&M);
+        pthread_join(writer,NULL);
+        pthread_cond_destroy(&out_done);
+        pthread_cond_destroy(&out_ready);
+        pthread_mutex_destroy(&M);
+        threaded = false;               // anything more is written by the caller
+    }
+#endif
+}
+
+void flow_report::end()
+{
+    records++;
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        /* the writer thread flushes pending once it is flush_ms old */
+        pthread_mutex_lock(&M);
+        bool was_empty = pending.size()==0;
+        pending.append(buf);
+        buf.clear();
+        if(pending.size() >= batch_bytes) hand_over();
+        else if(was_empty) pthread_cond_signal(&out_ready);
+        pthread_mutex_unlock(&M);
+        return;
+    }
+#endif
+    if(buf.size() >= batch_bytes){
+        flush();
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now,0);
+    int64_t ms = (int64_t)(now.tv_sec - last_flush.tv_sec)*1000 + (now.tv_usec - last_flush.tv_usec)/1000;
+    if(ms >= flush_ms) flush();
+}
+
+void flow_report::flush()
+{
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&M);
+        pending.append(buf);
+        buf.clear();
+        hand_over();
+        pthread_mutex_unlock(&M);
+        return;
+    }
+#endif
+    gettimeofday(&last_flush,0);
+    if(buf.size()==0) return;
+    write(buf);
+}
+
+/* dfxml_writer indents what it is given, and ends it with a newline */
+void flow_report::write(std::string &batch)
+{
+    size_t start = batch.compare(0,indent.size(),indent)==0 ? indent.size() : 0;
+    size_t len = batch.size()-start;
+    if(len>0 && batch[batch.size()-1]=='\n') len--;
+    xreport.xmlout("",batch.substr(start,len),"",false);
+    xreport.flush();
+    writes++;
+    batch.clear();
+}
+
+#ifdef HAVE_PTHREAD
+void *flow_report::writer_main(void *arg)
+{
+    static_cast<flow_report *>(arg)->run();
+    return 0;
+}
+
+/* With M held: give pending to the writer thread once it has written the last batch */
+void flow_report::hand_over()
+{
+    gettimeofday(&last_flush,0);
+    if(pending.size()==0) return;
+    while(out.size()>0) pthread_cond_wait(&out_done,&M);
+    out.swap(pending);                  // pending gets the writer's last, emptied, buffer
+    pthread_cond_signal(&out_ready);
+}
+
+/*
+ * Take each full buffer and write it while the packet thread fills the
+ * next. Take pending as well once it is flush_ms old, so the report keeps
+ * up when no flow closes to check the time.
+ */
+void flow_report::run()
+{
+    std::string batch;
+    pthread_mutex_lock(&M);
+    for(;;){
+        while(out.size()==0 && !stopping){
+            if(pending.size()==0 || flush_ms==0){
+                pthread_cond_wait(&out_ready,&M);
+                continue;
+            }
+            struct timeval now;
+            gettimeofday(&now,0);
+            int64_t ms = (int64_t)(now.tv_sec - last_flush.tv_sec)*1000 + (now.tv_usec - last_flush.tv_usec)/1000;
+            if(ms >= flush_ms){
+                out.swap(pending);
+                last_flush = now;
+                break;
+            }
+            struct timespec deadline;
+            uint64_t usec = (uint64_t)last_flush.tv_usec + (uint64_t)flush_ms*1000;
+            deadline.tv_sec  = last_flush.tv_sec + usec/1000000;
+            deadline.tv_nsec = (usec%1000000)*1000;
+            pthread_cond_timedwait(&out_ready,&M,&deadline);
+        }
+        if(out.size()==0) break;        // stopping, and all written
+        batch.swap(out);
+        pthread_cond_broadcast(&out_done);
+        pthread_mutex_unlock(&M);
+        write(batch);
+        pthread_mutex_lock(&M);
+    }
+    pthread_mutex_unlock(&M);
+}
+#endif
+
+void flow_report::append_time(std::string &s,const struct timeval &tv)
+{
+    if(tv.tv_sec!=cached_sec || cached_time.size()==0){
+        struct timeval whole = tv;
+        whole.tv_usec = 0;
+        std::string t = dfxml_writer::to8601(whole);
+        if(t.size()==0 || t[t.size()-1]!='Z'){ // not a format that can be spliced
+            s += dfxml_writer::to8601(tv);
+            return;
+        }
+        cached_time.assign(t,0,t.size()-1);
+        cached_sec = tv.tv_sec;
+    }
+    s += cached_time;
+    if(tv.tv_usec>0){
+        char usec[6];
+        uint32_t u = tv.tv_usec;
+        for(int i=5;i>=0;i--){
+            usec[i] = '0' + u%10;
+            u /= 10;
+        }
+        s += '.';
+        s.append(usec,6);
+    }
+    s += 'Z';
+}
+
+void flow_report::append_uint(std::string &s,uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v%10;
+        v /= 10;
+    } while(v);
+    while(n>0) s += digits[--n];
+}
+
+void flow_report::append_escaped(std::string &s,const std::string &v)
+{
+    if(v.find_first_of("<>&")==std::string::npos){
+        s += v;
+        return;
+    }
+    for(std::string::const_iterator it=v.begin();it!=v.end();it++){
+        switch(*it){
+        case '<': s += "&lt;"; break;
+        case '>': s += "&gt;"; break;
+        case '&': s += "&amp;"; break;
+        default:  s += *it;
+        }
+    }
+}
+
+void flow_report::append_ip(std::string &s,const uint8_t *addr,int family)
+{
+    if(family==AF_INET){
+        for(int i=0;i<4;i++){
+            if(i) s += '.';
+            append_uint(s,addr[i]);
+        }
+        return;
+    }
+    char addrbuf[INET6_ADDRSTRLEN];
+    if(inet_ntop(family,addr,addrbuf,sizeof(addrbuf))) s += addrbuf;
+}
+
+void flow_report::append_mac(std::string &s,const uint8_t *addr)
+{
+    static const char hexbuf[] = "0123456789abcdef";
+    for(int i=0;i<6;i++){
+        if(i) s += ':';
+        s += hexbuf[addr[i]>>4];
+        s += hexbuf[addr[i]&0x0f];
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * flow_report.h:
+ *
+ * The <fileobject>s of report.xml, batched. tcpip::dump_xml() formats
+ * each closed flow straight into one buffer, without streams: numbers
+ * and IPv4 addresses are formatted by hand, and a timestamp's date and
+ * time are made once per second. The buffer goes to the dfxml_writer in
+ * one piece, and is flushed, when it reaches batch_bytes or when flush_ms
+ * have passed since the last write, as console_writer does; so a crash
+ * loses at most that much of the report. With batch_bytes of 0 each
+ * <fileobject> is written and flushed as soon as it is made, as before.
+ *
+ * With a writer thread the packet thread only adds each <fileobject> to
+ * a pending buffer and swaps it over when it is full; the thread writes
+ * the full one while the next fills. If the thread falls a whole batch
+ * behind, the packet thread waits for it. The thread also writes pending
+ * once it is flush_ms old, so the time limit holds when no flow closes;
+ * without it the time is only checked as each <fileobject> is added.
+ * A live capture writes each <fileobject> at once unless asked to batch,
+ * and then always uses the thread.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef FLOW_REPORT_H
+#define FLOW_REPORT_H
+
+#include <stdint.h>
+#include <string>
+#include <sys/time.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+class flow_report {
+    /* These are not implemented */
+    flow_report(const flow_report &);
+    flow_report &operator=(const flow_report &);
+
+public:
+    enum { DEFAULT_BATCH=1024*1024,     // bytes; 0 writes every <fileobject> at once
+           DEFAULT_FLUSH_MS=1000 };
+
+    /* depth is how many elements the <fileobject>s are inside */
+    flow_report(class dfxml_writer &xreport,unsigned int depth,size_t batch_bytes,uint32_t flush_ms,bool thread);
+    virtual ~flow_report();             // close()
+
+    std::string &begin(){ return buf; } // append one <fileobject>, indented by indent
+    void end();                         // after it is appended
+    void flush();
+    void close();                       // write the rest and stop the thread
+
+    void append_time(std::string &s,const struct timeval &tv); // as dfxml_writer::to8601()
+    static void append_uint(std::string &s,uint64_t v);
+    static void append_escaped(std::string &s,const std::string &v);
+    static void append_ip(std::string &s,const uint8_t *addr,int family);
+    static void append_mac(std::string &s,const uint8_t *addr);
+
+    const std::string indent;           // of a <fileobject>
+    uint64_t records;                   // statistics
+    uint64_t writes;
+
+private:
+    class dfxml_writer &xreport;
+    std::string buf;                    // the packet thread's; with the writer thread, the <fileobject> being made
+    size_t   batch_bytes;
+    uint32_t flush_ms;
+    struct timeval last_flush;          // with the writer thread, under M
+    time_t   cached_sec;                // of cached_time
+    std::string cached_time;            // to8601() of cached_sec, without the Z; empty if to8601() has no Z
+
+    void write(std::string &batch);     // to xreport, and empty it
+#ifdef HAVE_PTHREAD
+    bool threaded;
+    bool stopping;
+    std::string pending;                // the <fileobject>s not handed over yet, under M
+    std::string out;                    // the writer thread's; empty when it is idle
+    pthread_mutex_t M;
+    pthread_cond_t  out_ready;
+    pthread_cond_t  out_done;
+    pthread_t writer;
+    static void *writer_main(void *arg);
+    void run();
+    void hand_over();                   // pending to out, with M held
+#endif
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * flow_sequencer.cpp:
+ *
+ * See flow_sequencer.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_sequencer.h"
+
+void flow_sequencer::consume_zeros(uint64_t len)
+{
+    gap(next,len);
+    zeroed.push_back(std::make_pair(next,next+len));
+    static const uint8_t zeros[65536] = {0};
+    while(len>0){
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        consume(zeros,n);
+        next += n;
+        len  -= n;
+    }
+}
+
+void flow_sequencer::drain(bool fill_gaps)
+{
+    while(staged.size()>0){
+        std::map<uint64_t,std::vector<uint8_t> >::iterator it = staged.begin();
+        if(it->first > next){
+            if(!fill_gaps) return;
+            DEBUG(10)("passing on a gap of %" PRId64 " bytes as zeros",(int64_t)(it->first-next));
+            consume_zeros(it->first-next);
+        }
+        uint64_t end = it->first + it->second.size();
+        if(end > next){
+            uint64_t skip = next - it->first;
+            consume(&it->second[skip],it->second.size()-skip);
+            next = end;
+        }
+        staged_bytes -= it->second.size();
+        staged.erase(it);
+    }
+}
+
+void flow_sequencer::sequence(const uint8_t *data,uint32_t len,uint64_t offset)
+{
+    if(len==0) return;
+    if(offset < next && zeroed.size()>0) note_late(offset,offset+len < next ? offset+len : next);
+    if(offset+len <= next){             // a retransmission of data already passed on
+        return;
+    }
+    if(offset < next){                  // partly old; pass on the new part
+        uint32_t skip = next - offset;
+        data   += skip;
+        len    -= skip;
+        offset  = next;
+    }
+    if(offset > next){
+        /* out of order; stage it, keeping the longer of two segments at the same offset */
+        std::vector<uint8_t> &s = staged[offset];
+        if(s.size() < len){
+            staged_bytes += len - s.size();
+            s.assign(data,data+len);
+        }
+        if(staged_bytes > MAX_STAGED){
+            DEBUG(2)("%" PRId64 " bytes staged; giving up on the gaps",(int64_t)staged_bytes);
+            drain(true);
+        }
+        return;
+    }
+    consume(data,len);
+    next += len;
+    drain(false);
+}
+
+/* Data arrived for [start,end), which was passed on already; count what fell in gaps */
+void flow_sequencer::note_late(uint64_t start,uint64_t end)
+{
+    for(std::vector<std::pair<uint64_t,uint64_t> >::const_iterator z=zeroed.begin();z!=zeroed.end();z++){
+        uint64_t lo = start > z->first  ? start : z->first;
+        uint64_t hi = end   < z->second ? end   : z->second;
+        if(lo >= hi) continue;
+        if(late_bytes==0 || lo < late_offset) late_offset = lo;
+        late_bytes += hi-lo;
+    }
+}
+
+void flow_sequencer::shift(uint32_t inslen)
+{
+    if(next==0 && staged.size()==0) return; // nothing yet; the new data will be the start
+    if(next>0){
+        /* The start of the stream is already passed on; the inserted bytes can't go before it */
+        DEBUG(2)("%u bytes before the start of a flow were dropped",inslen);
+        dropped_bytes += inslen;
+        next += inslen;
+        for(std::vector<std::pair<uint64_t,uint64_t> >::iterator z=zeroed.begin();z!=zeroed.end();z++){
+            z->first  += inslen;
+            z->second += inslen;
+        }
+        if(late_bytes>0) late_offset += inslen;
+    }
+    std::map<uint64_t,std::vector<uint8_t> > moved;
+    for(std::map<uint64_t,std::vector<uint8_t> >::iterator it=staged.begin();it!=staged.end();it++){
+        moved[it->first+inslen].swap(it->second);
+    }
+    staged.swap(moved);
+}
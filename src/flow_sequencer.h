@@ -0,0 +1,58 @@
+/*
+ * flow_sequencer.h:
+ *
+ * Turns the writes made by tcpip::store_packet(), which may arrive out
+ * of order, into a contiguous stream for output modes that can't seek:
+ * compression (flow_compressor.h) and chunking (chunk_store.h).
+ *
+ * Out-of-order data is staged until the gap before it is filled; if too
+ * much is staged the gap is given up and passed on as zeros, just as it
+ * would have been a hole in a flow file. Data that arrives for a range
+ * that has already been passed on is dropped; if the range was a gap, it
+ * is counted in late_bytes, as a flow file would have it but the stream
+ * did not.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef FLOW_SEQUENCER_H
+#define FLOW_SEQUENCER_H
+
+#include <vector>
+#include <map>
+
+class flow_sequencer {
+    /* These are not implemented */
+    flow_sequencer(const flow_sequencer &);
+    flow_sequencer &operator=(const flow_sequencer &);
+
+public:
+    enum { MAX_STAGED=16*1024*1024 };   // out-of-order bytes staged before a gap is given up
+
+    flow_sequencer():dropped_bytes(0),late_bytes(0),late_offset(0),next(0),staged(),staged_bytes(0),zeroed(){}
+    virtual ~flow_sequencer(){}
+
+    void sequence(const uint8_t *data,uint32_t len,uint64_t offset);
+    void shift(uint32_t inslen);        // bytes were inserted before the start of the flow
+    void drain(bool fill_gaps);         // pass on what is contiguous; with fill_gaps, everything
+    uint64_t position() const { return next; } // flow offset of the bytes being passed on in consume()
+
+    uint64_t dropped_bytes;             // arrived before the start of the flow after it was passed on
+    uint64_t late_bytes;                // arrived for a gap after it was passed on as zeros
+    uint64_t late_offset;               // the lowest flow offset of those, if late_bytes>0
+
+protected:
+    uint64_t next;                      // flow offset of the next byte to pass on
+    virtual void consume(const uint8_t *data,size_t len)=0;
+    virtual void gap(uint64_t offset,uint64_t len){} // the next len bytes passed on are zeros for a gap
+
+private:
+    std::map<uint64_t,std::vector<uint8_t> > staged; // out-of-order data by flow offset
+    uint64_t staged_bytes;
+    std::vector<std::pair<uint64_t,uint64_t> > zeroed; // start and end of the gaps passed on as zeros
+    void consume_zeros(uint64_t len);
+    void note_late(uint64_t start,uint64_t end);
+};
+
+#endif
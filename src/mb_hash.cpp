@@ -0,0 +1,332 @@
+/*
+ * mb_hash.cpp:
+ *
+ * See mb_hash.h.
+ *
+ * The MD5 and SHA-256 block functions are written once, over a GCC vector
+ * type whose elements are the lanes, and compiled for each engine with
+ * that engine's target attribute. The lane state is kept transposed:
+ * S[word][lane].
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "mb_hash.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MB_X86
+#include <cpuid.h>
+#endif
+
+#define MB_INLINE inline __attribute__((always_inline))
+
+typedef uint32_t lanes_t[8][mb_hash::MAX_LANES];
+typedef void block_func_t(lanes_t &S,const uint8_t *const *blk);
+
+typedef uint32_t v1u  __attribute__((vector_size(4)));
+#ifdef MB_X86
+typedef uint32_t v8u  __attribute__((vector_size(32)));
+typedef uint32_t v16u __attribute__((vector_size(64)));
+#endif
+
+static MB_INLINE uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static MB_INLINE uint32_t be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/****************************************************************
+ *** MD5
+ ****************************************************************/
+
+static const uint32_t md5_iv[4] = {0x67452301,0xefcdab89,0x98badcfe,0x10325476};
+
+static const uint32_t md5_K[64] = {
+    0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+    0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+    0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+    0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+    0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+    0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+    0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+    0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391};
+
+static const int md5_R[4][4] = {{7,12,17,22},{5,9,14,20},{4,11,16,23},{6,10,15,21}};
+
+#define ROTL(x,r) (((x)<<(r)) | ((x)>>(32-(r))))
+#define ROTR(x,r) (((x)>>(r)) | ((x)<<(32-(r))))
+
+/* The message words of each lane's block, word by word across the lanes */
+template<typename V,bool big_endian> static MB_INLINE void load_words(V *M,const uint8_t *const *blk)
+{
+    const int L = sizeof(V)/4;
+    uint32_t T[16][L];
+    for(int l=0;l<L;l++){
+        for(int w=0;w<16;w++) T[w][l] = big_endian ? be32(blk[l]+4*w) : le32(blk[l]+4*w);
+    }
+    for(int w=0;w<16;w++) memcpy(&M[w],T[w],sizeof(V));
+}
+
+template<typename V> static MB_INLINE void md5_block(lanes_t &S,const uint8_t *const *blk)
+{
+    V M[16];
+    load_words<V,false>(M,blk);
+    V a,b,c,d;
+    memcpy(&a,S[0],sizeof(V));
+    memcpy(&b,S[1],sizeof(V));
+    memcpy(&c,S[2],sizeof(V));
+    memcpy(&d,S[3],sizeof(V));
+    const V a0=a, b0=b, c0=c, d0=d;
+    for(int i=0;i<16;i++){
+        V t = a + ((b&c)|(~b&d)) + md5_K[i] + M[i];
+        a = d; d = c; c = b; b = b + ROTL(t,md5_R[0][i&3]);
+    }
+    for(int i=16;i<32;i++){
+        V t = a + ((d&b)|(~d&c)) + md5_K[i] + M[(5*i+1)&15];
+        a = d; d = c; c = b; b = b + ROTL(t,md5_R[1][i&3]);
+    }
+    for(int i=32;i<48;i++){
+        V t = a + (b^c^d) + md5_K[i] + M[(3*i+5)&15];
+        a = d; d = c; c = b; b = b + ROTL(t,md5_R[2][i&3]);
+    }
+    for(int i=48;i<64;i++){
+        V t = a + (c^(b|~d)) + md5_K[i] + M[(7*i)&15];
+        a = d; d = c; c = b; b = b + ROTL(t,md5_R[3][i&3]);
+    }
+    a += a0; b += b0; c += c0; d += d0;
+    memcpy(S[0],&a,sizeof(V));
+    memcpy(S[1],&b,sizeof(V));
+    memcpy(S[2],&c,sizeof(V));
+    memcpy(S[3],&d,sizeof(V));
+}
+
+/****************************************************************
+ *** SHA-256
+ ****************************************************************/
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+
+static const uint32_t sha256_K[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2};
+
+template<typename V> static MB_INLINE void sha256_block(lanes_t &S,const uint8_t *const *blk)
+{
+    V W[16];
+    load_words<V,true>(W,blk);
+    V h0[8],v[8];
+    for(int i=0;i<8;i++){
+        memcpy(&v[i],S[i],sizeof(V));
+        h0[i] = v[i];
+    }
+    for(int t=0;t<64;t++){
+        if(t>=16){
+            V w2 = W[(t-2)&15], w15 = W[(t-15)&15];
+            W[t&15] += (ROTR(w2,17)^ROTR(w2,19)^(w2>>10)) + W[(t-7)&15]
+                     + (ROTR(w15,7)^ROTR(w15,18)^(w15>>3));
+        }
+        V e = v[4], a = v[0];
+        V t1 = v[7] + (ROTR(e,6)^ROTR(e,11)^ROTR(e,25)) + ((e&v[5])^(~e&v[6])) + sha256_K[t] + W[t&15];
+        V t2 = (ROTR(a,2)^ROTR(a,13)^ROTR(a,22)) + ((a&v[1])^(a&v[2])^(v[1]&v[2]));
+        v[7] = v[6]; v[6] = v[5]; v[5] = v[4]; v[4] = v[3] + t1;
+        v[3] = v[2]; v[2] = v[1]; v[1] = v[0]; v[0] = t1 + t2;
+    }
+    for(int i=0;i<8;i++){
+        v[i] += h0[i];
+        memcpy(S[i],&v[i],sizeof(V));
+    }
+}
+
+/****************************************************************
+ *** engines
+ ****************************************************************/
+
+static void md5_x1(lanes_t &S,const uint8_t *const *blk)    { md5_block<v1u>(S,blk); }
+static void sha256_x1(lanes_t &S,const uint8_t *const *blk) { sha256_block<v1u>(S,blk); }
+#ifdef MB_X86
+__attribute__((target("avx2")))
+static void md5_x8(lanes_t &S,const uint8_t *const *blk)    { md5_block<v8u>(S,blk); }
+__attribute__((target("avx2")))
+static void sha256_x8(lanes_t &S,const uint8_t *const *blk) { sha256_block<v8u>(S,blk); }
+__attribute__((target("avx512f")))
+static void md5_x16(lanes_t &S,const uint8_t *const *blk)   { md5_block<v16u>(S,blk); }
+__attribute__((target("avx512f")))
+static void sha256_x16(lanes_t &S,const uint8_t *const *blk){ sha256_block<v16u>(S,blk); }
+#endif
+
+struct mb_engine {
+    const char    *name;
+    unsigned int   lanes;
+    block_func_t  *md5;
+    block_func_t  *sha256;
+};
+
+static const mb_engine engines[] = {    // best first
+#ifdef MB_X86
+    {"avx512",16,md5_x16,sha256_x16},
+    {"avx2",   8,md5_x8, sha256_x8},
+#endif
+    {"scalar", 1,md5_x1, sha256_x1},
+};
+static const mb_engine *chosen = 0;
+
+static bool supported(const mb_engine &e)
+{
+#ifdef MB_X86
+    __builtin_cpu_init();
+    if(strcmp(e.name,"avx512")==0) return __builtin_cpu_supports("avx512f");
+    if(strcmp(e.name,"avx2")==0)   return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+static const mb_engine *choose()
+{
+    if(chosen==0){
+        for(size_t i=0;i<sizeof(engines)/sizeof(engines[0]) && chosen==0;i++){
+            if(supported(engines[i])) chosen = &engines[i];
+        }
+    }
+    return chosen;
+}
+
+const char *mb_hash::engine()
+{
+    return choose()->name;
+}
+
+unsigned int mb_hash::lanes()
+{
+    return choose()->lanes;
+}
+
+/* With the SHA extensions, OpenSSL hashes one SHA-256 message about as fast
+ * as 16 lanes of AVX-512 hash 16 of them.
+ */
+bool mb_hash::worth_batching(alg_t alg)
+{
+    if(lanes()==1) return false;
+    if(alg==SHA256){
+#ifdef MB_X86
+        unsigned int a=0,b=0,c=0,d=0;
+        if(__get_cpuid_count(7,0,&a,&b,&c,&d) && (b & (1<<29))) return false;
+#endif
+    }
+    return true;
+}
+
+bool mb_hash::use_engine(const char *name)
+{
+    for(size_t i=0;i<sizeof(engines)/sizeof(engines[0]);i++){
+        if(strcmp(engines[i].name,name)==0 && supported(engines[i])){
+            chosen = &engines[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/****************************************************************
+ *** the lane scheduler
+ ****************************************************************/
+
+struct mb_lane {
+    const mb_hash::job *j;              // 0 if idle
+    const uint8_t *next;                // the next whole block of the message
+    size_t   whole;                     // whole blocks left in the message
+    unsigned tail_blocks;               // then these, with the padding
+    unsigned tail_done;
+    uint8_t  tail[128];
+};
+
+static void start_lane(mb_hash::alg_t alg,mb_lane &lane,const mb_hash::job &j,lanes_t &S,unsigned int l)
+{
+    lane.j     = &j;
+    lane.next  = j.data;
+    lane.whole = j.len/64;
+    size_t rem = j.len%64;
+    memset(lane.tail,0,sizeof(lane.tail));
+    if(rem) memcpy(lane.tail,j.data+j.len-rem,rem);
+    lane.tail[rem] = 0x80;
+    lane.tail_blocks = rem+1+8 <= 64 ? 1 : 2;
+    lane.tail_done = 0;
+    uint64_t bits = (uint64_t)j.len*8;
+    uint8_t *lenp = lane.tail + lane.tail_blocks*64 - 8;
+    for(int i=0;i<8;i++){
+        if(alg==mb_hash::MD5) lenp[i]   = (uint8_t)(bits>>(8*i));
+        else                  lenp[7-i] = (uint8_t)(bits>>(8*i));
+    }
+    if(alg==mb_hash::MD5){
+        for(int w=0;w<4;w++) S[w][l] = md5_iv[w];
+    } else {
+        for(int w=0;w<8;w++) S[w][l] = sha256_iv[w];
+    }
+}
+
+static void finish_lane(mb_hash::alg_t alg,mb_lane &lane,const lanes_t &S,unsigned int l)
+{
+    uint8_t *out = lane.j->digest;
+    for(unsigned int w=0;w<mb_hash::digest_size(alg)/4;w++){
+        uint32_t h = S[w][l];
+        for(int i=0;i<4;i++){
+            if(alg==mb_hash::MD5) out[w*4+i]   = (uint8_t)(h>>(8*i));
+            else                  out[w*4+3-i] = (uint8_t)(h>>(8*i));
+        }
+    }
+    lane.j = 0;
+}
+
+void mb_hash::digest(alg_t alg,const std::vector<job> &jobs)
+{
+    static const uint8_t idle[64] = {0};
+    const mb_engine *e = choose();
+    block_func_t *block = alg==MD5 ? e->md5 : e->sha256;
+
+    lanes_t S;
+    mb_lane lane[MAX_LANES];
+    const uint8_t *blk[MAX_LANES];
+    memset(S,0,sizeof(S));
+    for(unsigned int l=0;l<MAX_LANES;l++){
+        lane[l].j = 0;
+        blk[l] = idle;
+    }
+
+    size_t next_job = 0;
+    while(true){
+        unsigned int active = 0;
+        for(unsigned int l=0;l<e->lanes;l++){
+            if(lane[l].j==0 && next_job<jobs.size()) start_lane(alg,lane[l],jobs[next_job++],S,l);
+            if(lane[l].j==0){
+                blk[l] = idle;          // hashed and thrown away
+                continue;
+            }
+            active++;
+            blk[l] = lane[l].whole>0 ? lane[l].next : lane[l].tail + 64*lane[l].tail_done;
+        }
+        if(active==0) break;
+        (*block)(S,blk);
+        for(unsigned int l=0;l<e->lanes;l++){
+            if(lane[l].j==0) continue;
+            if(lane[l].whole>0){
+                lane[l].whole--;
+                lane[l].next += 64;
+            } else if(++lane[l].tail_done==lane[l].tail_blocks){
+                finish_lane(alg,lane[l],S,l);
+            }
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * mb_hash.h:
+ *
+ * Multi-buffer MD5 and SHA-256: many independent messages are hashed at
+ * once, one in each lane of the widest vector unit the CPU has: 16 lanes
+ * with AVX-512, 8 with AVX2. A lane that finishes its message takes the
+ * next one. The engine is chosen at first use; without either extension,
+ * or on other CPUs, the same code hashes one message at a time.
+ *
+ * scan_md5 uses it for the flows that close together at a timeout or at
+ * shutdown; see stream_scanners::closing().
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef MB_HASH_H
+#define MB_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class mb_hash {
+public:
+    enum alg_t { MD5, SHA256 };
+    enum { MAX_LANES=16 };
+
+    struct job {
+        job(const uint8_t *data_,size_t len_,uint8_t *digest_):data(data_),len(len_),digest(digest_){}
+        const uint8_t *data;
+        size_t         len;
+        uint8_t       *digest;          // digest_size() bytes
+    };
+
+    static void digest(alg_t alg,const std::vector<job> &jobs);
+    static unsigned int digest_size(alg_t alg){ return alg==MD5 ? 16 : 32; }
+    static const char *engine();        // "avx512", "avx2" or "scalar"
+    static unsigned int lanes();
+    static bool use_engine(const char *name); // for tests and benchmarks; false if the CPU can't
+    static bool worth_batching(alg_t alg); // beats hashing one message at a time with OpenSSL
+};
+
+#endif
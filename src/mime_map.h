@@ -10,8 +10,24 @@
 #ifndef MIME_MAP_H
 #define MIME_MAP_H
 
+#include <stddef.h>
 #include <string>
 
+#define MIME_TYPE_MAX 128		/* longer types are not looked up */
+
+struct mime_type_ext {
+	const char *type;
+	const char *ext;
+};
+
+extern const struct mime_type_ext mime_types[];
+extern const size_t mime_types_count;
+
+/* The usual file extension for a MIME type, ignoring case and any
+ * parameters; 0 if the type is not known. Nothing is allocated.
+ */
+const char *mime_extension(const char *type, size_t len);
+
 std::string get_extension_for_mime_type(const std::string& mime_type);
 
-#endif /* MIME_MAP_H */
\ No newline at end of file
+#endif /* MIME_MAP_H */
@@ -0,0 +1,199 @@
+/*
+ * pattern_set.cpp:
+ *
+ * See pattern_set.h.
+ *
+ * A pattern file has one pattern per line. Blank lines and lines that
+ * begin with '#' are skipped. \xNN stands for any byte and \\ for a
+ * backslash, so a pattern that begins with '#' is written \x23.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "pattern_set.h"
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+pattern_set::pattern_set():patterns(),folded(),fold(),wlen(4),wmask(0xffffffffU),shift(20),
+                           bucket_shift(28),maxlen(0),bits(),buckets(),by_key()
+{
+}
+
+uint32_t pattern_set::add(const std::string &pattern)
+{
+    patterns.push_back(pattern);
+    return patterns.size()-1;
+}
+
+static int hexval(char ch)
+{
+    if(ch>='0' && ch<='9') return ch-'0';
+    if(ch>='a' && ch<='f') return ch-'a'+10;
+    if(ch>='A' && ch<='F') return ch-'A'+10;
+    return -1;
+}
+
+bool pattern_set::unescape(const std::string &text,std::string &out)
+{
+    out.clear();
+    for(size_t i=0;i<text.size();i++){
+        if(text[i]!='\\'){
+            out.push_back(text[i]);
+            continue;
+        }
+        if(i+1<text.size() && text[i+1]=='\\'){
+            out.push_back('\\');
+            i++;
+            continue;
+        }
+        if(i+3<text.size() && text[i+1]=='x' && hexval(text[i+2])>=0 && hexval(text[i+3])>=0){
+            out.push_back((char)(hexval(text[i+2])*16+hexval(text[i+3])));
+            i += 3;
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool pattern_set::load(const std::string &fname,std::string &err)
+{
+    std::ifstream in(fname.c_str());
+    if(!in.is_open()){
+        err = fname + ": " + strerror(errno);
+        return false;
+    }
+    std::string line;
+    for(int lineno=1;std::getline(in,line);lineno++){
+        if(line.size() && line[line.size()-1]=='\r') line.resize(line.size()-1);
+        if(line.size()==0 || line[0]=='#') continue;
+        std::string pattern;
+        if(!unescape(line,pattern)){
+            std::stringstream ss;
+            ss << fname << ":" << lineno << ": bad escape in pattern";
+            err = ss.str();
+            return false;
+        }
+        add(pattern);
+    }
+    return true;
+}
+
+void pattern_set::compile(bool nocase)
+{
+    for(int b=0;b<256;b++){
+        fold[b] = (nocase && b>='A' && b<='Z') ? b+'a'-'A' : b;
+    }
+    folded.clear();
+    wlen = 4;
+    maxlen = 0;
+    for(std::vector<std::string>::const_iterator p=patterns.begin();p!=patterns.end();p++){
+        std::string f(*p);
+        for(size_t i=0;i<f.size();i++) f[i] = fold[(uint8_t)f[i]];
+        folded.push_back(f);
+        if(f.size()>0 && f.size()<wlen) wlen = f.size();
+        if(f.size()>maxlen) maxlen = f.size();
+    }
+    wmask = wlen==4 ? 0xffffffffU : (1U<<(8*wlen))-1;
+
+    /* Group the patterns by the window they end in */
+    std::vector<std::pair<uint32_t,uint32_t> > keys; // window, pattern
+    for(uint32_t p=0;p<folded.size();p++){
+        const std::string &f = folded[p];
+        if(f.size()==0) continue;       // matches nothing
+        uint32_t key = 0;
+        for(size_t i=f.size()-wlen;i<f.size();i++) key = (key<<8) | (uint8_t)f[i];
+        keys.push_back(std::make_pair(key,p));
+    }
+    std::sort(keys.begin(),keys.end());
+    size_t distinct = 0;
+    for(size_t i=0;i<keys.size();i++){
+        if(i==0 || keys[i].first!=keys[i-1].first) distinct++;
+    }
+
+    /* About 1 bit in 32 is set, so few bytes get past the filter */
+    unsigned int log2bits = 12;
+    while(log2bits<MAX_FILTER_LOG2 && ((size_t)1<<log2bits) < distinct*32) log2bits++;
+    shift = 32-log2bits;
+    bits.assign(((size_t)1<<log2bits)/64,0);
+
+    unsigned int log2buckets = 4;
+    while(((size_t)1<<log2buckets) < distinct*2) log2buckets++;
+    bucket_shift = 32-log2buckets;
+    buckets.assign((size_t)1<<log2buckets,bucket());
+
+    by_key.clear();
+    for(size_t i=0;i<keys.size();){
+        const uint32_t key = keys[i].first;
+        const uint32_t h = hash(key)>>shift;
+        bits[h>>6] |= (uint64_t)1<<(h&63);
+        size_t b = hash(key)>>bucket_shift;
+        while(buckets[b].count) b = (b+1) & (buckets.size()-1);
+        buckets[b].key   = key;
+        buckets[b].first = by_key.size();
+        for(;i<keys.size() && keys[i].first==key;i++){
+            by_key.push_back(keys[i].second);
+            buckets[b].count++;
+        }
+    }
+}
+
+/* The filter passed the window that ends at data+end: compare the
+ * patterns that end in it with the bytes before it, which may be in the
+ * stream's tail.
+ */
+void pattern_set::check(const stream &st,const uint8_t *data,size_t end,uint32_t key,std::vector<hit> &hits) const
+{
+    size_t b = hash(key)>>bucket_shift;
+    while(buckets[b].count && buckets[b].key!=key) b = (b+1) & (buckets.size()-1);
+    const bucket &bk = buckets[b];
+    for(uint32_t k=bk.first;k<bk.first+bk.count;k++){
+        const std::string &f = folded[by_key[k]];
+        if(st.seen+end < f.size()) continue;    // not that much data yet
+        const ptrdiff_t from = (ptrdiff_t)end-(ptrdiff_t)f.size();
+        const size_t n = f.size()-wlen;         // the window itself matched
+        size_t j = 0;
+        for(;j<n && from+(ptrdiff_t)j<0;j++){
+            if(fold[(uint8_t)st.tail[st.tail.size()+from+j]]!=(uint8_t)f[j]) break;
+        }
+        if(j<n && from+(ptrdiff_t)j<0) continue;
+        for(;j<n;j++){
+            if(fold[data[from+j]]!=(uint8_t)f[j]) break;
+        }
+        if(j==n) hits.push_back(hit(by_key[k],end));
+    }
+}
+
+void pattern_set::scan(stream &st,const uint8_t *data,size_t len,std::vector<hit> &hits) const
+{
+    if(len==0) return;
+    if(by_key.size()){
+        /* in locals, which check() cannot be assumed to leave alone */
+        const uint64_t *b = &bits[0];
+        const uint8_t *f = fold;
+        const uint32_t m = wmask;
+        const unsigned int sh = shift;
+        uint32_t w = st.window;
+        for(size_t i=0;i<len;i++){
+            w = (w<<8) | f[data[i]];
+            const uint32_t h = hash(w & m)>>sh;
+            if(__builtin_expect((b[h>>6]>>(h&63)) & 1,0)) check(st,data,i+1,w & m,hits);
+        }
+        st.window = w;
+    }
+
+    /* Keep the bytes a match that ends in the next segment may begin in */
+    const size_t keep = maxlen ? maxlen-1 : 0;
+    if(len>=keep){
+        st.tail.assign(reinterpret_cast<const char *>(data)+len-keep,keep);
+    } else {
+        st.tail.append(reinterpret_cast<const char *>(data),len);
+        if(st.tail.size()>keep) st.tail.erase(0,st.tail.size()-keep);
+    }
+    st.seen += len;
+}
@@ -0,0 +1,95 @@
+/*
+ * pattern_set.h:
+ *
+ * Many fixed strings searched for at once. Walking an Aho-Corasick
+ * automaton costs a dependent load per byte, and with tens of thousands
+ * of patterns most of those loads miss the cache. So the search is a
+ * filter and a check instead:
+ *
+ *  - at every byte, the last W bytes (W is the shortest pattern's length,
+ *    at most 4) are hashed into a bitmap that has a bit set for the last
+ *    W bytes of each pattern. The bitmap is sized to stay in L2, and the
+ *    loop has no dependency between bytes but the window itself;
+ *  - where the bit is set, the window is looked up exactly, and the
+ *    patterns that end in it are compared with the bytes before it.
+ *
+ * A stream keeps the window and the last longest()-1 bytes it has seen,
+ * so a flow scanned a segment at a time finds the matches that span
+ * segments, as if it had been scanned whole.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef PATTERN_SET_H
+#define PATTERN_SET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class pattern_set {
+    /* These are not implemented */
+    pattern_set(const pattern_set &);
+    pattern_set &operator=(const pattern_set &);
+
+public:
+    enum { MAX_FILTER_LOG2=23 };        // a 1MB bitmap at most
+
+    struct hit {
+        hit(uint32_t pattern_,size_t end_):pattern(pattern_),end(end_){}
+        uint32_t pattern;               // index in the order added
+        size_t   end;                   // offset in the buffer just past the match
+    };
+
+    /* The search state of one flow */
+    struct stream {
+        stream():window(0),seen(0),tail(){}
+        uint32_t    window;             // the last bytes, folded
+        uint64_t    seen;               // bytes scanned so far
+        std::string tail;               // the last longest()-1 of them
+    };
+
+    pattern_set();
+    uint32_t add(const std::string &pattern); // before compile(); returns the index
+    bool load(const std::string &fname,std::string &err); // one per line; see pattern_set.cpp
+    static bool unescape(const std::string &text,std::string &out); // \xNN and \\; false if malformed
+    void compile(bool nocase);
+
+    /* Scan the next len bytes of a stream. Each match is appended to
+     * hits, in the order its last byte is seen.
+     */
+    void scan(stream &st,const uint8_t *data,size_t len,std::vector<hit> &hits) const;
+
+    size_t size() const { return patterns.size(); }
+    const std::string &pattern(uint32_t i) const { return patterns[i]; }
+    size_t longest() const { return maxlen; }
+    unsigned int window_size() const { return wlen; }
+    size_t filter_bytes() const { return bits.size()*sizeof(uint64_t); }
+
+private:
+    struct bucket {                     // the patterns that end in one window
+        bucket():key(0),first(0),count(0){}
+        uint32_t key;
+        uint32_t first;                 // into by_key
+        uint32_t count;                 // 0 if the bucket is empty
+    };
+
+    std::vector<std::string> patterns;
+    std::vector<std::string> folded;    // as compared: lower case with nocase
+    uint8_t  fold[256];
+    unsigned int wlen;                  // W
+    uint32_t wmask;
+    unsigned int shift;                 // 32 - log2 of the bitmap's bits
+    unsigned int bucket_shift;          // 32 - log2 of the buckets
+    size_t   maxlen;
+    std::vector<uint64_t> bits;
+    std::vector<bucket> buckets;        // open addressing; a power of 2
+    std::vector<uint32_t> by_key;       // pattern indexes, grouped by window
+
+    static uint32_t hash(uint32_t key){ return key*0x9E3779B1U; }
+    void check(const stream &st,const uint8_t *data,size_t end,uint32_t key,std::vector<hit> &hits) const;
+};
+
+#endif
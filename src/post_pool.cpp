@@ -0,0 +1,154 @@
+/*
+ * post_pool.cpp:
+ *
+ * See post_pool.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "post_pool.h"
+
+static void scan(tcpdemux &demux,post_job *job)
+{
+    be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*job->sbuf,*(demux.fs),&job->xmladd));
+    delete job->sbuf;
+    job->sbuf = 0;
+}
+
+post_pool::post_pool(tcpdemux &demux_,unsigned int threads_,unsigned int queue_max_):
+    threads(threads_),queue_max(queue_max_),jobs(0),stalls(0),max_pending(0),
+    demux(demux_),pending(),work(),stopping(false)
+#ifdef HAVE_PTHREAD
+    ,M(),work_ready(),job_done(),workers()
+#endif
+{
+    if(queue_max < threads) queue_max = threads;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&M,NULL);
+    pthread_cond_init(&work_ready,NULL);
+    pthread_cond_init(&job_done,NULL);
+    for(unsigned int i=0;i<threads;i++){
+        pthread_t t;
+        if(pthread_create(&t,NULL,worker_main,this)){
+            DEBUG(1)("cannot create post-processing thread: %s",strerror(errno));
+            break;
+        }
+        workers.push_back(t);
+    }
+    this->threads = workers.size();
+#endif
+}
+
+post_pool::~post_pool()
+{
+    reap(true);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&M);
+    stopping = true;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&M);
+    for(std::vector<pthread_t>::const_iterator it=workers.begin();it!=workers.end();it++){
+        pthread_join(*it,NULL);
+    }
+    pthread_cond_destroy(&job_done);
+    pthread_cond_destroy(&work_ready);
+    pthread_mutex_destroy(&M);
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+void *post_pool::worker_main(void *arg)
+{
+    static_cast<post_pool *>(arg)->run();
+    return 0;
+}
+#endif
+
+/* The worker loop: take the oldest unstarted job and scan it */
+void post_pool::run()
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&M);
+    while(true){
+        while(work.empty() && !stopping) pthread_cond_wait(&work_ready,&M);
+        if(work.empty()) break;         // stopping, and nothing left
+        post_job *job = work.front();
+        work.pop_front();
+        pthread_mutex_unlock(&M);
+
+        scan(demux,job);
+
+        pthread_mutex_lock(&M);
+        job->done = true;
+        pthread_cond_broadcast(&job_done);
+    }
+    pthread_mutex_unlock(&M);
+#endif
+}
+
+/* Write the <fileobject> and the flow's rows, and delete the flow, as post_process does without a pool */
+void post_pool::complete(post_job *job)
+{
+    if(demux.report) job->tcp->dump_xml(*demux.report,job->xmladd.str());
+    if(demux.arrow) job->tcp->dump_arrow(*demux.arrow,job->xmladd.str());
+    if(demux.flowdb) job->tcp->dump_db(*demux.flowdb,job->xmladd.str());
+    delete job->tcp;
+    delete job;
+}
+
+void post_pool::submit(tcpip *tcp,sbuf_t *sbuf,const std::string &xmladd)
+{
+    post_job *job = new post_job(tcp,sbuf);
+    job->xmladd << xmladd;              // from the streaming scanners
+    jobs++;
+    if(pending.size() >= queue_max){
+        /* Backpressure: the packet thread waits for the oldest job */
+        stalls++;
+        while(pending.size() >= queue_max){
+            post_job *head = pending.front();
+#ifdef HAVE_PTHREAD
+            pthread_mutex_lock(&M);
+            while(!head->done) pthread_cond_wait(&job_done,&M);
+            pthread_mutex_unlock(&M);
+#endif
+            pending.pop_front();
+            complete(head);
+        }
+    }
+    pending.push_back(job);
+    if(pending.size() > max_pending) max_pending = pending.size();
+    if(sbuf){
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&M);
+        work.push_back(job);
+        pthread_cond_signal(&work_ready);
+        pthread_mutex_unlock(&M);
+#else
+        scan(demux,job);
+        job->done = true;
+#endif
+    }
+    reap(false);
+}
+
+void post_pool::reap(bool wait_all)
+{
+    while(!pending.empty()){
+        post_job *head = pending.front();
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&M);
+        if(wait_all){
+            while(!head->done) pthread_cond_wait(&job_done,&M);
+        }
+        bool done = head->done;
+        pthread_mutex_unlock(&M);
+        if(!done) return;
+#endif
+        pending.pop_front();
+        complete(head);
+    }
+}
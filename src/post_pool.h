@@ -0,0 +1,82 @@
+/*
+ * post_pool.h:
+ *
+ * Worker threads for flow post-processing (-S post_threads=N).
+ *
+ * When a flow closes, the packet thread still does the cheap part of
+ * tcpdemux::post_process(): it gets the flow into an sbuf, closes the
+ * file and records the saved flow. The sbuf is then handed to the pool
+ * and a worker runs the scanners on it. The flow's <fileobject> is
+ * written by the packet thread once its job is done.
+ *
+ * Jobs are completed in the order they were submitted, whatever order the
+ * workers finish them in, so report.xml is the same as with no pool.
+ * Flows without post-processing go through the queue as finished jobs
+ * for the same reason. At most queue_max jobs are outstanding; submit()
+ * waits for the oldest one when the queue is full.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef POST_POOL_H
+#define POST_POOL_H
+
+#include <deque>
+#include <vector>
+#include <sstream>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+class post_job {
+    /* These are not implemented */
+    post_job(const post_job &);
+    post_job &operator=(const post_job &);
+
+public:
+    post_job(class tcpip *tcp_,class sbuf_t *sbuf_):tcp(tcp_),sbuf(sbuf_),xmladd(),done(sbuf_==0){}
+    class tcpip *tcp;                   // the closed flow; deleted when the job is completed
+    class sbuf_t *sbuf;                 // what the scanners run on; 0 if nothing to scan
+    std::stringstream xmladd;           // what the scanners add to the <fileobject>
+    bool done;                          // protected by the pool mutex
+};
+
+class post_pool {
+    /* These are not implemented */
+    post_pool(const post_pool &);
+    post_pool &operator=(const post_pool &);
+
+public:
+    enum { DEFAULT_QUEUE_PER_THREAD=8 };
+
+    post_pool(class tcpdemux &demux,unsigned int threads,unsigned int queue_max);
+    virtual ~post_pool();               // completes everything and joins the workers
+
+    void submit(class tcpip *tcp,class sbuf_t *sbuf,const std::string &xmladd); // called from post_process
+    void reap(bool wait_all);           // complete the finished jobs at the head of the queue
+
+    unsigned int threads;
+    unsigned int queue_max;
+    uint64_t jobs;                      // statistics
+    uint64_t stalls;                    // submits that waited for the queue
+    unsigned int max_pending;
+
+private:
+    class tcpdemux &demux;
+    std::deque<post_job *> pending;     // submission order; only the packet thread touches it
+    std::deque<post_job *> work;        // not yet picked up by a worker
+    bool stopping;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t M;
+    pthread_cond_t  work_ready;
+    pthread_cond_t  job_done;
+    std::vector<pthread_t> workers;
+    static void *worker_main(void *arg);
+#endif
+    void run();
+    void complete(post_job *job);
+};
+
+#endif
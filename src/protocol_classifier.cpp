@@ -0,0 +1,188 @@
+/*
+ * protocol_classifier.cpp:
+ *
+ * See protocol_classifier.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "protocol_classifier.h"
+
+#include <assert.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+static const char *protocol_names[protocol_classifier::NPROTOCOLS] = {
+    "", "unknown", "http", "http2", "tls", "ssh", "smb", "dns", "smtp", "pop3", "imap", "rdp", "bittorrent", "sip", "rtsp"
+};
+
+/* Where any is given, a '?' in it marks a byte of the signature that
+ * matches anything.
+ */
+struct signature {
+    const char *bytes;
+    size_t len;
+    const char *any;
+    protocol_classifier::protocol_t proto;
+};
+#define SIG(s,p)       {s,sizeof(s)-1,0,protocol_classifier::p}
+#define SIG_ANY(s,a,p) {s,sizeof(s)-1,a,protocol_classifier::p}
+
+static const signature signatures[] = {
+    SIG("GET ",HTTP), SIG("POST ",HTTP), SIG("HEAD ",HTTP), SIG("PUT ",HTTP), SIG("DELETE ",HTTP),
+    SIG("OPTIONS ",HTTP), SIG("CONNECT ",HTTP), SIG("PATCH ",HTTP), SIG("TRACE ",HTTP), SIG("HTTP/1.",HTTP),
+    SIG("PRI * HTTP/2.0\r\n",HTTP2),
+    SIG("\x16\x03\x00",TLS), SIG("\x16\x03\x01",TLS), SIG("\x16\x03\x02",TLS), // a handshake record
+    SIG("\x16\x03\x03",TLS), SIG("\x16\x03\x04",TLS),
+    SIG("SSH-",SSH),
+    SIG_ANY("\x00\x00\x00\x00\xffSMB","x???xxxx",SMB), // after the NetBIOS session header
+    SIG_ANY("\x00\x00\x00\x00\xfeSMB","x???xxxx",SMB), // SMB2
+    SIG_ANY("\x00\x00\x00\x00\xfdSMB","x???xxxx",SMB), // SMB3 encrypted
+    SIG("EHLO ",SMTP), SIG("HELO ",SMTP), SIG("ehlo ",SMTP), SIG("helo ",SMTP),
+    SIG("+OK",POP3),
+    SIG("* OK",IMAP), SIG("* PREAUTH",IMAP),
+    SIG_ANY("\x03\x00\x00\x00\x00\xe0","xx???x",RDP), // TPKT, then an X.224 connection request
+    SIG_ANY("\x03\x00\x00\x00\x00\xd0","xx???x",RDP), // and its confirm
+    SIG("\x13" "BitTorrent protocol",BITTORRENT),
+    SIG("SIP/2.0 ",SIP), SIG("INVITE sip:",SIP), SIG("REGISTER sip:",SIP), SIG("OPTIONS sip:",SIP),
+    SIG("RTSP/1.0 ",RTSP), SIG("DESCRIBE rtsp:",RTSP), SIG("OPTIONS rtsp:",RTSP), SIG("SETUP rtsp:",RTSP),
+};
+
+/* The signatures, compiled. Node 0 is the root, whose edges are looked up
+ * directly; the other nodes have a few edges each, sorted by byte, and
+ * maybe one for any byte, which is taken only if no edge is. No signature
+ * needs to back up from an exact byte to an any, so the walk never does.
+ */
+class signature_trie {
+public:
+    signature_trie();
+    protocol_classifier::protocol_t walk(const uint8_t *data,size_t len) const;
+
+private:
+    struct node {
+        node():first(0),count(0),proto(0),any(0){}
+        uint16_t first;                 // into edge_byte and edge_node
+        uint8_t  count;
+        uint8_t  proto;                 // of the signature that ends here; 0 if none
+        uint16_t any;                   // 0 if none
+    };
+    uint16_t root[256];
+    std::vector<node> nodes;
+    std::vector<uint8_t> edge_byte;
+    std::vector<uint16_t> edge_node;
+
+    struct build_node {                 // before it is flattened
+        build_node():next(),proto(0){}
+        std::map<int,build_node *> next; // -1 for any byte
+        uint8_t proto;
+        ~build_node(){
+            for(std::map<int,build_node *>::iterator it=next.begin();it!=next.end();it++) delete it->second;
+        }
+    };
+    uint16_t flatten(const build_node &b);
+};
+
+signature_trie::signature_trie():nodes(),edge_byte(),edge_node()
+{
+    build_node top;
+    for(size_t i=0;i<sizeof(signatures)/sizeof(signatures[0]);i++){
+        const signature &s = signatures[i];
+        build_node *b = &top;
+        for(size_t j=0;j<s.len;j++){
+            int key = (s.any && s.any[j]=='?') ? -1 : (uint8_t)s.bytes[j];
+            assert(key>=0 || b!=&top);
+            build_node *&child = b->next[key];
+            if(child==0) child = new build_node();
+            b = child;
+        }
+        b->proto = s.proto;
+    }
+    memset(root,0,sizeof(root));
+    nodes.push_back(node());
+    for(std::map<int,build_node *>::const_iterator it=top.next.begin();it!=top.next.end();it++){
+        root[it->first] = flatten(*it->second);
+    }
+}
+
+uint16_t signature_trie::flatten(const build_node &b)
+{
+    const uint16_t n = nodes.size();
+    nodes.push_back(node());
+    nodes[n].proto = b.proto;
+    std::vector<std::pair<uint8_t,uint16_t> > edges;
+    for(std::map<int,build_node *>::const_iterator it=b.next.begin();it!=b.next.end();it++){
+        uint16_t child = flatten(*it->second);
+        if(it->first<0) nodes[n].any = child;
+        else edges.push_back(std::make_pair((uint8_t)it->first,child));
+    }
+    nodes[n].first = edge_byte.size();
+    nodes[n].count = edges.size();
+    for(size_t i=0;i<edges.size();i++){   // in byte order, from the map
+        edge_byte.push_back(edges[i].first);
+        edge_node.push_back(edges[i].second);
+    }
+    return n;
+}
+
+protocol_classifier::protocol_t signature_trie::walk(const uint8_t *data,size_t len) const
+{
+    uint8_t best = 0;
+    uint16_t n = len ? root[data[0]] : 0;
+    for(size_t i=1;n!=0;i++){
+        const node &nd = nodes[n];
+        if(nd.proto) best = nd.proto;
+        if(i>=len) break;
+        uint16_t next = nd.any;
+        for(unsigned int e=nd.first;e<(unsigned int)nd.first+nd.count;e++){
+            if(edge_byte[e]==data[i]){
+                next = edge_node[e];
+                break;
+            }
+            if(edge_byte[e]>data[i]) break;
+        }
+        n = next;
+    }
+    return (protocol_classifier::protocol_t)best;
+}
+
+static const signature_trie trie;
+
+/* A DNS message behind its two byte TCP length: a query, inverse query
+ * or status request, with one question and a plausible first label.
+ */
+static bool dns_over_tcp(const uint8_t *data,size_t len)
+{
+    if(len<2+12+5) return false;
+    const size_t msglen = (data[0]<<8) | data[1];
+    if(msglen<12+5) return false;
+    const uint8_t *h = data+2;
+    if(((h[2]>>3)&0x0f)>2) return false; // opcode
+    if(h[3]&0x40) return false;          // Z must be zero
+    if(h[4]!=0 || h[5]!=1) return false; // QDCOUNT
+    if(h[6]!=0 || h[8]!=0 || h[10]!=0) return false; // more than 255 records is not DNS
+    if(h[12]>63) return false;           // a label, or the root
+    return true;
+}
+
+protocol_classifier::protocol_t protocol_classifier::classify(const uint8_t *data,size_t len)
+{
+    protocol_t p = trie.walk(data,len);
+    if(p!=UNCLASSIFIED) return p;
+    if(dns_over_tcp(data,len)) return DNS;
+    return UNKNOWN;
+}
+
+const char *protocol_classifier::name(protocol_t p)
+{
+    return p<NPROTOCOLS ? protocol_names[p] : "";
+}
+
+protocol_classifier::protocol_t protocol_classifier::lookup(const std::string &name)
+{
+    for(int p=UNKNOWN;p<NPROTOCOLS;p++){
+        if(name==protocol_names[p]) return (protocol_t)p;
+    }
+    return NPROTOCOLS;
+}
@@ -0,0 +1,43 @@
+/*
+ * protocol_classifier.h:
+ *
+ * Names the application protocol of a flow from the first bytes it
+ * carries, whatever its ports: a TLS record, an HTTP method, an SSH
+ * banner, an SMB header behind its NetBIOS length, and so on. The
+ * signatures are prefixes, some with bytes that match anything, compiled
+ * once into a small trie; a flow costs one walk down it, a few dozen
+ * bytes at most, and the longest signature that matches wins. DNS over
+ * TCP has no fixed prefix, so its header is checked if nothing matches.
+ *
+ * tcpip::store_packet() classifies each direction of a connection by the
+ * first segment that starts the flow, and keeps the answer in
+ * flow::protocol; a segment too short for any signature it starts leaves
+ * the flow UNKNOWN. -S classify=0 turns it off.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef PROTOCOL_CLASSIFIER_H
+#define PROTOCOL_CLASSIFIER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+class protocol_classifier {
+public:
+    enum protocol_t {
+        UNCLASSIFIED=0,                 // no data at the start of the flow yet
+        UNKNOWN,                        // looked at, and nothing matched
+        HTTP, HTTP2, TLS, SSH, SMB, DNS, SMTP, POP3, IMAP, RDP, BITTORRENT, SIP, RTSP,
+        NPROTOCOLS
+    };
+
+    /* The protocol of a flow that starts with these bytes; never UNCLASSIFIED */
+    static protocol_t classify(const uint8_t *data,size_t len);
+    static const char *name(protocol_t p); // "" for UNCLASSIFIED
+    static protocol_t lookup(const std::string &name); // NPROTOCOLS if it is not a name
+};
+
+#endif
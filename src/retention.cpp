@@ -0,0 +1,200 @@
+/*
+ * retention.cpp:
+ *
+ * See retention.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "config.h"
+#include "retention.h"
+#include "pattern_set.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <sstream>
+
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+
+const char *retention_policy::rule::action_name() const
+{
+    switch(action){
+    case KEEP:     return "keep";
+    case TRUNCATE: return "truncate";
+    case DROP:     return "drop";
+    }
+    return "";
+}
+
+retention_policy::retention_policy(uint32_t head_bytes_):head_bytes(head_bytes_),kept(0),truncated(0),dropped(0),
+                                                         unwritten_bytes(0),rules(),default_rule()
+{
+}
+
+retention_policy::rule::~rule()
+{
+#ifdef HAVE_REGEX_H
+    if(re){
+        regfree((regex_t *)re);
+        delete (regex_t *)re;
+    }
+#endif
+}
+
+retention_policy::~retention_policy()
+{
+    for(std::vector<rule *>::const_iterator it=rules.begin();it!=rules.end();it++){
+        delete *it;
+    }
+}
+
+static bool parse_action(const std::string &word,retention_policy::rule &r)
+{
+    if(word=="keep"){
+        r.action = retention_policy::KEEP;
+        return true;
+    }
+    if(word=="drop"){
+        r.action = retention_policy::DROP;
+        return true;
+    }
+    if(word.compare(0,9,"truncate=")==0 && word.size()>9){
+        char *end = 0;
+        r.limit = strtoull(word.c_str()+9,&end,10);
+        r.action = retention_policy::TRUNCATE;
+        return *end=='\0';
+    }
+    return false;
+}
+
+bool retention_policy::load(const std::string &fname,std::string &err)
+{
+    std::ifstream in(fname.c_str());
+    if(!in.is_open()){
+        err = fname + ": " + strerror(errno);
+        return false;
+    }
+    std::string line;
+    for(int lineno=1;std::getline(in,line);lineno++){
+        if(line.size() && line[line.size()-1]=='\r') line.resize(line.size()-1);
+        std::stringstream words(line);
+        std::string action,match;
+        words >> action >> match;
+        if(action.size()==0 || action[0]=='#') continue;
+
+        std::stringstream where;
+        where << fname << ":" << lineno << ": ";
+        if(action=="default"){
+            if(!parse_action(match,default_rule)){
+                err = where.str() + "unknown action '" + match + "'";
+                return false;
+            }
+            continue;
+        }
+        rules.push_back(new rule());    // built in place; if it does not parse it is freed with the rest
+        rule &r = *rules.back();
+        r.line = lineno;
+        if(!parse_action(action,r)){
+            err = where.str() + "unknown action '" + action + "'";
+            return false;
+        }
+
+        /* the argument is the rest of the line */
+        std::string arg;
+        if(words.tellg()>=0){
+            size_t start = line.find_first_not_of(" \t",(size_t)words.tellg());
+            if(start!=std::string::npos) arg = line.substr(start);
+        }
+        if(match=="literal" || match=="magic" || match.compare(0,6,"magic@")==0){
+            r.match = match=="literal" ? LITERAL : MAGIC;
+            if(match.size()>6){
+                char *end = 0;
+                r.at = strtoull(match.c_str()+6,&end,10);
+                if(*end!='\0'){
+                    err = where.str() + "bad offset in '" + match + "'";
+                    return false;
+                }
+            }
+            if(!pattern_set::unescape(arg,r.arg)){
+                err = where.str() + "bad escape";
+                return false;
+            }
+        } else if(match=="regex" || match=="iregex"){
+            r.match = REGEX;
+#ifdef HAVE_REGEX_H
+            regex_t *re = new regex_t;
+            int code = regcomp(re,arg.c_str(),REG_EXTENDED|REG_NOSUB|(match=="iregex" ? REG_ICASE : 0));
+            if(code!=0){
+                char msg[256];
+                regerror(code,re,msg,sizeof(msg));
+                delete re;
+                err = where.str() + msg;
+                return false;
+            }
+            r.re = re;
+#else
+            err = where.str() + "regular expressions are not available in this build";
+            return false;
+#endif
+        } else if(match=="protocol"){
+            r.match = PROTOCOL;
+            r.protocol = protocol_classifier::lookup(arg);
+            if(r.protocol==protocol_classifier::NPROTOCOLS){
+                err = where.str() + "unknown protocol '" + arg + "'";
+                return false;
+            }
+        } else {
+            err = where.str() + "unknown match '" + match + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool retention_policy::matches(const rule &r,const uint8_t *head,size_t len,
+                               protocol_classifier::protocol_t protocol) const
+{
+    switch(r.match){
+    case DEFAULT:
+        return true;
+    case LITERAL:
+        return std::search(head,head+len,r.arg.begin(),r.arg.end(),
+                           std::equal_to<uint8_t>())!=head+len || r.arg.size()==0;
+    case MAGIC:
+        return r.at+r.arg.size()<=len && memcmp(head+r.at,r.arg.data(),r.arg.size())==0;
+    case REGEX:
+#ifdef HAVE_REGEX_H
+#ifdef REG_STARTEND
+        {
+            /* the head may have NULs */
+            regmatch_t m[1];
+            m[0].rm_so = 0;
+            m[0].rm_eo = len;
+            return regexec((const regex_t *)r.re,len ? (const char *)head : "",1,m,REG_STARTEND)==0;
+        }
+#else
+        return regexec((const regex_t *)r.re,std::string((const char *)head,len).c_str(),0,0,0)==0;
+#endif
+#endif
+        break;
+    case PROTOCOL:
+        return r.protocol==(protocol==protocol_classifier::UNCLASSIFIED ? protocol_classifier::UNKNOWN : protocol);
+    }
+    return false;
+}
+
+const retention_policy::rule *retention_policy::decide(const uint8_t *head,size_t len,
+                                                      protocol_classifier::protocol_t protocol) const
+{
+    for(std::vector<rule *>::const_iterator it=rules.begin();it!=rules.end();it++){
+        if(matches(**it,head,len,protocol)) return *it;
+    }
+    return &default_rule;
+}
@@ -0,0 +1,113 @@
+/*
+ * retention.h:
+ *
+ * A retention policy decides, once for each flow, whether its file is
+ * worth the disk. It looks at the first retention_bytes of the flow, in
+ * order, and the first rule that matches them decides:
+ *
+ *   keep                      write the whole flow, as usual
+ *   truncate=N                write only the first N bytes, as -b does
+ *   drop                      write nothing more and unlink the file
+ *
+ * A flow that closes before it has retention_bytes is decided on what it
+ * has. Until the decision the flow is written as usual; after it, a
+ * dropped flow makes no writes, opens no file and feeds no scanner, but
+ * its <fileobject> is still written to the report, with a <retention>
+ * element that names the rule. With -S container or -S chunk_store
+ * nothing can be unlinked, so a dropped flow keeps what was written
+ * before the decision.
+ *
+ * The rules are in -S retention_rules, one per line:
+ *
+ *   # action   match       argument
+ *   drop       magic       \x1a\x45\xdf\xa3
+ *   drop       magic@4     ftyp
+ *   truncate=65536 regex   ^HTTP/1\.[01] 2[0-9][0-9] .*Content-Type: video/
+ *   keep       literal     Authorization:
+ *   truncate=4096 protocol tls
+ *   default    drop
+ *
+ * literal matches anywhere in the head and magic@N at offset N (0 if
+ * it is not given); their arguments take \xNN and \\ escapes. regex is a
+ * POSIX extended regular expression, and iregex ignores case. protocol
+ * matches the name protocol_classifier gave the flow (unknown if it found
+ * none, or with -S classify=0). default sets the action for flows no rule
+ * matches; it is keep if not given.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "flow_sequencer.h"
+#include "protocol_classifier.h"
+
+class retention_policy {
+    /* These are not implemented */
+    retention_policy(const retention_policy &);
+    retention_policy &operator=(const retention_policy &);
+
+public:
+    enum { DEFAULT_HEAD_BYTES=4096 };
+    enum action_t { KEEP, TRUNCATE, DROP };
+    enum match_t { DEFAULT, LITERAL, MAGIC, REGEX, PROTOCOL };
+
+    struct rule {
+        rule():action(KEEP),limit(0),match(DEFAULT),arg(),at(0),re(0),protocol(),line(0){}
+        ~rule();                        // frees re
+        action_t    action;
+        uint64_t    limit;              // for TRUNCATE
+        match_t     match;
+        std::string arg;                // LITERAL and MAGIC
+        uint64_t    at;                 // MAGIC
+        void        *re;                // REGEX: a regex_t, owned by the rule
+        protocol_classifier::protocol_t protocol; // PROTOCOL
+        int         line;               // in the rules file; 0 for the default
+        const char *action_name() const;
+    private:
+        /* These are not implemented; a rule owns its re */
+        rule(const rule &);
+        rule &operator=(const rule &);
+    };
+
+    retention_policy(uint32_t head_bytes_);
+    ~retention_policy();
+    bool load(const std::string &fname,std::string &err);
+    const rule *decide(const uint8_t *head,size_t len,protocol_classifier::protocol_t protocol) const; // never 0
+
+    const uint32_t head_bytes;
+    uint64_t kept;                      // flows
+    uint64_t truncated;
+    uint64_t dropped;
+    uint64_t unwritten_bytes;           // not written to truncated and dropped flows
+
+private:
+    std::vector<rule *> rules;          // in file order
+    rule default_rule;
+    bool matches(const rule &r,const uint8_t *head,size_t len,protocol_classifier::protocol_t protocol) const;
+};
+
+/* The head of one flow, in order, until the policy has decided */
+class retention_probe : public flow_sequencer {
+public:
+    retention_probe(size_t want_):head(),want(want_){}
+    bool full() const { return head.size()>=want; }
+    std::vector<uint8_t> head;
+
+protected:
+    virtual void consume(const uint8_t *data,size_t len){
+        if(head.size()+len > want) len = want-head.size();
+        head.insert(head.end(),data,data+len);
+    }
+
+private:
+    const size_t want;
+};
+
+#endif
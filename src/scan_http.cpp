@@ -12,8 +12,10 @@
 #include "tcpdemux.h"
 
 #include "http-parser/http_parser.h"
+#include "dfxml/src/hash_t.h"
 
 #include "mime_map.h"
+#include "stream_scanner.h"
 
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
@@ -33,64 +35,419 @@
 #  define z_stream void *               // prevents z_stream from generating an error
 #endif
 
+#if defined(HAVE_LIBDEFLATE_H) && defined(HAVE_LIBDEFLATE)
+#  include <libdeflate.h>
+#  define USE_LIBDEFLATE
+#endif
+
 #define MIN_HTTP_BUFSIZE 80             // don't bother parsing smaller than this
 
 #include <sys/types.h>
 #include <iostream>
-#include <algorithm>
 #include <map>
-#include <iomanip>
+#include <deque>
 
 #define HTTP_CMD "http_cmd"
 #define HTTP_ALERT_FD "http_alert_fd"
+#define HTTP_DEDUP "http_dedup"
+#define HTTP_CMD_WORKERS "http_cmd_workers"
+#define HTTP_MAX_RATIO "http_max_ratio"
+#define HTTP_ONESHOT_MAX "http_oneshot_max"
+#define HTTP_COPY_RANGE "http_copy_range"
+
+#define HTTP_RATIO_FLOOR   (1024*1024)  // http_max_ratio never cuts a body shorter than this
+#define DEFLATE_MAX_RATIO  1032         // the most deflate can expand its input
 
 /* options */
 std::string http_cmd;                   // command to run on each http object
 int http_subproc_max = 10;              // how many subprocesses are we allowed?
 int http_subproc = 0;                   // how many do we currently have?
 int http_alert_fd = -1;                 // where should we send alerts?
+bool http_dedup = false;                // store each distinct body once under outdir/dedup
+int http_cmd_workers = 0;               // long-lived http_cmd processes; 0 to fork one per body
+int http_max_ratio = 250;               // stop inflating a body at this many times its compressed size; 0 for no limit
+uint64_t http_oneshot_max = 16*1024*1024; // inflate compressed bodies up to this size in one call
+bool http_copy_range = true;            // copy uncompressed bodies out of the flow file in the kernel
+
+/* How much a body of zlen compressed bytes may inflate to */
+static uint64_t inflate_limit(uint64_t zlen)
+{
+    if(http_max_ratio<=0) return UINT64_MAX;
+    uint64_t limit = zlen * http_max_ratio;
+    return limit > HTTP_RATIO_FLOOR ? limit : HTTP_RATIO_FLOOR;
+}
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+/* With -S post_threads, several flows are scanned at once; this protects
+ * http_subproc and the dedup directory.
+ */
+static pthread_mutex_t http_M = PTHREAD_MUTEX_INITIALIZER;
+#define HTTP_LOCK()   pthread_mutex_lock(&http_M)
+#define HTTP_UNLOCK() pthread_mutex_unlock(&http_M)
+#else
+#define HTTP_LOCK()
+#define HTTP_UNLOCK()
+#endif
+
+#ifdef HAVE_FORK
+#include <poll.h>
+#include <signal.h>
+
+/**
+ * With -S http_cmd_workers=N, http_cmd is started N times when the first
+ * body is finished and each instance reads body paths from its stdin, one
+ * per line. A command that takes the path as an argument can be wrapped:
+ *
+ *   -S http_cmd='while read f; do mycmd "$f"; done'
+ *
+ * The pipes are non-blocking. A path goes to the next helper with room in
+ * its pipe; the scanner only waits when every pipe is full. The helpers
+ * are sent EOF and reaped when scan_http shuts down.
+ */
+class http_cmd_helpers {
+    /* These are not implemented */
+    http_cmd_helpers(const http_cmd_helpers &);
+    http_cmd_helpers &operator=(const http_cmd_helpers &);
+
+public:
+    http_cmd_helpers():pids(),fds(),next(0),started(false){}
+    void start(const std::string &cmd,int n);
+    void send(const std::string &path);
+    void stop();
+    bool running() const { return started; }
+
+private:
+    std::vector<pid_t> pids;
+    std::vector<int>   fds;             // write end of each helper's stdin; -1 once it has exited
+    size_t next;                        // where to start looking for room
+    bool   started;
+    static ssize_t finish(int fd,const std::string &line,size_t done);
+};
+
+void http_cmd_helpers::start(const std::string &cmd,int n)
+{
+    started = true;
+    signal(SIGPIPE,SIG_IGN);            // a helper that exits must not take us with it
+    for(int i=0;i<n;i++){
+        int p[2];
+        if(pipe(p)){
+            perror("pipe");
+            break;
+        }
+        pid_t pid = fork();
+        if(pid<0) die("Cannot fork child");
+        if(pid==0){
+            /* We are the helper; keep only stdio */
+            dup2(p[0],0);
+            for(int fd=3;fd<getdtablesize();fd++) ::close(fd);
+            execl("/bin/sh","sh","-c",cmd.c_str(),(char *)0);
+            _exit(127);
+        }
+        ::close(p[0]);
+        fcntl(p[1],F_SETFD,FD_CLOEXEC);
+        fcntl(p[1],F_SETFL,fcntl(p[1],F_GETFL) | O_NONBLOCK);
+        pids.push_back(pid);
+        fds.push_back(p[1]);
+    }
+    DEBUG(5)("started %d copies of %s",(int)pids.size(),cmd.c_str());
+}
+
+void http_cmd_helpers::send(const std::string &path)
+{
+    const std::string line = path + "\n";    // one write of at most PIPE_BUF bytes is never split
+    while(true){
+        size_t alive = 0;
+        for(size_t k=0;k<fds.size();k++){
+            size_t i = (next+k) % fds.size();
+            if(fds[i]<0) continue;
+            alive++;
+            ssize_t r = ::write(fds[i],line.data(),line.size());
+            if(r>0 && r<(ssize_t)line.size()){
+                /* A line longer than PIPE_BUF was split; the rest must follow on the same pipe */
+                r = finish(fds[i],line,r);
+            }
+            if(r==(ssize_t)line.size()){
+                next = i+1;
+                return;
+            }
+            if(r<0 && (errno==EAGAIN || errno==EINTR)) continue;
+            DEBUG(1)("http_cmd helper %d is gone: %s",(int)pids[i],strerror(errno));
+            ::close(fds[i]);
+            fds[i] = -1;
+            alive--;
+        }
+        if(alive==0){
+            DEBUG(1)("no http_cmd helpers left; %s not processed",path.c_str());
+            return;
+        }
+        /* every pipe is full; wait for a helper to catch up */
+        std::vector<struct pollfd> pfds;
+        for(size_t i=0;i<fds.size();i++){
+            if(fds[i]<0) continue;
+            struct pollfd pfd;
+            pfd.fd = fds[i];
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            pfds.push_back(pfd);
+        }
+        poll(&pfds[0],pfds.size(),-1);
+    }
+}
+
+/* Write the rest of line, from done, to fd, waiting for room; line.size(), or -1 */
+ssize_t http_cmd_helpers::finish(int fd,const std::string &line,size_t done)
+{
+    while(done<line.size()){
+        ssize_t r = ::write(fd,line.data()+done,line.size()-done);
+        if(r>0){
+            done += r;
+            continue;
+        }
+        if(r<0 && errno==EINTR) continue;
+        if(r<0 && errno==EAGAIN){
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            poll(&pfd,1,-1);
+            continue;
+        }
+        if(r==0) errno = EPIPE;
+        return -1;
+    }
+    return line.size();
+}
+
+void http_cmd_helpers::stop()
+{
+    for(size_t i=0;i<fds.size();i++){
+        if(fds[i]>=0) ::close(fds[i]);
+    }
+    for(size_t i=0;i<pids.size();i++){
+        int status=0;
+        waitpid(pids[i],&status,0);
+    }
+    fds.clear();
+    pids.clear();
+    started = false;
+}
+
+static http_cmd_helpers helpers;
+#endif
+
+
+/**
+ * The headers scan_http looks at, collected without allocating. Names are
+ * matched case-insensitively against a fixed list as they arrive, possibly
+ * split over several callbacks; the values of the ones in the list are
+ * copied into an arena that keeps its capacity from message to message.
+ * Other headers are skipped. A repeated header replaces the earlier value.
+ */
+class http_headers {
+public:
+    enum header_t { CONTENT_TYPE, CONTENT_ENCODING, CONTENT_DISPOSITION, HOST, NUM_HEADERS };
+
+    http_headers():arena(),name_len(0),last(NOTHING),current(NUM_HEADERS){
+        arena.reserve(1024);
+        clear();
+    }
+    void clear(){                       // for the next message
+        arena.clear();
+        name_len = 0;
+        last = NOTHING;
+        current = NUM_HEADERS;
+        for(int i=0;i<NUM_HEADERS;i++) start[i] = len[i] = 0;
+    }
+    void field(const char *at,size_t length){
+        if(last!=FIELD) name_len = 0;   // a new name
+        if(name_len+length <= sizeof(name)){
+            memcpy(name+name_len,at,length);
+        }
+        name_len += length;             // too long to be one of ours if it exceeds name[]
+        last = FIELD;
+    }
+    void value(const char *at,size_t length){
+        if(last==FIELD){                // the first part of the value: which header is it?
+            current = lookup();
+            if(current!=NUM_HEADERS){
+                start[current] = arena.size();
+                len[current] = 0;
+            }
+        }
+        if(current!=NUM_HEADERS){
+            arena.append(at,length);
+            len[current] += length;
+        }
+        last = VALUE;
+    }
+    bool has(header_t h) const { return len[h]>0; }
+    const char *data(header_t h) const { return arena.data()+start[h]; }
+    size_t size(header_t h) const { return len[h]; }
+    bool is(header_t h,const char *val) const { // case-insensitive
+        size_t n = strlen(val);
+        return len[h]==n && strncasecmp(data(h),val,n)==0;
+    }
+    void get(header_t h,std::string &out) const { out.assign(data(h),len[h]); }
+
+private:
+    typedef enum {NOTHING,FIELD,VALUE} last_on_header_t;
+    static const char *names[NUM_HEADERS];
+    std::string arena;
+    char     name[32];
+    size_t   name_len;
+    last_on_header_t last;
+    header_t current;                   // NUM_HEADERS while in a header we don't keep
+    size_t   start[NUM_HEADERS];
+    size_t   len[NUM_HEADERS];
+
+    header_t lookup() const {
+        if(name_len > sizeof(name)) return NUM_HEADERS;
+        for(int i=0;i<NUM_HEADERS;i++){
+            if(strlen(names[i])==name_len && strncasecmp(name,names[i],name_len)==0) return (header_t)i;
+        }
+        return NUM_HEADERS;
+    }
+};
+
+const char *http_headers::names[http_headers::NUM_HEADERS] = {
+    "content-type","content-encoding","content-disposition","host"
+};
+
+/* Append a decimal number, as sprintf would, without a stream */
+static void append_u64(std::string &s,uint64_t v)
+{
+    char buf[24];
+    char *p = buf+sizeof(buf);
+    do {
+        *--p = '0' + (v % 10);
+        v /= 10;
+    } while(v>0);
+    s.append(p,buf+sizeof(buf)-p);
+}
 
+/* A request seen in one direction of a connection, waiting for its response */
+class http_request {
+public:
+    http_request(uint64_t no_,unsigned int method_,const std::string &url_,const std::string &host_):
+        no(no_),method(method_),url(url_),host(host_){}
+    uint64_t    no;                     // 0 for the first request on the connection
+    unsigned int method;                // enum http_method
+    std::string url;
+    std::string host;
+};
+
+/* Shared by the streams of the two flows of a TCP connection. Responses
+ * are paired with requests by their order on the connection, so a response
+ * that is parsed before its request stays unpaired rather than shifting
+ * the pairs after it.
+ */
+class http_connection {
+public:
+    enum { MAX_WAITING=1000 };          // requests kept when no responses are seen
+    http_connection():waiting(),requests(0),responses(0),refs(0){}
+    std::deque<http_request> waiting;
+    uint64_t requests;                  // seen so far
+    uint64_t responses;
+    int      refs;                      // streams using it
+
+    void request(unsigned int method,const std::string &url,const std::string &host){
+        uint64_t no = requests++;
+        if(no < responses) return;      // its response went by unpaired
+        waiting.push_back(http_request(no,method,url,host));
+        if(waiting.size() > MAX_WAITING) waiting.pop_front();
+    }
+    bool response(http_request &req){  // true if the next response has a request
+        uint64_t no = responses++;
+        while(waiting.size()>0 && waiting.front().no < no) waiting.pop_front();
+        if(waiting.size()==0 || waiting.front().no != no) return false;
+        req = waiting.front();
+        waiting.pop_front();
+        return true;
+    }
+};
 
 /* define a callback object for sharing state between scan_http() and its callbacks
  */
 class scan_http_cbo {
 private:
-    typedef enum {NOTHING,FIELD,VALUE} last_on_header_t;
     scan_http_cbo(const scan_http_cbo& c); // not implemented
     scan_http_cbo &operator=(const scan_http_cbo &c); // not implemented
 
 public:
     virtual ~scan_http_cbo(){
         on_message_complete();          // make sure message was ended
+#ifdef USE_LIBDEFLATE
+        if(ld) libdeflate_free_decompressor(ld);
+#endif
     }
-    scan_http_cbo(const std::string& path_,const char *base_,std::stringstream *xmlstream_) :
-        path(path_), base(base_),xmlstream(xmlstream_),xml_fo(),request_no(0),
-        headers(), last_on_header(NOTHING), header_value(), header_field(),
-        output_path(), fd(-1), first_body(true),bytes_written(0),unzip(false),zs(),zinit(false),zfail(false){};
+    scan_http_cbo(const std::string& path_,std::stringstream *xmlstream_) :
+        path(path_), base(0),base_offset(0),xmlstream(xmlstream_),xml_fo(),request_no(0),
+        headers(), content_type(),
+        output_path(), fd(-1), suspended(false), first_body(true),bytes_written(0),hasher(0),
+        unzip(false),zs(),zinit(false),zfail(false),zcapped(false),zin(0),
+        oneshot(false),zlength(0),zbody(),zout(),
+#ifdef USE_LIBDEFLATE
+        ld(0),
+#endif
+        source(),extents(),
+        conn(0),request_xml(){};
+    void set_base(const char *base_,uint64_t offset){ base = base_; base_offset = offset; }
+    void set_connection(http_connection *conn_){ conn = conn_; }
+    void set_source(const std::string &source_){ source = source_; }
+    void suspend();                     // close the body file until more of it arrives
 private:        
         
     const std::string path;             // where data gets written
-    const char *base;                   // where data started in memory
+    const char *base;                   // where the data being parsed is in memory
+    uint64_t base_offset;               // and where it is in the flow
     std::stringstream *xmlstream;       // if present, where to put the fileobject annotations
-    std::stringstream xml_fo;           // xml stream for this file object
+    std::string xml_fo;                 // xml for this file object
     int request_no;                     // request number
         
     /* parsed headers */
-    std::map<std::string, std::string> headers;
-        
-    /* placeholders for possibly-incomplete header data */
-    last_on_header_t last_on_header;
-    std::string header_value, header_field;
+    http_headers headers;
+    std::string content_type;           // for the MIME lookup
     std::string output_path;
     int         fd;                         // fd for writing
+    bool        suspended;                  // fd was closed between parts of the body
     bool        first_body;                 // first call to on_body after headers
     uint64_t    bytes_written;
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    sha256_generator *hasher;               // hash of the body as written, for http_dedup
+#else
+    void        *hasher;
+#endif
 
     /* decompression for gzip-encoded streams. */
     bool     unzip;           // should we be decompressing?
     z_stream zs;              // zstream (avoids casting and memory allocation)
     bool     zinit;           // we have initialized the zstream 
     bool     zfail;           // zstream failed in some manner, so ignore the rest of this stream
+    bool     zcapped;         // output was cut off at http_max_ratio
+    uint64_t zin;             // compressed bytes seen, for http_max_ratio
+
+    /* A compressed body whose Content-Length is known is collected and
+     * inflated in one call; see inflate_oneshot()
+     */
+    bool     oneshot;         // collecting the body in zbody
+    uint64_t zlength;         // its Content-Length
+    std::vector<char> zbody;  // the compressed body
+    std::vector<char> zout;   // and inflated
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_decompressor *ld; // allocated on first use
+#endif
+
+    /* An uncompressed body need not be copied through memory: where it is
+     * in the flow file is recorded, and the body file is made from those
+     * extents with copy_file_range() when the body is finished.
+     */
+    std::string source;                 // the flow file; empty to write from memory
+    std::vector<std::pair<uint64_t,uint64_t> > extents; // offset and length of each part of the body in it
+
+    /* the other direction, when streaming */
+    http_connection *conn;              // 0 if the requests are not known
+    std::string request_xml;            // the request this response answers
 
     /* The static functions are callbacks; they wrap the method calls */
 #define CBO (reinterpret_cast<scan_http_cbo*>(parser->data))
@@ -99,7 +456,7 @@ public:
     static int scan_http_cb_on_url(http_parser * parser, const char *at, size_t length) { return 0;}
     static int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t length) { return CBO->on_header_field(at,length);}
     static int scan_http_cb_on_header_value(http_parser * parser, const char *at, size_t length) { return CBO->on_header_value(at,length); }
-    static int scan_http_cb_on_headers_complete(http_parser * parser) { return CBO->on_headers_complete();}
+    static int scan_http_cb_on_headers_complete(http_parser * parser) { return CBO->on_headers_complete(parser);}
     static int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) { return CBO->on_body(at,length);}
     static int scan_http_cb_on_message_complete(http_parser * parser) {return CBO->on_message_complete();}
 #undef CBO
@@ -108,9 +465,17 @@ private:
     int on_url(const char *at, size_t length);
     int on_header_field(const char *at, size_t length);
     int on_header_value(const char *at, size_t length);
-    int on_headers_complete();
+    int on_headers_complete(const http_parser *parser);
     int on_body(const char *at, size_t length);
     int on_message_complete();          
+    void resume();
+    int  inflate_body(const char *at,size_t length);
+    void inflate_oneshot();
+    int  write_inflated(const char *buf,size_t len);
+    void copy_extents();
+    void hash(const char *buf,size_t len);
+    void dedup();
+    int  open_body(int oflag);
 };
     
 
@@ -135,59 +500,17 @@ int scan_http_cbo::on_url(const char *at, size_t length)
 }
 
 
-/* Note 1: The state machine is defined in http-parser/README.md
- * Note 2: All header field names are converted to lowercase.
- *         This is consistent with the RFC.
- */
+/* Note: The state machine is defined in http-parser/README.md */
 
 int scan_http_cbo::on_header_field(const char *at,size_t length)
 {
-    std::string field(at,length);
-    std::transform(field.begin(), field.end(), field.begin(), ::tolower);
-    
-    switch(last_on_header){
-    case NOTHING:                       
-        // Allocate new buffer and copy callback data into it
-        header_field = field;
-        break;
-    case VALUE:
-        // New header started.
-        // Copy current name,value buffers to headers
-        // list and allocate new buffer for new name
-        headers[header_field] = header_value;
-        header_field = field;
-        break;
-    case FIELD:
-        // Previous name continues. Reallocate name
-        // buffer and append callback data to it
-        header_field.append(field);
-        break;
-    }
-    last_on_header = FIELD;
+    headers.field(at,length);
     return 0;
 }
 
 int scan_http_cbo::on_header_value(const char *at, size_t length)
 {
-    const std::string value(at,length);
-    switch(last_on_header){
-    case FIELD:
-        //Value for current header started. Allocate
-        //new buffer and copy callback data to it
-        header_value = value;
-        break;
-    case VALUE:
-        //Value continues. Reallocate value buffer
-        //and append callback data to it
-        header_value.append(value);
-        break;
-    case NOTHING:
-        // this shouldn't happen
-        DEBUG(10)("Internal error in http-parser");
-        break;
-    }
-    last_on_header = VALUE;
-
+    headers.value(at,length);
     return 0;
 }
 
@@ -197,36 +520,41 @@ int scan_http_cbo::on_header_value(const char *at, size_t length)
  * Also see if decompressing is happening...
  */
 
-int scan_http_cbo::on_headers_complete()
+int scan_http_cbo::on_headers_complete(const http_parser *parser)
 {
     tcpdemux *demux = tcpdemux::getInstance();
+    const unsigned int status = parser->status_code;
 
-    /* Add the most recently read header to the map, if any */
-    if (last_on_header==VALUE) {
-        headers[header_field] = header_value;
-        header_field="";
+    /* Pair the response with its request; 1xx responses come before the real one */
+    request_xml.clear();
+    http_request req(0,0,"","");
+    if (conn && status/100 != 1 && conn->response(req)) {
+        request_xml.append("<http_request method='").append(http_method_str((enum http_method)req.method))
+            .append("' url='").append(dfxml_writer::xmlescape(req.url)).append("'");
+        if (req.host.size()) request_xml.append(" host='").append(dfxml_writer::xmlescape(req.host)).append("'");
+        request_xml.append("/>");
+        /* A response to HEAD has headers that describe a body that is not sent */
+        if (req.method==HTTP_HEAD) return 1;
     }
         
     /* Set output path to <path>-HTTPBODY-nnn.ext for each part.
      * This is not consistent with tcpflow <= 1.3.0, which supported only one HTTPBODY,
      * but it's correct...
      */
-    
-    std::stringstream os;
-    os << path << "-HTTPBODY-" << std::setw(3) << std::setfill('0') << request_no << std::setw(0);
+    char num[16];
+    snprintf(num,sizeof(num),"%03d",request_no);
+    output_path.assign(path).append("-HTTPBODY-").append(num);
 
     /* See if we can guess a file extension */
-    std::string extension = get_extension_for_mime_type(headers["content-type"]);
-    if (extension.size()) {
-        os << "." << extension;
+    headers.get(http_headers::CONTENT_TYPE,content_type);
+    const char *extension = mime_extension(content_type.data(),content_type.size());
+    if (extension) {
+        output_path.append(".").append(extension);
     }
         
-    output_path = os.str();
-        
     /* Choose an output function based on the content encoding */
-    std::string content_encoding(headers["content-encoding"]);
-
-    if ((content_encoding == "gzip" || content_encoding == "deflate") && (demux->opt.gzip_decompress)){
+    if ((headers.is(http_headers::CONTENT_ENCODING,"gzip") || headers.is(http_headers::CONTENT_ENCODING,"deflate"))
+        && (demux->opt.gzip_decompress)){
 #ifdef HAVE_LIBZ
         DEBUG(10) ( "%s: detected zlib content, decompressing", output_path.c_str());
         unzip = true;
@@ -236,12 +564,20 @@ int scan_http_cbo::on_headers_complete()
         DEBUG(5) ( "%s: refusing to decompress since zlib is unavailable", output_path.c_str() );
 #endif
     } 
+
+    /* A chunked body, or one with no Content-Length, can only be inflated as it comes */
+    oneshot = false;
+    if (unzip && (parser->flags & F_CHUNKED)==0) {
+        const uint64_t clen = parser->content_length;
+        if (clen>0 && clen!=(uint64_t)-1 && clen<=http_oneshot_max) {
+            oneshot = true;
+            zlength = clen;
+            zbody.reserve(clen);
+        }
+    }
         
     /* Open the output path */
-    fd = demux->retrying_open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
-    if (fd < 0) {
-        DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
-    }
+    fd = open_body(O_WRONLY|O_CREAT|O_BINARY|O_TRUNC);
     if(http_alert_fd>=0){
         std::stringstream ss;
         ss << "open\t" << output_path << "\n";
@@ -252,6 +588,9 @@ int scan_http_cbo::on_headers_complete()
     }
 
     first_body = true;                  // next call to on_body will be the first one
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    if(http_dedup && fd>=0) hasher = new sha256_generator();
+#endif
         
     /* We can do something smart with the headers here.
      *
@@ -263,21 +602,80 @@ int scan_http_cbo::on_headers_complete()
     return 0;
 }
 
+/* The post-processing threads must not touch the demux's open files;
+ * max_fds was lowered to leave room for them.
+ */
+int scan_http_cbo::open_body(int oflag)
+{
+    tcpdemux *demux = tcpdemux::getInstance();
+    int nfd = demux->pool ? ::open(output_path.c_str(),oflag,0644) : demux->retrying_open(output_path,oflag,0644);
+    if (nfd < 0) {
+        DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
+    }
+    return nfd;
+}
+
+/* When streaming, a body may arrive over the life of a connection; its
+ * file is not kept open between packets, so that open connections do not
+ * use up descriptors that the flow files need.
+ */
+void scan_http_cbo::suspend()
+{
+    if(fd >= 0){
+        if (::close(fd) != 0) {
+            perror("close() of http body");
+        }
+        fd = -1;
+        suspended = true;
+    }
+}
+
+/* Reopen the body file closed by suspend(), positioned at its end.
+ * Not O_APPEND: copy_file_range() refuses to write to an O_APPEND file.
+ */
+void scan_http_cbo::resume()
+{
+    if (fd < 0 && suspended){
+        fd = open_body(O_WRONLY|O_BINARY);
+        if (fd >= 0 && lseek(fd,0,SEEK_END)<0) perror("lseek() of http body");
+        suspended = false;
+    }
+}
+
 /* Write to fd, optionally decompressing as we go */
 int scan_http_cbo::on_body(const char *at,size_t length)
 {
-    if (fd < 0)    return -1;              // no open fd? (internal error)x
+    if (fd < 0 && !suspended) return -1;   // no open fd? (internal error)x
     if (length==0) return 0;               // nothing to write
 
     if(first_body){                      // stuff for first time on_body is called
-        xml_fo << "     <byte_run file_offset='" << (at-base) << "'><fileobject><filename>" << output_path << "</filename>";
+        xml_fo.append("     <byte_run file_offset='");
+        append_u64(xml_fo,base_offset+(at-base));
+        xml_fo.append("'><fileobject><filename>").append(output_path).append("</filename>").append(request_xml);
         first_body = false;
     }
 
+    /* If copying from the flow file, just note where this part is */
+    if(unzip==false && source.size()){
+        const uint64_t offset = base_offset+(at-base);
+        if(extents.size()>0 && extents.back().first+extents.back().second==offset){
+            extents.back().second += length;
+        } else {
+            extents.push_back(std::make_pair(offset,(uint64_t)length));
+        }
+        hash(at,length);
+        bytes_written += length;
+        return 0;
+    }
+
+    resume();
+    if (fd < 0) return -1;
+
     /* If not decompressing, just write the data and return. */
     if(unzip==false){
         int rv = write(fd,at,length);
         if(rv<0) return -1;             // write error; that's bad
+        hash(at,rv);
         bytes_written += rv;
         return 0;
     }
@@ -285,18 +683,23 @@ int scan_http_cbo::on_body(const char *at,size_t length)
 #ifndef HAVE_LIBZ
     assert(0);                          // shoudln't have gotten here
 #endif    
-    if(zfail) return 0;                 // stream was corrupt; ignore rest
-    /* set up this round of decompression, using a small local buffer */
+    if(oneshot){
+        zbody.insert(zbody.end(),at,at+length);
+        if(zbody.size() >= zlength) inflate_oneshot();
+        return 0;
+    }
+    return inflate_body(at,length);
+}
+
+/* Inflate the next part of a body with zlib and write it */
+int scan_http_cbo::inflate_body(const char *at,size_t length)
+{
+    if(zfail) return 0;                 // stream was corrupt or capped; ignore rest
 
     /* Call init if we are not initialized */
     char decompressed[65536];           // where decompressed data goes
     if (!zinit) {
         memset(&zs,0,sizeof(zs));
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
-        
         int rv = inflateInit2(&zs, 32 + MAX_WBITS);      /* 32 auto-detects gzip or deflate */
         if (rv != Z_OK) {
             /* fail! */
@@ -305,15 +708,19 @@ int scan_http_cbo::on_body(const char *at,size_t length)
             return 0;
         }
         zinit = true;                   // successfully initted
-    } else {
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
     }
+    zs.next_in = (Bytef*)at;
+    zs.avail_in = length;
+    zin += length;
         
-    /* iteratively decompress, writing each time */
-    while (zs.avail_in > 0) {
+    /* iteratively decompress, writing each time; a full buffer may leave
+     * more output in zlib even when the input is used up
+     */
+    bool more = true;
+    while (more) {
+        zs.next_out = (Bytef*)decompressed;
+        zs.avail_out = sizeof(decompressed);
+
         /* decompress as much as possible */
         int rv = inflate(&zs, Z_SYNC_FLUSH);
                 
@@ -322,35 +729,227 @@ int scan_http_cbo::on_body(const char *at,size_t length)
             if (zs.avail_in > 0) {
                 /* ...no. */
                 DEBUG(3) ("decompression completed, but with trailing garbage");
-                return 0;
             }
+            zfail = true;               // nothing more to inflate
+            more = false;
+        } else if (rv == Z_BUF_ERROR) {
+            break;                      // needs more input
         } else if (rv != Z_OK) {
             /* some other error */
             DEBUG(3) ("decompression failed (corrupted stream?)");
             zfail = true;               // ignore the rest of this stream
             return 0;
+        } else {
+            more = zs.avail_in > 0 || zs.avail_out == 0;
         }
                 
-        /* successful decompression, at least partly */
-        /* write the result */
-        int bytes_decompressed = sizeof(decompressed) - zs.avail_out;
-        ssize_t written = write(fd, decompressed, bytes_decompressed);
-
-        if (written < bytes_decompressed) {
-            DEBUG(3) ("writing decompressed data failed");
-            zfail= true;
-            return 0;
+        /* successful decompression, at least partly; write the result */
+        if (write_inflated(decompressed, sizeof(decompressed) - zs.avail_out)) return 0;
+    }
+    return 0;
+}
+
+/**
+ * The whole compressed body is in zbody. Inflate it in one call into a
+ * buffer of the right size and write it with one write(). A gzip body
+ * gives its size in its trailer; otherwise the buffer starts at four times
+ * the input and grows. Anything the one call cannot do, a corrupt body or
+ * one that would inflate past http_max_ratio, goes through inflate_body()
+ * instead, which writes what it can.
+ */
+void scan_http_cbo::inflate_oneshot()
+{
+    oneshot = false;
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(&zbody[0]);
+    const size_t in_len = zbody.size();
+    const uint64_t limit = inflate_limit(in_len);
+    const uint64_t most  = (uint64_t)in_len * DEFLATE_MAX_RATIO;
+    const size_t bufmax  = (size_t)(limit < most ? limit : most);
+
+    const bool gzip = in_len >= 18 && in[0]==0x1f && in[1]==0x8b;
+    size_t want = in_len * 4;
+    if (gzip) {
+        uint32_t isize = in[in_len-4] | (in[in_len-3]<<8) | (in[in_len-2]<<16) | ((uint32_t)in[in_len-1]<<24);
+        if (isize > limit) {
+            DEBUG(5) ("%s: gzip trailer gives %u bytes; inflating as a stream",output_path.c_str(),isize);
+            want = 0;
+        } else if (isize > 0) {
+            want = isize;
         }
-        bytes_written += written;
-                
-        /* reset the buffer for the next iteration */
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
+    }
+    if (want > bufmax) want = bufmax;
+
+    bool ok = false;
+    size_t out_len = 0;
+    while (want > 0) {
+        zout.resize(want);
+#ifdef USE_LIBDEFLATE
+        if (!ld) ld = libdeflate_alloc_decompressor();
+        if (!ld) break;
+        enum libdeflate_result r = gzip ?
+            libdeflate_gzip_decompress(ld,in,in_len,&zout[0],want,&out_len) :
+            libdeflate_zlib_decompress(ld,in,in_len,&zout[0],want,&out_len);
+        if (r == LIBDEFLATE_SUCCESS) { ok = true; break; }
+        if (r != LIBDEFLATE_INSUFFICIENT_SPACE) break;
+#else
+        z_stream z;
+        memset(&z,0,sizeof(z));
+        if (inflateInit2(&z, 32 + MAX_WBITS) != Z_OK) break;
+        z.next_in = in;
+        z.avail_in = in_len;
+        z.next_out = reinterpret_cast<Bytef *>(&zout[0]);
+        z.avail_out = want;
+        int rv = inflate(&z, Z_FINISH);
+        out_len = want - z.avail_out;
+        inflateEnd(&z);
+        if (rv == Z_STREAM_END) { ok = true; break; }
+        if (rv != Z_BUF_ERROR || out_len < want) break; // corrupt or truncated, not short of room
+#endif
+        if (want >= bufmax) break;
+        want = want*2 < bufmax ? want*2 : bufmax;
+    }
+
+    if (ok) {
+        zin = in_len;
+        if (write_inflated(&zout[0],out_len)==0) zfail = true; // the body is done
+    } else {
+        DEBUG(5) ("%s: one-shot decompression failed; inflating as a stream",output_path.c_str());
+        inflate_body(&zbody[0],in_len);
+    }
+    zbody.clear();
+}
+
+/* Write inflated bytes, stopping at http_max_ratio. Returns -1 if the rest of the body is to be ignored. */
+int scan_http_cbo::write_inflated(const char *buf,size_t len)
+{
+    const uint64_t limit = inflate_limit(zin);
+    if (bytes_written + len > limit) {
+        DEBUG(3) ("%s: inflates to more than %d times its size; truncated",output_path.c_str(),http_max_ratio);
+        len = limit > bytes_written ? limit - bytes_written : 0;
+        zcapped = true;
+    }
+    ssize_t written = write(fd, buf, len);
+    if (written < (ssize_t)len) {
+        DEBUG(3) ("writing decompressed data failed");
+        zfail = true;
+        return -1;
+    }
+    hash(buf,written);
+    bytes_written += written;
+    if (zcapped) {
+        zfail = true;
+        return -1;
     }
     return 0;
 }
 
 
+/**
+ * Make the body file from its extents in the flow file. On a filesystem
+ * with reflinks (XFS, btrfs) copy_file_range() can share the flow file's
+ * blocks; elsewhere it copies in the kernel. If it can't be used between
+ * these files, the bytes are read and written. bytes_written becomes
+ * what was really copied.
+ */
+void scan_http_cbo::copy_extents()
+{
+    int src = ::open(source.c_str(),O_RDONLY|O_BINARY);
+    if(src<0){
+        DEBUG(1)("%s: cannot open %s: %s",output_path.c_str(),source.c_str(),strerror(errno));
+        bytes_written = 0;
+        return;
+    }
+    off_t out_offset = lseek(fd,0,SEEK_CUR); // the extents go after anything already written
+    if(out_offset<0) out_offset = 0;
+    uint64_t copied = 0;
+    bool in_kernel = true;
+    for(std::vector<std::pair<uint64_t,uint64_t> >::const_iterator e=extents.begin();e!=extents.end();e++){
+        off_t    offset = e->first;
+        uint64_t left   = e->second;
+        while(left>0){
+            ssize_t n = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+            if(in_kernel){
+                n = copy_file_range(src,&offset,fd,&out_offset,left,0);
+                if(n<0 && (errno==EXDEV || errno==EINVAL || errno==ENOSYS || errno==EOPNOTSUPP || errno==EBADF)){
+                    DEBUG(5)("%s: copy_file_range: %s; copying through memory",output_path.c_str(),strerror(errno));
+                    in_kernel = false;
+                    continue;
+                }
+            } else
+#endif
+            {
+                char buf[65536];
+                n = pread(src,buf,left < sizeof(buf) ? left : sizeof(buf),offset);
+                if(n>0 && pwrite(fd,buf,n,out_offset)!=n) n = -1;
+                if(n>0){
+                    offset += n;
+                    out_offset += n;
+                }
+            }
+            if(n<=0){
+                DEBUG(3)("%s: copying %" PRIu64 " bytes from %s failed",output_path.c_str(),e->second,source.c_str());
+                ::close(src);
+                lseek(fd,out_offset,SEEK_SET);
+                bytes_written = copied;
+                return;
+            }
+            left   -= n;
+            copied += n;
+        }
+    }
+    ::close(src);
+    lseek(fd,out_offset,SEEK_SET);      // an explicit offset leaves the file position alone
+    bytes_written = copied;
+}
+
+void scan_http_cbo::hash(const char *buf,size_t len)
+{
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    if(hasher) hasher->update(reinterpret_cast<const uint8_t *>(buf),len);
+#endif
+}
+
+/**
+ * http_dedup: the body has been written and closed. Keep one copy of each
+ * distinct body in outdir/dedup/xx/<sha256> and make output_path a hard link to it.
+ * The hash and what happened are added to the byte_run.
+ */
+void scan_http_cbo::dedup()
+{
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    const std::string hexdigest = hasher->final().hexdigest();
+    delete hasher;
+    hasher = 0;
+
+    const std::string store = tcpdemux::getInstance()->outdir + "/dedup/" + hexdigest.substr(0,2) + "/" + hexdigest;
+    const char *status = "new";
+    HTTP_LOCK();
+    if(access(store.c_str(),F_OK)==0){
+        /* Seen before: replace our copy with a link to the stored one */
+        std::string tmp = output_path + ".dedup";
+        if(::link(store.c_str(),tmp.c_str())==0 && ::rename(tmp.c_str(),output_path.c_str())==0){
+            status = "duplicate";
+        } else {
+            ::unlink(tmp.c_str());
+            /* Probably EMLINK; start a new generation of the stored copy from ours */
+            DEBUG(5)("%s: cannot link to %s: %s",output_path.c_str(),store.c_str(),strerror(errno));
+            ::unlink(store.c_str());
+            status = ::link(output_path.c_str(),store.c_str())==0 ? "new" : "unlinked";
+        }
+    } else {
+        mkdirs_for_path(store);
+        if(::link(output_path.c_str(),store.c_str())){
+            DEBUG(5)("%s: cannot link to %s: %s",output_path.c_str(),store.c_str(),strerror(errno));
+            status = "unlinked";
+        }
+    }
+    HTTP_UNLOCK();
+    xml_fo.append("<hashdigest type='SHA256'>").append(hexdigest).append("</hashdigest>")
+          .append("<dedup status='").append(status).append("'/>");
+#endif
+}
+
 /**
  * called at the conclusion of each HTTP body.
  * Clean out all of the state for this HTTP header/body pair.
@@ -358,24 +957,43 @@ int scan_http_cbo::on_body(const char *at,size_t length)
 
 int scan_http_cbo::on_message_complete()
 {
+    if(extents.size()>0){
+        resume();
+        if(fd >= 0) copy_extents();
+        extents.clear();
+    }
+
+    /* A one-shot body that was cut short is inflated as far as it goes */
+    if(oneshot && zbody.size()>0){
+        oneshot = false;
+        resume();
+        if(fd >= 0) inflate_body(&zbody[0],zbody.size());
+    }
+
     /* Close the file */
     headers.clear();
-    header_field = "";
-    header_value = "";
-    last_on_header = NOTHING;
     if(fd >= 0) {
         if (::close(fd) != 0) {
             perror("close() of http body");
         }
         fd = -1;
     }
+    suspended = false;
 
     /* Erase zero-length files and update the DFXML */
     if(bytes_written>0){
+        if(hasher) dedup();
+        if(zcapped){
+            xml_fo.append("<decompression_truncated max_ratio='");
+            append_u64(xml_fo,http_max_ratio);
+            xml_fo.append("'/>");
+        }
         /* Update DFXML */
         if(xmlstream){
-            xml_fo << "<filesize>" << bytes_written << "</filesize></fileobject></byte_run>\n";
-            if(xmlstream) *xmlstream << xml_fo.str();
+            xml_fo.append("<filesize>");
+            append_u64(xml_fo,bytes_written);
+            xml_fo.append("</filesize></fileobject></byte_run>\n");
+            *xmlstream << xml_fo;
         }
         if(http_alert_fd>=0){
             std::stringstream ss;
@@ -386,24 +1004,34 @@ int scan_http_cbo::on_message_complete()
             }
         }
         if(http_cmd.size()>0 && output_path.size()>0){
-            /* If we are at maximum number of subprocesses, wait for one to exit */
-            std::string cmd = http_cmd + " " + output_path;
 #ifdef HAVE_FORK
-            int status=0;
-            pid_t pid = 0;
-            while(http_subproc >= http_subproc_max){
-                pid = wait(&status);
-                http_subproc--;
-            }
-            /* Fork off a child */
-            pid = fork();
-            if(pid<0) die("Cannot fork child");
-            if(pid==0){
-                /* We are the child */
-                exit(system(cmd.c_str()));
+            if(http_cmd_workers>0){
+                HTTP_LOCK();
+                if(!helpers.running()) helpers.start(http_cmd,http_cmd_workers);
+                helpers.send(output_path);
+                HTTP_UNLOCK();
+            } else {
+                /* If we are at maximum number of subprocesses, wait for one to exit */
+                std::string cmd = http_cmd + " " + output_path;
+                int status=0;
+                pid_t pid = 0;
+                HTTP_LOCK();
+                while(http_subproc >= http_subproc_max){
+                    pid = wait(&status);
+                    http_subproc--;
+                }
+                /* Fork off a child */
+                pid = fork();
+                if(pid<0) die("Cannot fork child");
+                if(pid==0){
+                    /* We are the child */
+                    exit(system(cmd.c_str()));
+                }
+                http_subproc++;
+                HTTP_UNLOCK();
             }
-            http_subproc++;
 #else
+            std::string cmd = http_cmd + " " + output_path;
             system(cmd.c_str());
 #endif            
         }
@@ -415,8 +1043,14 @@ int scan_http_cbo::on_message_complete()
     }
 
     /* Erase the state variables for this part */
-    xml_fo.str("");
-    output_path = "";
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+    if(hasher){
+        delete hasher;
+        hasher = 0;
+    }
+#endif
+    xml_fo.clear();
+    output_path.clear();
     bytes_written=0;
     unzip = false;
     if(zinit){
@@ -424,9 +1058,283 @@ int scan_http_cbo::on_message_complete()
         zinit = false;
     }
     zfail = false;
+    zcapped = false;
+    zin = 0;
+    oneshot = false;
+    zbody.clear();
+    if(zbody.capacity() > HTTP_RATIO_FLOOR || zout.capacity() > HTTP_RATIO_FLOOR){ // don't keep a big body's buffers for the life of the flow
+        std::vector<char>().swap(zbody);
+        std::vector<char>().swap(zout);
+    }
+    return 0;
+}
+
+
+static http_parser_settings scan_http_parser_settings;
+
+static void init_parser_settings()
+{
+    memset(&scan_http_parser_settings,0,sizeof(scan_http_parser_settings)); // in the event that new callbacks get created
+    scan_http_parser_settings.on_message_begin          = scan_http_cbo::scan_http_cb_on_message_begin;
+    scan_http_parser_settings.on_url                    = scan_http_cbo::scan_http_cb_on_url;
+    scan_http_parser_settings.on_header_field           = scan_http_cbo::scan_http_cb_on_header_field;
+    scan_http_parser_settings.on_header_value           = scan_http_cbo::scan_http_cb_on_header_value;
+    scan_http_parser_settings.on_headers_complete       = scan_http_cbo::scan_http_cb_on_headers_complete;
+    scan_http_parser_settings.on_body                   = scan_http_cbo::scan_http_cb_on_body;
+    scan_http_parser_settings.on_message_complete       = scan_http_cbo::scan_http_cb_on_message_complete;
+}
+
+/* Bodies can be copied out of the flow file if it holds the flow as it
+ * was sent. When streaming, the bytes must also be written by the time
+ * the body is finished, which is not so with the async writer.
+ */
+static bool flow_file_is_plain(bool streaming)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    tcpdemux *demux = tcpdemux::getInstance();
+    if(!http_copy_range || demux->opt.compress || demux->container || demux->chunks) return false;
+    return !streaming || demux->aio==0;
+#else
+    return false;
+#endif
+}
+
+/* The connections with a stream on either of their flows */
+typedef std::map<std::string,http_connection *> http_connection_map_t;
+static http_connection_map_t http_connections;
+
+/* The same for both flows of a connection: the lower endpoint comes first */
+static std::string connection_key(const flow_addr &f)
+{
+    std::string a(reinterpret_cast<const char *>(f.src.addr),sizeof(f.src.addr));
+    a.append(reinterpret_cast<const char *>(&f.sport),sizeof(f.sport));
+    std::string b(reinterpret_cast<const char *>(f.dst.addr),sizeof(f.dst.addr));
+    b.append(reinterpret_cast<const char *>(&f.dport),sizeof(f.dport));
+    std::string key = a<b ? a+b : b+a;
+    key.push_back((char)f.family);
+    return key;
+}
+
+/* The request methods that start a request flow; see http_parser.h */
+static bool is_request_start(const std::string &head)
+{
+    static const char *methods[] = {"GET ","POST ","HEAD ","PUT ","DELETE ","OPTIONS ","PATCH ",
+                                    "CONNECT ","TRACE ",0};
+    for(int i=0;methods[i];i++){
+        size_t len = strlen(methods[i]);
+        if(head.size()>=len && head.compare(0,len,methods[i])==0) return true;
+    }
+    return false;
+}
+
+/**
+ * The streaming version parses each direction of a connection as it is
+ * written. A flow that starts with a request method is parsed as requests,
+ * which are recorded in the connection; a flow that starts with "HTTP/1."
+ * (with at least MIN_HTTP_BUFSIZE bytes, as for the whole flow) is parsed
+ * as responses, each paired with its request. Bodies are written as they
+ * arrive, so a keep-alive connection's bodies are complete as soon as each
+ * response is. If a parser stops early, a new one starts where it stopped,
+ * as the whole-flow loop below does.
+ */
+class http_stream : public stream_scanner {
+    /* These are not implemented */
+    http_stream(const http_stream &);
+    http_stream &operator=(const http_stream &);
+
+public:
+    http_stream(const std::string &path_,const std::string &key_);
+    virtual ~http_stream();
+    virtual void on_data(class tcpip &tcp,const uint8_t *data,size_t len);
+    virtual void on_close(class tcpip &tcp,std::stringstream &xmladd);
+
+private:
+    enum {WAITING,REQUESTS,RESPONSES,DONE};
+    const std::string path;             // the flow file
+    const std::string key;              // into http_connections
+    http_connection *conn;
+    std::stringstream xml;              // the <byte_run>s
+    std::string head;                   // the start of the flow, until there is enough to decide
+    int         state;
+    uint64_t    offset;                 // flow offset of the next byte to parse
+    uint64_t    parser_start;           // flow offset where the parser started
+    http_parser parser;
+    scan_http_cbo *cbo;                 // for responses
+
+    /* the request being parsed */
+    std::string url;
+    http_headers headers;
+    std::string host;
+
+    void start();
+    void parse(const char *buf,size_t len);
+
+    /* request callbacks */
+#define STREAM (reinterpret_cast<http_stream*>(parser->data))
+    static int cb_on_message_begin(http_parser *parser) { return STREAM->on_request_begin(); }
+    static int cb_on_url(http_parser *parser,const char *at,size_t length) { STREAM->url.append(at,length); return 0; }
+    static int cb_on_header_field(http_parser *parser,const char *at,size_t length) { return STREAM->on_header_field(at,length); }
+    static int cb_on_header_value(http_parser *parser,const char *at,size_t length) { return STREAM->on_header_value(at,length); }
+    static int cb_on_headers_complete(http_parser *parser) { return STREAM->on_request_headers_complete(); }
+#undef STREAM
+    int on_request_begin();
+    int on_header_field(const char *at,size_t length);
+    int on_header_value(const char *at,size_t length);
+    int on_request_headers_complete();
+
+public:
+    static http_parser_settings request_settings;
+    static void init_request_settings();
+};
+
+http_parser_settings http_stream::request_settings;
+
+void http_stream::init_request_settings()
+{
+    memset(&request_settings,0,sizeof(request_settings));
+    request_settings.on_message_begin    = cb_on_message_begin;
+    request_settings.on_url              = cb_on_url;
+    request_settings.on_header_field     = cb_on_header_field;
+    request_settings.on_header_value     = cb_on_header_value;
+    request_settings.on_headers_complete = cb_on_headers_complete;
+}
+
+http_stream::http_stream(const std::string &path_,const std::string &key_):
+    path(path_),key(key_),conn(0),xml(),head(),state(WAITING),offset(0),parser_start(0),parser(),cbo(0),
+    url(),headers(),host()
+{
+    http_connection_map_t::iterator it = http_connections.find(key);
+    if(it==http_connections.end()){
+        it = http_connections.insert(std::make_pair(key,new http_connection())).first;
+    }
+    conn = it->second;
+    conn->refs++;
+}
+
+http_stream::~http_stream()
+{
+    if(cbo) delete cbo;
+    if(--conn->refs==0){
+        http_connections.erase(key);
+        delete conn;
+    }
+}
+
+int http_stream::on_request_begin()
+{
+    url.clear();
+    headers.clear();
     return 0;
 }
 
+int http_stream::on_header_field(const char *at,size_t length)
+{
+    headers.field(at,length);
+    return 0;
+}
+
+int http_stream::on_header_value(const char *at,size_t length)
+{
+    headers.value(at,length);
+    return 0;
+}
+
+int http_stream::on_request_headers_complete()
+{
+    headers.get(http_headers::HOST,host);
+    conn->request(parser.method,url,host);
+    return 0;
+}
+
+void http_stream::start()
+{
+    if(cbo){
+        delete cbo;                     // finishes its message
+        cbo = 0;
+    }
+    if(state==REQUESTS){
+        http_parser_init(&parser, HTTP_REQUEST);
+        parser.data = this;
+    } else {
+        http_parser_init(&parser, HTTP_RESPONSE);
+        cbo = new scan_http_cbo(path,&xml);
+        cbo->set_connection(conn);
+        if(flow_file_is_plain(true)) cbo->set_source(path);
+        parser.data = cbo;
+    }
+    parser_start = offset;
+}
+
+void http_stream::parse(const char *buf,size_t len)
+{
+    const http_parser_settings *settings = state==REQUESTS ? &request_settings : &scan_http_parser_settings;
+    while(len>0 && state!=DONE){
+        if(cbo) cbo->set_base(buf,offset);
+        size_t parsed = http_parser_execute(&parser, settings, buf, len);
+        assert(parsed <= len);
+        offset += parsed;
+        buf    += parsed;
+        len    -= parsed;
+        if(len==0) break;               // wait for more
+
+        /* Stop parsing if a new parser parsed nothing, as that indicates something header! */
+        if(parsed==0 && offset==parser_start){
+            state = DONE;
+            break;
+        }
+        /* Stop parsing if we're a connection upgrade (e.g. WebSockets) */
+        if (parser.upgrade) {
+            DEBUG(9) ("upgrade connection detected (WebSockets?); cowardly refusing to dump further");
+            state = DONE;
+            break;
+        }
+        start();
+    }
+    if(cbo) cbo->suspend();
+}
+
+void http_stream::on_data(class tcpip &tcp,const uint8_t *data,size_t len)
+{
+    if(state==DONE) return;
+    if(state==WAITING){
+        head.append(reinterpret_cast<const char *>(data),len);
+        if(is_request_start(head)){
+            state = REQUESTS;
+        } else if(head.size()<MIN_HTTP_BUFSIZE){
+            return;
+        } else if(head.compare(0,7,"HTTP/1.")==0){
+            state = RESPONSES;          // smells enough like HTTP to try parsing
+        } else {
+            state = DONE;
+            head.clear();
+            return;
+        }
+        start();
+        std::string buf;
+        buf.swap(head);
+        parse(buf.data(),buf.size());
+        return;
+    }
+    offset = tcp.stream->position();    // differs from the bytes seen if some were inserted before the flow
+    parse(reinterpret_cast<const char *>(data),len);
+}
+
+void http_stream::on_close(class tcpip &tcp,std::stringstream &xmladd)
+{
+    if(cbo==0) return;                  // no responses
+    /* Indicate EOF (flushing callbacks) */
+    if(state==RESPONSES) http_parser_execute(&parser, &scan_http_parser_settings, NULL, 0);
+    delete cbo;
+    cbo = 0;
+    xmladd << "\n    <byte_runs>\n" << xml.str() << "    </byte_runs>";
+}
+
+static stream_scanner *http_stream_factory(class tcpip &tcp)
+{
+    /* Not for TLS, SSH and the like; UNKNOWN may still be HTTP split oddly */
+    if(tcp.myflow.protocol>protocol_classifier::UNKNOWN && tcp.myflow.protocol!=protocol_classifier::HTTP) return 0;
+    return new http_stream(tcp.flow_pathname,connection_key(tcp.myflow));
+}
 
 /***
  * the HTTP scanner plugin itself
@@ -446,24 +1354,34 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
         sp.info->flags = scanner_info::SCANNER_DISABLED; // default disabled
         sp.info->get_config(HTTP_CMD,&http_cmd,"Command to execute on each HTTP attachment");
         sp.info->get_config(HTTP_ALERT_FD,&http_alert_fd,"File descriptor to send information about completed HTTP attachments");
+        sp.info->get_config(HTTP_DEDUP,&http_dedup,"Store identical HTTP bodies once, hard linked from outdir/dedup");
+        sp.info->get_config(HTTP_CMD_WORKERS,&http_cmd_workers,"Start this many copies of http_cmd once and send them body paths on stdin (0 to run it per body)");
+        sp.info->get_config(HTTP_MAX_RATIO,&http_max_ratio,"Stop decompressing a body at this many times its compressed size (0 for no limit)");
+        sp.info->get_config(HTTP_ONESHOT_MAX,&http_oneshot_max,"Decompress gzip/deflate bodies with a Content-Length up to this size in one call");
+        sp.info->get_config(HTTP_COPY_RANGE,&http_copy_range,"Make uncompressed bodies with copy_file_range from the flow file instead of writing them");
+#ifndef HAVE_EVP_GET_DIGESTBYNAME
+        if(http_dedup){
+            std::cerr << HTTP_DEDUP << " requires OpenSSL; bodies will not be deduplicated\n";
+            http_dedup = false;
+        }
+#endif
+        init_parser_settings();
+        http_stream::init_request_settings();
+        stream_scanners::add(sp.info->name,http_stream_factory);
         return;         /* No feature files created */
     }
 
+#ifdef HAVE_FORK
+    if(sp.phase==scanner_params::PHASE_SHUTDOWN){
+        if(helpers.running()) helpers.stop(); // wait for the last bodies to be processed
+        return;
+    }
+#endif
+
     if(sp.phase==scanner_params::PHASE_SCAN){
         /* See if there is an HTTP response */
         if(sp.sbuf.bufsize>=MIN_HTTP_BUFSIZE && sp.sbuf.memcmp(reinterpret_cast<const uint8_t *>("HTTP/1."),0,7)==0){
             /* Smells enough like HTTP to try parsing */
-            /* Set up callbacks */
-            http_parser_settings scan_http_parser_settings;
-            memset(&scan_http_parser_settings,0,sizeof(scan_http_parser_settings)); // in the event that new callbacks get created
-            scan_http_parser_settings.on_message_begin          = scan_http_cbo::scan_http_cb_on_message_begin;
-            scan_http_parser_settings.on_url                    = scan_http_cbo::scan_http_cb_on_url;
-            scan_http_parser_settings.on_header_field           = scan_http_cbo::scan_http_cb_on_header_field;
-            scan_http_parser_settings.on_header_value           = scan_http_cbo::scan_http_cb_on_header_value;
-            scan_http_parser_settings.on_headers_complete       = scan_http_cbo::scan_http_cb_on_headers_complete;
-            scan_http_parser_settings.on_body                   = scan_http_cbo::scan_http_cb_on_body;
-            scan_http_parser_settings.on_message_complete       = scan_http_cbo::scan_http_cb_on_message_complete;
-                        
             if(sp.sxml) (*sp.sxml) << "\n    <byte_runs>\n";
             for(size_t offset=0;;){
                 /* Set up a parser instance for the next chunk of HTTP responses and data.
@@ -483,7 +1401,9 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
                 http_parser parser;
                 http_parser_init(&parser, HTTP_RESPONSE);
 
-                scan_http_cbo cbo(sp.sbuf.pos0.path,base,sp.sxml);
+                scan_http_cbo cbo(sp.sbuf.pos0.path,sp.sxml);
+                cbo.set_base(base,offset);
+                if(sp.depth==0 && flow_file_is_plain(false)) cbo.set_source(sp.sbuf.pos0.path);
                 parser.data = &cbo;
 
                 /* Parse */
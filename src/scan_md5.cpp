@@ -3,15 +3,293 @@
  * scan_md5:
  * plug-in demonstration that shows how to write a simple plug-in scanner that calculates
  * the MD5 of each file..
+ *
+ * -S hash_types=md5,sha1,sha256,blake3 computes several digests in the one
+ * pass over the flow; blake3 is there if tcpflow was built with libblake3.
+ *
+ * A flow is not hashed while it is shorter than -S hash_batch_bytes. If it
+ * is still that short when many flows close at once, its MD5 and SHA-256
+ * are computed with the others' in the lanes of mb_hash.
  */
 
 #include "config.h"
-#include "bulk_extractor_i.h"
-#include "dfxml/src/hash_t.h"
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "stream_scanner.h"
+#include "mb_hash.h"
 
 #include <iostream>
+#include <algorithm>
 #include <sys/types.h>
 
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+#include <openssl/evp.h>
+
+#if defined(HAVE_BLAKE3_H) && defined(HAVE_LIBBLAKE3)
+#  include <blake3.h>
+#  define USE_BLAKE3
+#endif
+
+#define HASH_TYPES "hash_types"
+#define HASH_BATCH_BYTES "hash_batch_bytes"
+static std::string hash_types("md5");
+static uint32_t hash_batch_bytes = 4096; // flows up to this long can wait to be hashed in a batch
+
+struct digest_type {
+    const char *name;                   // in -S hash_types
+    const char *xml_name;               // in <hashdigest type=...>
+    const EVP_MD *(*md)(void);          // 0 for BLAKE3
+    int mb;                             // the mb_hash::alg_t; -1 if it has none
+};
+
+static const digest_type known_digests[] = {
+    {"md5","MD5",EVP_md5,mb_hash::MD5},
+    {"sha1","SHA1",EVP_sha1,-1},
+    {"sha256","SHA256",EVP_sha256,mb_hash::SHA256},
+#ifdef USE_BLAKE3
+    {"blake3","BLAKE3",0,-1},
+#endif
+};
+
+static std::vector<const digest_type *> digests; // the ones in hash_types, in its order
+
+static void choose_digests(const std::string &types)
+{
+    std::stringstream ss(types);
+    std::string name;
+    while(std::getline(ss,name,',')){
+        std::transform(name.begin(),name.end(),name.begin(),::tolower);
+        const digest_type *d = 0;
+        for(size_t i=0;i<sizeof(known_digests)/sizeof(known_digests[0]);i++){
+            if(name==known_digests[i].name) d = &known_digests[i];
+        }
+        if(d==0){
+            std::cerr << "scan_md5: unknown hash type '" << name << "'\n";
+            continue;
+        }
+        if(std::find(digests.begin(),digests.end(),d)==digests.end()) digests.push_back(d);
+    }
+    if(digests.empty()) digests.push_back(&known_digests[0]);
+}
+
+/* The chosen digests of one flow, updated together */
+class multi_hash {
+    /* These are not implemented */
+    multi_hash(const multi_hash &);
+    multi_hash &operator=(const multi_hash &);
+
+public:
+    enum { BLOCK=16384 };               // each digest takes a block while it is in cache
+
+    multi_hash(bool batch):ctx(),held(batch && hash_batch_bytes>0),pending(),batched(),done()
+#ifdef USE_BLAKE3
+                ,b3()
+#endif
+    {
+        for(std::vector<const digest_type *>::const_iterator d=digests.begin();d!=digests.end();d++){
+            EVP_MD_CTX *c = 0;
+            if((*d)->md){
+                c = EVP_MD_CTX_create();
+                EVP_DigestInit_ex(c,(*d)->md(),NULL);
+            }
+#ifdef USE_BLAKE3
+            else blake3_hasher_init(&b3);
+#endif
+            ctx.push_back(c);
+        }
+        batched.resize(digests.size()*32);
+        done.resize(digests.size());
+    }
+    ~multi_hash(){
+        for(std::vector<EVP_MD_CTX *>::const_iterator c=ctx.begin();c!=ctx.end();c++){
+            if(*c) EVP_MD_CTX_destroy(*c);
+        }
+    }
+    void update(const uint8_t *buf,size_t len){
+        if(held){
+            if(pending.size()+len <= hash_batch_bytes){
+                pending.insert(pending.end(),buf,buf+len);
+                return;
+            }
+            release();                  // too long to wait for a batch
+        }
+        hash(buf,len);
+    }
+    void copy(const multi_hash &from){  // take its state
+        for(size_t i=0;i<ctx.size();i++){
+            if(ctx[i]) EVP_MD_CTX_copy_ex(ctx[i],from.ctx[i]);
+        }
+#ifdef USE_BLAKE3
+        b3 = from.b3;
+#endif
+        held    = from.held;
+        pending = from.pending;
+        batched = from.batched;
+        done    = from.done;
+    }
+    void add_jobs(mb_hash::alg_t alg,std::vector<mb_hash::job> &jobs){ // the digests a batch can do
+        if(!held) return;
+        for(size_t i=0;i<digests.size();i++){
+            if(digests[i]->mb!=alg || done[i]) continue;
+            jobs.push_back(mb_hash::job(pending.size() ? &pending[0] : 0,pending.size(),&batched[i*32]));
+        }
+    }
+    void batch_done(mb_hash::alg_t alg){ // the jobs from add_jobs() were run
+        if(!held) return;
+        for(size_t i=0;i<digests.size();i++){
+            if(digests[i]->mb==alg) done[i] = true;
+        }
+    }
+    void final(std::ostream &xml){      // the <hashdigest>s
+        static const char hexbuf[] = "0123456789abcdef";
+        if(held) release();
+        for(size_t i=0;i<ctx.size();i++){
+            uint8_t md[EVP_MAX_MD_SIZE];
+            unsigned int mdlen = 0;
+            if(done[i]){
+                mdlen = mb_hash::digest_size((mb_hash::alg_t)digests[i]->mb);
+                memcpy(md,&batched[i*32],mdlen);
+            }
+            else if(ctx[i]) EVP_DigestFinal_ex(ctx[i],md,&mdlen);
+#ifdef USE_BLAKE3
+            else {
+                blake3_hasher_finalize(&b3,md,BLAKE3_OUT_LEN);
+                mdlen = BLAKE3_OUT_LEN;
+            }
+#endif
+            char hex[EVP_MAX_MD_SIZE*2];
+            for(unsigned int j=0;j<mdlen;j++){
+                hex[j*2]   = hexbuf[md[j]>>4];
+                hex[j*2+1] = hexbuf[md[j]&0x0f];
+            }
+            xml << "<hashdigest type='" << digests[i]->xml_name << "'>";
+            xml.write(hex,mdlen*2);
+            xml << "</hashdigest>";
+        }
+    }
+
+private:
+    std::vector<EVP_MD_CTX *> ctx;      // one per digest; 0 for BLAKE3
+    bool held;                          // the flow so far is in pending, not hashed
+    std::vector<uint8_t> pending;
+    std::vector<uint8_t> batched;       // 32 bytes per digest, from a batch
+    std::vector<bool> done;             // per digest: batched has it
+#ifdef USE_BLAKE3
+    blake3_hasher b3;
+#endif
+
+    void hash(const uint8_t *buf,size_t len){
+        while(len>0){
+            size_t n = len < BLOCK ? len : BLOCK;
+            for(size_t i=0;i<ctx.size();i++){
+                if(done[i]) continue;
+                if(ctx[i]) EVP_DigestUpdate(ctx[i],buf,n);
+#ifdef USE_BLAKE3
+                else blake3_hasher_update(&b3,buf,n);
+#endif
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+    void release(){                     // hash what was held
+        held = false;
+        if(pending.size()) hash(&pending[0],pending.size());
+        std::vector<uint8_t>().swap(pending);
+    }
+};
+
+/* The streaming version hashes each flow as it is written */
+class hash_stream : public stream_scanner {
+    /* These are not implemented */
+    hash_stream(const hash_stream &);
+    hash_stream &operator=(const hash_stream &);
+
+public:
+    hash_stream(class tcpip &flow_):flow(flow_),hasher(true),checkpoint(0),checkpoint_offset(0){
+        open_streams[&flow] = this;
+    }
+    virtual ~hash_stream(){
+        open_streams.erase(&flow);
+        delete checkpoint;
+    }
+    virtual void on_data(class tcpip &tcp,const uint8_t *data,size_t len){
+        hasher.update(data,len);
+    }
+    virtual void on_gap(class tcpip &tcp,uint64_t offset,uint64_t len){
+        if(checkpoint) return;
+        checkpoint = new multi_hash(true);
+        checkpoint->copy(hasher);
+        checkpoint_offset = offset;
+    }
+    virtual void on_close(class tcpip &tcp,std::stringstream &xmladd){
+        if(checkpoint && tcp.stream->late_bytes>0) rehash(tcp);
+        hasher.final(xmladd);
+    }
+    typedef std::map<const class tcpip *,hash_stream *> open_streams_t;
+    static open_streams_t open_streams; // for hash_closing()
+    class tcpip &flow;
+    multi_hash hasher;
+private:
+    multi_hash *checkpoint;             // the state before the first gap the stream passed on as zeros
+    uint64_t checkpoint_offset;
+    void rehash(class tcpip &tcp);
+};
+
+hash_stream::open_streams_t hash_stream::open_streams;
+
+/* Data for a gap arrived after the stream had passed the gap on as zeros.
+ * A flow file written in place has the data, so the stream's digest is not
+ * of the file. Go back to the state before the first gap and hash the file
+ * from there. Compressed and chunked flows drop late data as the stream does.
+ */
+void hash_stream::rehash(class tcpip &tcp)
+{
+    tcpdemux *demux = tcpdemux::getInstance();
+    if(tcp.compressor || demux->chunks) return;
+    sbuf_t *sbuf = demux->read_flow(&tcp);
+    if(sbuf==0 || sbuf->bufsize < checkpoint_offset){
+        DEBUG(2)("%s: cannot read the flow again to hash the late data",tcp.flow_pathname.c_str());
+        delete sbuf;
+        return;
+    }
+    DEBUG(10)("%s: %" PRIu64 " bytes arrived for gaps; hashing from offset %" PRIu64 " again",
+              tcp.flow_pathname.c_str(),tcp.stream->late_bytes,checkpoint_offset);
+    hasher.copy(*checkpoint);
+    hasher.update(sbuf->buf+checkpoint_offset,sbuf->bufsize-checkpoint_offset);
+    delete sbuf;
+}
+
+static stream_scanner *hash_stream_factory(class tcpip &tcp)
+{
+    return new hash_stream(tcp);
+}
+
+/* Many flows are about to close: hash the short ones side by side */
+static void hash_closing(const std::vector<class tcpip *> &flows)
+{
+    static const mb_hash::alg_t algs[] = {mb_hash::MD5,mb_hash::SHA256};
+    for(size_t a=0;a<sizeof(algs)/sizeof(algs[0]);a++){
+        if(!mb_hash::worth_batching(algs[a])) continue;
+        std::vector<mb_hash::job> jobs;
+        std::vector<hash_stream *> streams;
+        for(std::vector<class tcpip *>::const_iterator it=flows.begin();it!=flows.end();it++){
+            hash_stream::open_streams_t::const_iterator s = hash_stream::open_streams.find(*it);
+            if(s==hash_stream::open_streams.end()) continue;
+            size_t before = jobs.size();
+            s->second->hasher.add_jobs(algs[a],jobs);
+            if(jobs.size()>before) streams.push_back(s->second);
+        }
+        if(jobs.size()<2) continue;     // not a batch
+        DEBUG(10)("hashing %zu flows in a batch on %s",jobs.size(),mb_hash::engine());
+        mb_hash::digest(algs[a],jobs);
+        for(std::vector<hash_stream *>::const_iterator s=streams.begin();s!=streams.end();s++){
+            (*s)->hasher.batch_done(algs[a]);
+        }
+    }
+}
+#endif
 
 extern "C"
 void  scan_md5(const class scanner_params &sp,const recursion_control_block &rcb)
@@ -26,15 +304,28 @@ void  scan_md5(const class scanner_params &sp,const recursion_control_block &rcb
     if(sp.phase==scanner_params::PHASE_STARTUP){
 	sp.info->name  = "md5";
 	sp.info->flags = scanner_info::SCANNER_DISABLED;
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+        sp.info->get_config(HASH_TYPES,&hash_types,"Digests of each flow, any of md5,sha1,sha256"
+#ifdef USE_BLAKE3
+                            ",blake3"
+#endif
+                            );
+        sp.info->get_config(HASH_BATCH_BYTES,&hash_batch_bytes,"Keep flows up to this long unhashed, to hash them in a batch if many close at once (0 to hash as they arrive)");
+        choose_digests(hash_types);
+        stream_scanners::add(sp.info->name,hash_stream_factory);
+        stream_scanners::add_closing_hook(hash_closing);
+#else
+        stream_scanners::add(sp.info->name,0); // nothing to compute
+#endif
         return;     /* No feature files created */
     }
 
 #ifdef HAVE_EVP_GET_DIGESTBYNAME
     if(sp.phase==scanner_params::PHASE_SCAN){
-	static const std::string hash0("<hashdigest type='MD5'>");
-	static const std::string hash1("</hashdigest>");
 	if(sp.sxml){
-            (*sp.sxml) << hash0 << md5_generator::hash_buf(sp.sbuf.buf,sp.sbuf.bufsize).hexdigest() << hash1;
+            multi_hash hasher(false);
+            hasher.update(sp.sbuf.buf,sp.sbuf.bufsize);
+            hasher.final(*sp.sxml);
         }
 	return;
     }
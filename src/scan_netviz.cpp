@@ -10,6 +10,7 @@
 #include <sys/types.h>
 
 #include "bulk_extractor_i.h"
+#include "stream_scanner.h"
 
 #ifdef HAVE_LIBCAIRO
 #include "netviz/one_page_report.h"
@@ -51,6 +52,7 @@ void  scan_netviz(const class scanner_params &sp,const recursion_control_block &
 	sp.info->flags = scanner_info::SCANNER_DISABLED; // disabled by default
 	sp.info->author= "Mike Shick";
 	sp.info->packet_user = 0;
+        stream_scanners::add(sp.info->name,0); // packets only; flows are not scanned
 #ifdef HAVE_LIBCAIRO
         sp.info->description = "Performs 1-page visualization of network packets";
 	sp.info->packet_cb = netviz_process_packet;
@@ -0,0 +1,193 @@
+/**
+ *
+ * scan_pattern:
+ * Looks for the strings in -S pattern_file (one per line; see
+ * pattern_set.cpp) in each flow, as the flow is written. Matches that
+ * span packets are found, as long as no gap was given up between them.
+ *
+ * Each match goes to the pattern feature file, with up to
+ * PATTERN_CONTEXT bytes either side of it from the same segment, and each
+ * flow with a match gets a <patterns> element in its <fileobject>. The
+ * report's summary says how fast the flows were scanned, per core.
+ *
+ * -S pattern_nocase=1 ignores ASCII case.
+ * -S pattern_max_hits limits the feature lines written for one flow; the
+ * counts in the XML are not limited.
+ */
+
+#include "config.h"
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "stream_scanner.h"
+#include "pattern_set.h"
+
+#include <iostream>
+#include <map>
+#include <time.h>
+
+#define PATTERN_FILE "pattern_file"
+#define PATTERN_NOCASE "pattern_nocase"
+#define PATTERN_MAX_HITS "pattern_max_hits"
+#define PATTERN_FEATURE "pattern"
+#define PATTERN_CONTEXT 16
+
+static std::string pattern_file;
+static bool pattern_nocase = false;
+static uint32_t pattern_max_hits = 1000;
+static pattern_set patterns;
+
+/* Time spent scanning, over all threads, for bytes per second per core */
+static uint64_t scanned_bytes = 0;
+static uint64_t scanned_ns = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* A pattern as it can go in XML */
+static std::string printable(const std::string &s)
+{
+    static const char hexbuf[] = "0123456789abcdef";
+    std::string ret;
+    for(size_t i=0;i<s.size();i++){
+        uint8_t ch = s[i];
+        if(ch>=' ' && ch<0x7f && ch!='\\'){
+            ret.push_back(ch);
+        } else {
+            ret.append("\\x");
+            ret.push_back(hexbuf[ch>>4]);
+            ret.push_back(hexbuf[ch&0x0f]);
+        }
+    }
+    return ret;
+}
+
+/* The matches in one flow */
+class pattern_hits {
+public:
+    pattern_hits():st(),found(),counts(),total(0){}
+
+    /* the next len bytes of the flow at path, which start at offset */
+    void scan(const std::string &path,uint64_t offset,const uint8_t *data,size_t len){
+        uint64_t t0 = now_ns();
+        found.clear();
+        patterns.scan(st,data,len,found);
+        __sync_fetch_and_add(&scanned_bytes,len);
+        __sync_fetch_and_add(&scanned_ns,now_ns()-t0);
+        if(found.size()) record(path,offset,data,len);
+    }
+    void gap(){                         // a match cannot span a gap
+        st = pattern_set::stream();
+    }
+    void xml(std::ostream &os) const {
+        if(total==0) return;
+        os << "<patterns hits='" << total << "'>";
+        for(counts_t::const_iterator it=counts.begin();it!=counts.end();it++){
+            os << "<pattern count='" << it->second.first << "' offset='" << it->second.second << "'>"
+               << dfxml_writer::xmlescape(printable(patterns.pattern(it->first))) << "</pattern>";
+        }
+        os << "</patterns>";
+    }
+
+private:
+    typedef std::map<uint32_t,std::pair<uint64_t,uint64_t> > counts_t; // pattern to count, first offset
+    pattern_set::stream st;
+    std::vector<pattern_set::hit> found;
+    counts_t counts;
+    uint64_t total;
+
+    void record(const std::string &path,uint64_t offset,const uint8_t *data,size_t len){
+        feature_recorder *fr = tcpdemux::getInstance()->fs->get_name(PATTERN_FEATURE);
+        for(std::vector<pattern_set::hit>::const_iterator h=found.begin();h!=found.end();h++){
+            const size_t plen = patterns.pattern(h->pattern).size();
+            const uint64_t start = offset+h->end-plen; // may be in an earlier segment
+            counts_t::iterator c = counts.find(h->pattern);
+            if(c==counts.end()) c = counts.insert(std::make_pair(h->pattern,std::make_pair((uint64_t)0,start))).first;
+            c->second.first++;
+            if(fr && total<pattern_max_hits){
+                size_t from = h->end>plen+PATTERN_CONTEXT ? h->end-plen-PATTERN_CONTEXT : 0;
+                size_t to   = std::min(len,h->end+PATTERN_CONTEXT);
+                fr->write(pos0_t(path,start),patterns.pattern(h->pattern),
+                          std::string(reinterpret_cast<const char *>(data)+from,to-from));
+            }
+            total++;
+        }
+    }
+};
+
+/* The streaming version scans each flow as it is written */
+class pattern_stream : public stream_scanner {
+public:
+    pattern_stream():hits(),offset(0){}
+    virtual void on_data(class tcpip &tcp,const uint8_t *data,size_t len){
+        hits.scan(tcp.flow_pathname,offset,data,len);
+        offset += len;
+    }
+    virtual void on_gap(class tcpip &tcp,uint64_t gap_offset,uint64_t len){
+        hits.gap();
+        offset = gap_offset+len;
+    }
+    virtual void on_close(class tcpip &tcp,std::stringstream &xmladd){
+        hits.xml(xmladd);
+    }
+private:
+    pattern_hits hits;
+    uint64_t offset;
+};
+
+static stream_scanner *pattern_stream_factory(class tcpip &tcp)
+{
+    if(patterns.size()==0) return 0;
+    return new pattern_stream();
+}
+
+extern "C"
+void  scan_pattern(const class scanner_params &sp,const recursion_control_block &rcb)
+{
+    if(sp.sp_version!=scanner_params::CURRENT_SP_VERSION){
+	std::cerr << "scan_pattern requires sp version " << scanner_params::CURRENT_SP_VERSION << "; "
+		  << "got version " << sp.sp_version << "\n";
+	exit(1);
+    }
+
+    if(sp.phase==scanner_params::PHASE_STARTUP){
+	sp.info->name  = "pattern";
+	sp.info->flags = scanner_info::SCANNER_DISABLED;
+        sp.info->feature_names.insert(PATTERN_FEATURE);
+        sp.info->get_config(PATTERN_FILE,&pattern_file,"File of strings to look for in each flow, one per line");
+        sp.info->get_config(PATTERN_NOCASE,&pattern_nocase,"Ignore ASCII case when looking for the strings");
+        sp.info->get_config(PATTERN_MAX_HITS,&pattern_max_hits,"Most feature lines to write for one flow");
+        if(pattern_file.size()){
+            std::string err;
+            if(!patterns.load(pattern_file,err)) die("scan_pattern: %s",err.c_str());
+            patterns.compile(pattern_nocase);
+            DEBUG(2)("%zu patterns from %s; %u byte window, %zu byte filter",patterns.size(),
+                     pattern_file.c_str(),patterns.window_size(),patterns.filter_bytes());
+        }
+        stream_scanners::add(sp.info->name,pattern_stream_factory);
+        return;
+    }
+
+    if(sp.phase==scanner_params::PHASE_SCAN){
+        if(patterns.size()==0) return;
+        pattern_hits hits;
+        hits.scan(sp.sbuf.pos0.path,0,sp.sbuf.buf,sp.sbuf.bufsize);
+        if(sp.sxml) hits.xml(*sp.sxml);
+        return;
+    }
+
+    if(sp.phase==scanner_params::PHASE_SHUTDOWN){
+        if(scanned_bytes==0) return;
+        const double seconds = scanned_ns/1e9;
+        const double mbps = seconds>0 ? scanned_bytes/seconds/1e6 : 0;
+        DEBUG(2)("pattern scan: %" PRIu64 " bytes in %.3f seconds, %.0f MB/s per core",scanned_bytes,seconds,mbps);
+        if(sp.sxml){
+            (*sp.sxml) << "<pattern_scan patterns='" << patterns.size() << "' bytes='" << scanned_bytes
+                       << "' seconds='" << seconds << "' mb_per_sec_per_core='" << (uint64_t)mbps << "'/>\n";
+        }
+    }
+}
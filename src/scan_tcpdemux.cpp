@@ -18,6 +18,7 @@
 #include <iostream>
 #include <sys/types.h>
 #include "bulk_extractor_i.h"
+#include "stream_scanner.h"
 
 
 /** callback called by process_packet()
@@ -42,6 +43,7 @@ void  scan_tcpdemux(const class scanner_params &sp,const recursion_control_block
 	sp.info->author= "Simson Garfinkel";
 	sp.info->packet_user = tcpdemux::getInstance();
 	sp.info->packet_cb = packet_handler;
+        stream_scanners::add(sp.info->name,0); // packets only; flows are not scanned
         
         sp.info->get_config("tcp_timeout",&tcpdemux::getInstance()->tcp_timeout,"Timeout for TCP connections");
 
@@ -0,0 +1,433 @@
+/**
+ *
+ * scan_tls:
+ * Parses the TLS handshake at the start of each flow, as it is written.
+ * The ClientHello gives the server name, the ALPN protocols, the cipher
+ * suites and the JA3 and JA4 fingerprints; the ServerHello gives the
+ * version and cipher chosen and the JA3S fingerprint; before TLS 1.3 the
+ * server's certificates are in the clear, and each one's SHA-256 is
+ * recorded. They go in a <tls_client_hello> or <tls_server_hello> in the
+ * <fileobject>, and the server names and certificate hashes go to the tls
+ * feature file.
+ *
+ * -S tls_stop=1 stops writing the flow at its first ChangeCipherSpec or
+ * application data record, so only the handshake is kept on disk; the
+ * rest is ciphertext. See tcpip::limit_writes(). This scanner is then fed
+ * before the other streaming scanners, so a digest of the flow covers
+ * only what is kept.
+ *
+ * Unless -S classify=0, only the flows protocol_classifier names tls are
+ * parsed.
+ */
+
+#include "config.h"
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "stream_scanner.h"
+#include "mb_hash.h"
+
+#include <ctype.h>
+#include <iostream>
+#include <algorithm>
+
+#define TLS_STOP "tls_stop"
+#define TLS_FEATURE "tls"
+#define TLS_MAX_RECORD (16384+2048)     // the largest a TLSCiphertext may be
+#define TLS_MAX_HANDSHAKE (256*1024)    // certificate chains are rarely more than a few KB
+
+static bool tls_stop = false;
+
+/* The reserved values clients send to keep servers tolerant; RFC 8701 */
+static bool grease(uint16_t v)
+{
+    return (v & 0x0f0f)==0x0a0a && (v>>8)==(v & 0xff);
+}
+
+static std::string hexdigest(mb_hash::alg_t alg,const uint8_t *data,size_t len,size_t chars)
+{
+    static const char hexbuf[] = "0123456789abcdef";
+    uint8_t md[32];
+    std::vector<mb_hash::job> jobs(1,mb_hash::job(data,len,md));
+    mb_hash::digest(alg,jobs);
+    std::string ret;
+    for(size_t i=0;i<mb_hash::digest_size(alg) && ret.size()<chars;i++){
+        ret.push_back(hexbuf[md[i]>>4]);
+        ret.push_back(hexbuf[md[i]&0x0f]);
+    }
+    ret.resize(std::min(chars,ret.size()));
+    return ret;
+}
+
+static std::string hexdigest(mb_hash::alg_t alg,const std::string &s,size_t chars=64)
+{
+    return hexdigest(alg,reinterpret_cast<const uint8_t *>(s.data()),s.size(),chars);
+}
+
+/* The values without GREASE, joined, in decimal for JA3 or in 4 hex digits for JA4 */
+static std::string join(const std::vector<uint16_t> &v,char sep,bool hex)
+{
+    std::string ret;
+    char buf[8];
+    for(size_t i=0;i<v.size();i++){
+        if(grease(v[i])) continue;
+        snprintf(buf,sizeof(buf),hex ? "%04x" : "%u",v[i]);
+        if(ret.size()) ret.push_back(sep);
+        ret.append(buf);
+    }
+    return ret;
+}
+
+/* Bounds-checked reads from a handshake message; a short read sets !ok */
+class tls_reader {
+public:
+    tls_reader(const std::string &buf_,size_t pos_,size_t end_):buf(buf_),pos(pos_),end(end_),ok(pos_<=end_){}
+    uint32_t get(unsigned int bytes){
+        if(!ok || end-pos<bytes){
+            ok = false;
+            return 0;
+        }
+        uint32_t v = 0;
+        for(unsigned int i=0;i<bytes;i++) v = (v<<8) | (uint8_t)buf[pos++];
+        return v;
+    }
+    tls_reader sub(unsigned int lenbytes){ // a vector with a length of lenbytes
+        size_t len = get(lenbytes);
+        if(!ok || end-pos<len){
+            ok = false;
+            return tls_reader(buf,end,end);
+        }
+        pos += len;
+        return tls_reader(buf,pos-len,pos);
+    }
+    std::string rest() const { return ok ? buf.substr(pos,end-pos) : std::string(); }
+    bool more() const { return ok && pos<end; }
+    const std::string &buf;
+    size_t pos;
+    const size_t end;
+    bool ok;
+};
+
+/* What one direction's handshake said */
+class tls_handshake {
+public:
+    tls_handshake():client(false),server(false),version(0),max_version(0),sni(),has_sni(false),alpn(),
+                    ciphers(),extensions(),groups(),point_formats(),sigalgs(),certificates(){}
+    bool client;                        // a ClientHello was seen
+    bool server;                        // a ServerHello was seen
+    uint16_t version;                   // in the hello
+    uint16_t max_version;               // from supported_versions; 0 if it was not sent
+    std::string sni;
+    bool has_sni;
+    std::vector<std::string> alpn;
+    std::vector<uint16_t> ciphers;      // the one chosen, for a server
+    std::vector<uint16_t> extensions;   // in the order sent
+    std::vector<uint16_t> groups;
+    std::vector<uint16_t> point_formats;
+    std::vector<uint16_t> sigalgs;
+    std::vector<std::pair<std::string,size_t> > certificates; // SHA-256 and length
+
+    bool hello(const std::string &hs,size_t pos,size_t end,bool from_client);
+    void certificate(const std::string &hs,size_t pos,size_t end);
+    std::string ja3() const;
+    std::string ja4() const;
+    void xml(std::ostream &os) const;
+    void features(const std::string &path) const;
+};
+
+bool tls_handshake::hello(const std::string &hs,size_t pos,size_t end,bool from_client)
+{
+    tls_reader r(hs,pos,end);
+    version = r.get(2);
+    r.get(32);                          // random
+    r.sub(1);                           // session id
+    if(from_client){
+        tls_reader cs = r.sub(2);
+        while(cs.more()) ciphers.push_back(cs.get(2));
+        r.sub(1);                       // compression methods
+    } else {
+        ciphers.push_back(r.get(2));
+        r.get(1);
+    }
+    if(!r.ok) return false;
+    tls_reader exts = r.sub(2);         // absent in very old hellos
+    while(exts.more()){
+        uint16_t type = exts.get(2);
+        tls_reader e = exts.sub(2);
+        if(!exts.ok) break;
+        extensions.push_back(type);
+        switch(type){
+        case 0:                         // server_name
+            has_sni = true;
+            if(from_client){
+                tls_reader list = e.sub(2);
+                while(list.more()){
+                    uint8_t name_type = list.get(1);
+                    tls_reader name = list.sub(2);
+                    if(name_type==0 && sni.size()==0) sni = name.rest();
+                }
+            }
+            break;
+        case 10:                        // supported_groups
+            for(tls_reader list=e.sub(2);list.more();) groups.push_back(list.get(2));
+            break;
+        case 11:                        // ec_point_formats
+            for(tls_reader list=e.sub(1);list.more();) point_formats.push_back(list.get(1));
+            break;
+        case 13:                        // signature_algorithms
+            for(tls_reader list=e.sub(2);list.more();) sigalgs.push_back(list.get(2));
+            break;
+        case 16:                        // application_layer_protocol_negotiation
+            for(tls_reader list=e.sub(2);list.more();) alpn.push_back(list.sub(1).rest());
+            break;
+        case 43:                        // supported_versions
+            if(from_client){
+                for(tls_reader list=e.sub(1);list.more();){
+                    uint16_t v = list.get(2);
+                    if(!grease(v) && v>max_version) max_version = v;
+                }
+            } else {
+                max_version = e.get(2);
+            }
+            break;
+        }
+    }
+    if(from_client) client = true;
+    else server = true;
+    return true;
+}
+
+void tls_handshake::certificate(const std::string &hs,size_t pos,size_t end)
+{
+    tls_reader r(hs,pos,end);
+    for(tls_reader list=r.sub(3);list.more();){
+        tls_reader cert = list.sub(3);
+        if(!list.ok) break;
+        certificates.push_back(std::make_pair(hexdigest(mb_hash::SHA256,
+                                                        reinterpret_cast<const uint8_t *>(hs.data())+cert.pos,
+                                                        cert.end-cert.pos,64),
+                                              cert.end-cert.pos));
+    }
+}
+
+/* SSLVersion,Ciphers,Extensions,EllipticCurves,EllipticCurvePointFormats for a client;
+ * SSLVersion,Cipher,Extensions for a server (JA3S)
+ */
+std::string tls_handshake::ja3() const
+{
+    std::stringstream ss;
+    ss << version << "," << join(ciphers,'-',false) << "," << join(extensions,'-',false);
+    if(client) ss << "," << join(groups,'-',false) << "," << join(point_formats,'-',false);
+    return ss.str();
+}
+
+/* JA4's three parts: t, the version, d or i, the counts and the ALPN; the
+ * sorted ciphers, hashed; the sorted extensions but SNI and ALPN and the
+ * signature algorithms, hashed.
+ */
+std::string tls_handshake::ja4() const
+{
+    static const char hexbuf[] = "0123456789abcdef";
+    const uint16_t v = max_version ? max_version : version;
+    const char *vs = v==0x0304 ? "13" : v==0x0303 ? "12" : v==0x0302 ? "11" : v==0x0301 ? "10" : v==0x0300 ? "s3" : "00";
+
+    std::vector<uint16_t> cs,ext;
+    for(size_t i=0;i<ciphers.size();i++) if(!grease(ciphers[i])) cs.push_back(ciphers[i]);
+    size_t next = 0;
+    for(size_t i=0;i<extensions.size();i++){
+        if(grease(extensions[i])) continue;
+        next++;
+        if(extensions[i]!=0 && extensions[i]!=16) ext.push_back(extensions[i]);
+    }
+    std::string a;
+    if(alpn.size() && alpn[0].size()){
+        uint8_t first = alpn[0][0], last = alpn[0][alpn[0].size()-1];
+        if(isalnum(first) && isalnum(last)){
+            a.push_back(first);
+            a.push_back(last);
+        } else {
+            a.push_back(hexbuf[first>>4]);
+            a.push_back(hexbuf[last&0x0f]);
+        }
+    } else {
+        a = "00";
+    }
+    char head[16];
+    snprintf(head,sizeof(head),"t%s%c%02u%02u",vs,has_sni ? 'd' : 'i',
+             (unsigned int)std::min(cs.size(),(size_t)99),(unsigned int)std::min(next,(size_t)99));
+
+    std::sort(cs.begin(),cs.end());
+    std::sort(ext.begin(),ext.end());
+    std::string exts = join(ext,',',true);
+    if(sigalgs.size()) exts += "_" + join(sigalgs,',',true);
+    return std::string(head) + a + "_" + (cs.size() ? hexdigest(mb_hash::SHA256,join(cs,',',true),12) : "000000000000")
+        + "_" + (ext.size() ? hexdigest(mb_hash::SHA256,exts,12) : "000000000000");
+}
+
+void tls_handshake::xml(std::ostream &os) const
+{
+    char buf[8];
+    snprintf(buf,sizeof(buf),"0x%04x",max_version ? max_version : version);
+    if(client){
+        os << "<tls_client_hello version='" << buf << "'";
+        if(has_sni) os << " sni='" << dfxml_writer::xmlescape(sni) << "'";
+    } else if(server){
+        os << "<tls_server_hello version='" << buf << "'";
+    } else {
+        return;
+    }
+    if(alpn.size()){
+        std::string a;
+        for(size_t i=0;i<alpn.size();i++) a += (i ? "," : "") + alpn[i];
+        os << " alpn='" << dfxml_writer::xmlescape(a) << "'";
+    }
+    os << (client ? " ciphers='" : " cipher='") << join(ciphers,',',true) << "'";
+    const std::string j = ja3();
+    os << (client ? " ja3='" : " ja3s='") << j << "' " << (client ? "ja3_hash='" : "ja3s_hash='")
+       << hexdigest(mb_hash::MD5,j,32) << "'";
+    if(client) os << " ja4='" << ja4() << "'";
+    if(certificates.size()==0){
+        os << "/>";
+        return;
+    }
+    os << ">";
+    for(size_t i=0;i<certificates.size();i++){
+        os << "<tls_certificate sha256='" << certificates[i].first << "' length='" << certificates[i].second << "'/>";
+    }
+    os << "</tls_server_hello>";
+}
+
+void tls_handshake::features(const std::string &path) const
+{
+    feature_recorder *fr = tcpdemux::getInstance()->fs->get_name(TLS_FEATURE);
+    if(fr==0) return;
+    if(client && sni.size()){
+        fr->write(pos0_t(path,0),sni,"ja3_hash=" + hexdigest(mb_hash::MD5,ja3(),32) + " ja4=" + ja4());
+    }
+    for(size_t i=0;i<certificates.size();i++){
+        fr->write(pos0_t(path,0),certificates[i].first,"certificate");
+    }
+}
+
+/* Splits a flow into records, and the handshake records into messages */
+class tls_parser {
+public:
+    tls_parser():hs(),hello(),offset(0),header(),record_left(0),record_type(0),stop_offset(-1),done(false){}
+
+    /* the next len bytes of the flow. Returns false when there is no more to parse */
+    bool data(const uint8_t *p,size_t len){
+        while(len>0 && !done){
+            if(record_left==0){         // the header
+                size_t n = std::min(len,(size_t)5-header.size());
+                header.append(reinterpret_cast<const char *>(p),n);
+                p += n; len -= n; offset += n;
+                if(header.size()<5) break;
+                record_type = (uint8_t)header[0];
+                record_left = ((uint8_t)header[3]<<8) | (uint8_t)header[4];
+                header.clear();
+                if(record_type<20 || record_type>24 || record_left==0 || record_left>TLS_MAX_RECORD){
+                    done = true;        // not TLS, or lost
+                    break;
+                }
+                if(record_type==20 || record_type==23){ // the rest is encrypted
+                    stop_offset = offset-5;
+                    done = true;
+                    break;
+                }
+                continue;
+            }
+            size_t n = std::min(len,(size_t)record_left);
+            if(record_type==22) handshake(p,n);
+            p += n; len -= n; offset += n;
+            record_left -= n;
+        }
+        return !done;
+    }
+    std::string hs;                     // handshake bytes not yet parsed
+    tls_handshake hello;
+    uint64_t offset;                    // in the flow
+    std::string header;                 // of the next record, as far as it has come
+    uint16_t record_left;               // bytes of the current record still to come
+    uint8_t  record_type;
+    int64_t  stop_offset;               // of the first encrypted record; -1 if none yet
+    bool done;
+
+private:
+    void handshake(const uint8_t *p,size_t len){
+        hs.append(reinterpret_cast<const char *>(p),len);
+        size_t pos = 0;
+        while(hs.size()-pos>=4){
+            uint8_t type = hs[pos];
+            size_t mlen = ((uint8_t)hs[pos+1]<<16) | ((uint8_t)hs[pos+2]<<8) | (uint8_t)hs[pos+3];
+            if(mlen>TLS_MAX_HANDSHAKE){
+                done = true;
+                return;
+            }
+            if(hs.size()-pos-4<mlen) break; // the rest is in a later record
+            switch(type){
+            case 1:  if(!hello.hello(hs,pos+4,pos+4+mlen,true))  done = true; break;
+            case 2:  if(!hello.hello(hs,pos+4,pos+4+mlen,false)) done = true; break;
+            case 11: hello.certificate(hs,pos+4,pos+4+mlen); break;
+            case 14: break;             // ServerHelloDone
+            }
+            pos += 4+mlen;
+        }
+        hs.erase(0,pos);
+    }
+};
+
+/* The streaming version stops the flow's writes where the encryption starts */
+class tls_stream : public stream_scanner {
+public:
+    tls_stream():parser(){}
+    virtual void on_data(class tcpip &tcp,const uint8_t *data,size_t len){
+        if(parser.done) return;
+        parser.data(data,len);
+        if(parser.stop_offset>=0 && tls_stop && (parser.hello.client || parser.hello.server)){
+            tcp.limit_writes(parser.stop_offset);
+        }
+    }
+    virtual void on_gap(class tcpip &tcp,uint64_t offset,uint64_t len){
+        parser.done = true;             // the records are out of step
+    }
+    virtual void on_close(class tcpip &tcp,std::stringstream &xmladd){
+        parser.hello.xml(xmladd);
+        parser.hello.features(tcp.flow_pathname);
+    }
+    virtual bool limits_writes() const { return tls_stop; }
+private:
+    tls_parser parser;
+};
+
+static stream_scanner *tls_stream_factory(class tcpip &tcp)
+{
+    if(tcp.myflow.protocol!=protocol_classifier::UNCLASSIFIED && tcp.myflow.protocol!=protocol_classifier::TLS) return 0;
+    return new tls_stream();
+}
+
+extern "C"
+void  scan_tls(const class scanner_params &sp,const recursion_control_block &rcb)
+{
+    if(sp.sp_version!=scanner_params::CURRENT_SP_VERSION){
+	std::cerr << "scan_tls requires sp version " << scanner_params::CURRENT_SP_VERSION << "; "
+		  << "got version " << sp.sp_version << "\n";
+	exit(1);
+    }
+
+    if(sp.phase==scanner_params::PHASE_STARTUP){
+	sp.info->name  = "tls";
+	sp.info->flags = scanner_info::SCANNER_DISABLED;
+        sp.info->feature_names.insert(TLS_FEATURE);
+        sp.info->get_config(TLS_STOP,&tls_stop,"Stop writing each TLS flow where its encrypted records start");
+        stream_scanners::add(sp.info->name,tls_stream_factory);
+        return;
+    }
+
+    if(sp.phase==scanner_params::PHASE_SCAN){
+        tls_parser parser;
+        parser.data(sp.sbuf.buf,sp.sbuf.bufsize);
+        if(sp.sxml) parser.hello.xml(*sp.sxml);
+        parser.hello.features(sp.sbuf.pos0.path);
+        return;
+    }
+}
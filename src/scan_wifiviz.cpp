@@ -9,6 +9,7 @@
 #include <sys/types.h>
 
 #include "bulk_extractor_i.h"
+#include "stream_scanner.h"
 #include "datalink_wifi.h"
 
 extern "C"
@@ -26,6 +27,7 @@ void  scan_wifiviz(const class scanner_params &sp,const recursion_control_block
 	sp.info->flags = scanner_info::SCANNER_DISABLED;
 	sp.info->author= "Simson Garfinkel";
 	sp.info->packet_user = 0;
+        stream_scanners::add(sp.info->name,0); // packets only; flows are not scanned
         sp.info->description = "Performs wifi isualization";
         sp.info->get_config("check_fcs",&TFCB::theTFCB.opt_check_fcs,"Require valid Frame Check Sum (FCS)");
     }
@@ -0,0 +1,187 @@
+/*
+ * stream_scanner.cpp:
+ *
+ * See stream_scanner.h.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "stream_scanner.h"
+
+#include <algorithm>
+
+bool stream_scanners::need_sbuf = true;
+std::vector<stream_scanner_factory_t *> stream_scanners::active;
+stream_scanners::registry_t stream_scanners::registry;
+std::vector<std::string> stream_scanners::taken;
+std::vector<stream_scanners::closing_hook_t *> stream_scanners::closing_hooks;
+
+void stream_scanners::add(const std::string &name,stream_scanner_factory_t *factory)
+{
+    registry.push_back(std::make_pair(name,factory));
+}
+
+void stream_scanners::select()
+{
+    std::vector<std::string> enabled;
+    be13::plugin::get_enabled_scanners(enabled);
+
+    need_sbuf = false;
+    for(std::vector<std::string>::const_iterator it=enabled.begin();it!=enabled.end();it++){
+        registry_t::const_iterator r;
+        for(r=registry.begin();r!=registry.end();r++){
+            if(r->first==*it) break;
+        }
+        if(r==registry.end()) need_sbuf = true; // only knows PHASE_SCAN
+    }
+
+    for(registry_t::const_iterator r=registry.begin();r!=registry.end();r++){
+        if(r->second==0) continue;
+        if(std::find(enabled.begin(),enabled.end(),r->first)==enabled.end()) continue;
+        DEBUG(10)("%s scans flows as they are written",r->first.c_str());
+        active.push_back(r->second);
+        be13::plugin::scanners_disable(r->first);
+        taken.push_back(r->first);
+    }
+    if(taken.size()) be13::plugin::scanners_process_enable_disable_commands();
+}
+
+void stream_scanners::restore()
+{
+    if(taken.empty()) return;
+    for(std::vector<std::string>::const_iterator it=taken.begin();it!=taken.end();it++){
+        be13::plugin::scanners_enable(*it);
+    }
+    be13::plugin::scanners_process_enable_disable_commands();
+    taken.clear();
+}
+
+void stream_scanners::add_closing_hook(closing_hook_t *hook)
+{
+    closing_hooks.push_back(hook);
+}
+
+void stream_scanners::closing(const std::vector<tcpip *> &flows)
+{
+    if(closing_hooks.empty() || flows.size()<2) return;
+    for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end();it++){
+        if((*it)->retention_head) (*it)->retention_decide(true); // as post_process() would; it releases the stream
+        if((*it)->stream) (*it)->stream->drain(true); // as close() would
+    }
+    for(std::vector<closing_hook_t *>::const_iterator h=closing_hooks.begin();h!=closing_hooks.end();h++){
+        (**h)(flows);
+    }
+}
+
+static bool limits_writes(const stream_scanner *s)
+{
+    return s->limits_writes();
+}
+
+stream_feed::stream_feed(tcpip &tcp_):tcp(tcp_),scanners(),holding(false),held_offset(0),held(),held_gaps()
+{
+    for(std::vector<stream_scanner_factory_t *>::const_iterator it=stream_scanners::active.begin();
+        it!=stream_scanners::active.end();it++){
+        stream_scanner *s = (**it)(tcp);
+        if(s){
+            s->on_open(tcp);
+            scanners.push_back(s);
+        }
+    }
+    std::stable_partition(scanners.begin(),scanners.end(),limits_writes);
+}
+
+stream_feed::~stream_feed()
+{
+    for(std::vector<stream_scanner *>::const_iterator it=scanners.begin();it!=scanners.end();it++){
+        delete *it;
+    }
+}
+
+size_t stream_feed::allowed(uint64_t offset,size_t len) const
+{
+    if(tcp.write_limit<0) return len;
+    uint64_t limit = tcp.write_limit;
+    if(offset>=limit) return 0;
+    return offset+len > limit ? limit-offset : len;
+}
+
+/* The limit is checked again for each scanner, as one before it may have just set it */
+void stream_feed::deliver(uint64_t offset,const uint8_t *data,size_t len)
+{
+    if(len==0) return;
+    for(std::vector<stream_scanner *>::const_iterator it=scanners.begin();it!=scanners.end();it++){
+        size_t n = allowed(offset,len);
+        if(n==0) return;
+        (*it)->on_data(tcp,data,n);
+    }
+}
+
+void stream_feed::consume(const uint8_t *data,size_t len)
+{
+    if(holding){
+        if(held.size()==0) held_offset = position();
+        held.insert(held.end(),data,data+len);
+        return;
+    }
+    deliver(position(),data,len);
+}
+
+void stream_feed::gap(uint64_t offset,uint64_t len)
+{
+    if(holding){
+        held_gaps.push_back(std::make_pair(offset,len));
+        return;
+    }
+    for(std::vector<stream_scanner *>::const_iterator it=scanners.begin();it!=scanners.end();it++){
+        uint64_t n = allowed(offset,len < SIZE_MAX ? len : SIZE_MAX);
+        if(n==0) return;
+        (*it)->on_gap(tcp,offset,n);
+    }
+}
+
+void stream_feed::hold()
+{
+    holding = true;
+}
+
+void stream_feed::release()
+{
+    if(!holding) return;
+    holding = false;
+    uint64_t offset = held_offset;
+    const uint8_t *data = held.size() ? &held[0] : 0;
+    for(std::vector<std::pair<uint64_t,uint64_t> >::const_iterator g=held_gaps.begin();g!=held_gaps.end();g++){
+        if(g->first > offset){          // the bytes before the gap; its zeros follow in held
+            deliver(offset,data,g->first-offset);
+            data += g->first-offset;
+            offset = g->first;
+        }
+        gap(g->first,g->second);
+    }
+    deliver(offset,data,held.size()-(data-(held.size() ? &held[0] : 0)));
+    std::vector<uint8_t>().swap(held);
+    held_gaps.clear();
+}
+
+void stream_feed::shift(uint32_t inslen)
+{
+    if(holding && (held.size()>0 || held_gaps.size()>0)){ // it was passed on, so it moves as the rest does
+        held_offset += inslen;
+        for(std::vector<std::pair<uint64_t,uint64_t> >::iterator g=held_gaps.begin();g!=held_gaps.end();g++){
+            g->first += inslen;
+        }
+    }
+    flow_sequencer::shift(inslen);
+}
+
+void stream_feed::close(std::stringstream &xmladd)
+{
+    drain(true);
+    for(std::vector<stream_scanner *>::const_iterator it=scanners.begin();it!=scanners.end();it++){
+        (*it)->on_close(tcp,xmladd);
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * stream_scanner.h:
+ *
+ * Streaming scanners see a flow's bytes in order as tcpip::store_packet()
+ * writes them, instead of a whole-file sbuf after the flow is closed. That
+ * saves the flow file being read back and mapped for them.
+ *
+ * A be13 scanner offers a streaming version by registering a factory in
+ * its PHASE_STARTUP. If it is enabled, stream_scanners::select() takes it
+ * over: it is disabled in be13, so its PHASE_SCAN is not called, and the
+ * factory makes a stream_scanner for each flow with data. Scanners that
+ * have no PHASE_SCAN work register a null factory. The whole-flow sbuf is
+ * only built if some enabled scanner is not registered at all.
+ *
+ * The bytes come through a flow_sequencer, so out-of-order data is
+ * passed on when the gap before it fills, and gaps left at the end of
+ * the flow are passed on as zeros, as they read from a flow file. Bytes
+ * inserted before the start of a flow after the start was passed on
+ * cannot be seen by the stream; see flow_sequencer::shift(). Nor can data
+ * that arrives for a gap that was given up, though a flow file written in
+ * place has it; the feed's late_bytes counts it.
+ *
+ * No scanner sees bytes past tcpip::write_limit, which are not kept in
+ * the flow file. A scanner that sets the limit as it reads, as scan_tls
+ * does, is fed before the others, so that they never see (or hash) the
+ * rest of the bytes it cut.
+ *
+ * While the retention policy has yet to decide how much of a flow to
+ * keep, the feed holds what it would pass on; the scanners get it when
+ * the decision is made, cut to what is kept.
+ *
+ * -S stream_scan=0 keeps every scanner on the whole-flow path.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifndef STREAM_SCANNER_H
+#define STREAM_SCANNER_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include "flow_sequencer.h"
+
+/* One per flow per streaming scanner */
+class stream_scanner {
+public:
+    virtual ~stream_scanner(){}
+    virtual void on_open(class tcpip &tcp){}                  // before the first byte; the flow has its name
+    virtual void on_data(class tcpip &tcp,const uint8_t *data,size_t len)=0; // the next contiguous bytes
+    virtual void on_gap(class tcpip &tcp,uint64_t offset,uint64_t len){}      // the next len bytes are zeros for a gap
+    virtual void on_close(class tcpip &tcp,std::stringstream &xmladd){}       // add to the <fileobject>
+    virtual bool limits_writes() const { return false; } // may call tcpip::limit_writes() from on_data()
+};
+
+typedef stream_scanner *stream_scanner_factory_t(class tcpip &tcp); // may return 0 to skip the flow
+
+class stream_scanners {
+public:
+    static void add(const std::string &name,stream_scanner_factory_t *factory); // from PHASE_STARTUP
+    static void select();               // after the enable/disable commands are processed
+    static void restore();              // enable them again before PHASE_SHUTDOWN, which be13 only sends to enabled scanners
+    static bool need_sbuf;              // an enabled scanner still wants the whole flow in PHASE_SCAN
+    static std::vector<stream_scanner_factory_t *> active; // in registration order
+
+    /* A scanner that can do better with many flows at once than one at a
+     * time can ask to hear when flows are about to be post-processed
+     * together: at a timeout, and at shutdown.
+     */
+    typedef void closing_hook_t(const std::vector<class tcpip *> &flows);
+    static void add_closing_hook(closing_hook_t *hook); // from PHASE_STARTUP
+    static void closing(const std::vector<class tcpip *> &flows); // passes on the rest of their data first
+
+private:
+    typedef std::vector<std::pair<std::string,stream_scanner_factory_t *> > registry_t;
+    static registry_t registry;
+    static std::vector<std::string> taken; // disabled in be13 by select()
+    static std::vector<closing_hook_t *> closing_hooks;
+};
+
+/* The in-order feed for a flow's streaming scanners; hangs off tcpip::stream */
+class stream_feed : public flow_sequencer {
+    /* These are not implemented */
+    stream_feed(const stream_feed &);
+    stream_feed &operator=(const stream_feed &);
+
+public:
+    stream_feed(class tcpip &tcp);
+    virtual ~stream_feed();
+    void close(std::stringstream &xmladd); // pass on the rest and let each scanner add its XML
+    void hold();                        // keep what would be passed on, until release()
+    void release();                     // pass it on, up to the write limit as it is now
+    void shift(uint32_t inslen);        // as flow_sequencer::shift(), and move what is held
+
+private:
+    class tcpip &tcp;
+    std::vector<stream_scanner *> scanners; // the ones that limit writes first
+    bool holding;
+    uint64_t held_offset;               // flow offset of held[0]
+    std::vector<uint8_t> held;
+    std::vector<std::pair<uint64_t,uint64_t> > held_gaps; // offset and length of the gaps in it
+    size_t allowed(uint64_t offset,size_t len) const; // of len bytes at offset, those under the write limit
+    void deliver(uint64_t offset,const uint8_t *data,size_t len);
+
+protected:
+    virtual void consume(const uint8_t *data,size_t len);
+    virtual void gap(uint64_t offset,uint64_t len);
+};
+
+#endif
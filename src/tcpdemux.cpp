@@ -14,6 +14,12 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "async_io.h"
+#include "container_store.h"
+#include "flow_compressor.h"
+#include "chunk_store.h"
+#include "post_pool.h"
+#include "stream_scanner.h"
 
 #include <iostream>
 #include <sstream>
@@ -23,65 +29,13 @@
 /* static */ uint32_t tcpdemux::tcp_timeout = 0;
 
 tcpdemux::tcpdemux():
-#ifdef HAVE_SQLITE3
-    db(),insert_flow(),
-#endif
     outdir("."),flow_counter(0),packet_counter(0),
-    xreport(0),pwriter(0),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
+    xreport(0),report(0),arrow(0),flowdb(0),pwriter(0),aio(0),container(0),chunks(0),console(0),pool(0),retention(0),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
     flow_map(),open_flows(),saved_flow_map(),
     saved_flows(),start_new_connections(false),opt(),fs()
 {
 }
 
-void tcpdemux::openDB()
-{
-#ifdef HAVE_SQLITE3
-    int rc = sqlite3_open("test.db", &db);
-    if( rc ){
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        db = 0;
-    }
-    /* Create SQL statement */
-    const char *sql = "CREATE TABLE connections ("
-        "starttime TEXT NOT NULL,"
-        "endtime TEXT NOT NULL,"
-        "src_ipn TEXT,"  
-        "dst_ipn TEXT,"
-        "mac_daddr TEXT,"
-        "mac_saddr TEXT,"
-        "packets INTEGER,"
-        "srcport INTEGER,"
-        "dstport INTEGER,"
-        "hashdigest_md5 TEXT);";
-
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, callback, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-        sqlite3_close(db);
-        return 0;
-    }
-    const char* zSql = "INSERT INTO connections (starttime,endtime,src_ipn,dst_ipn,mac_daddr,mac_saddr,packets,srcport,dstport,hashdigest_md5) VALUES (?,?,?,?,?,?,?,?,?,?)";
-    if(sqlite3_prepare_v2(db, zSql, strlen(zSql), &insert_stmt, NULL)!=SQLITE_OK ){
-        fprintf(stderr, "SQL prepare error");
-        db = 0;
-        insert_stmt=0;
-        return(0);
-    }
-#endif
-}
-
-void  tcpdemux::write_flow_record(const std::string &starttime,const std::string &endtime,
-                        const std::string &src_ipn,const std::string &dst_ipn,
-                        const std::string &mac_daddr,const std::string &mac_saddr,
-                        uint64_t packets,uint16_t srcport,uint16_t dstport,
-                        const std::string &hashdigest_md5)
-{
-}
-
-
-
 /* static */ tcpdemux *tcpdemux::getInstance()
 {
     static tcpdemux * theInstance = 0;
@@ -103,8 +57,7 @@ void tcpdemux::close_oldest_fd()
 int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 {
     while(true){
-    //Packet index file reduces max_fds by 1/2 as the index files also take a fd
-	if(open_flows.size() >= (opt.output_packet_index ?  max_fds/2 : max_fds)) close_oldest_fd();
+	if(open_flows.size() >= max_fds) close_oldest_fd();
 	int fd = ::open(filename.c_str(),oflag,mask);
 	DEBUG(2)("retrying_open ::open(fn=%s,oflag=x%x,mask:x%x)=%d",filename.c_str(),oflag,mask,fd);
 	if(fd>=0){
@@ -182,7 +135,20 @@ tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be
 void tcpdemux::post_process(tcpip *tcp)
 {
     std::stringstream xmladd;		// for this <fileobject>
-    if(opt.post_processing && tcp->file_created && tcp->last_byte>0){
+    sbuf_t *sbuf = 0;                   // only kept past the scan when there is a pool
+    if(tcp->retention_head) tcp->retention_decide(true); // it ended before retention_bytes
+    if(tcp->retain_rule){
+        xmladd << "<retention action='" << tcp->retain_rule->action_name() << "' rule='" << tcp->retain_rule->line << "'";
+        if(tcp->retain_rule->action==retention_policy::TRUNCATE) xmladd << " limit='" << tcp->retain_rule->limit << "'";
+        xmladd << "/>";
+    }
+    if(tcp->compressor){
+        /* end the compressed stream; anything still staged is written with its gaps as zeros */
+        if(tcp->fd<0) tcp->open_file();
+        if(tcp->fd>=0) tcp->compressor->finish(tcp->fd);
+    }
+    if(tcp->stream) tcp->stream->close(xmladd); // the streaming scanners are already done
+    if(opt.post_processing && stream_scanners::need_sbuf && tcp->file_created && tcp->last_byte>0 && !tcp->retain_dropped){
         /** 
          * After the flow is finished, if more than a byte was
          * written, then put it in an SBUF and process it.  if we are
@@ -190,26 +156,47 @@ void tcpdemux::post_process(tcpip *tcp)
          * in tcpip.cpp.
          */
 
-        /* Open the fd if it is not already open */
-        tcp->open_file();
-        if(tcp->fd>=0){
-            sbuf_t *sbuf = sbuf_t::map_file(tcp->flow_pathname,tcp->fd);
-            if(sbuf){
-                be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,*(fs),&xmladd));
-                delete sbuf;
-                sbuf = 0;
-            }
+        sbuf = read_flow(tcp);
+        if(sbuf && !pool){
+            be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,*(fs),&xmladd));
+            delete sbuf;
+            sbuf = 0;
         }
     }
     tcp->close_file();
-    if(xreport) tcp->dump_xml(xreport,xmladd.str());
+    if(aio) aio->drain(tcp);            // the filename is final once the open completes
+    if(container) container->finish(tcp); // append the flow's index record
+    if(chunks) chunks->finish(tcp);     // append the flow's recipe
+    if(opt.output_packet_index && !tcp->retain_dropped) tcp->write_index();
     /**
      * Before we delete the tcp structure, save information about the saved flow
      */
     save_flow(tcp);
+    if(pool){
+        /* The mapped file outlives the close; the pool writes the XML and deletes tcp */
+        pool->submit(tcp,sbuf,xmladd.str());
+        return;
+    }
+    if(report) tcp->dump_xml(*report,xmladd.str());
+    if(arrow) tcp->dump_arrow(*arrow,xmladd.str());
+    if(flowdb) tcp->dump_db(*flowdb,xmladd.str());
     delete tcp;
 }
 
+/* Also used by streaming scanners that have to look back at the flow from on_close() */
+sbuf_t *tcpdemux::read_flow(tcpip *tcp)
+{
+    /* Open the fd if it is not already open */
+    if(!container && !chunks) tcp->open_file();
+    if(aio) aio->drain(tcp);            // the writes must be on disk before we map the file
+    if(opt.mmap_window) tcp->map_release(); // and the file must have its true size
+    if(container) return container->read_flow(tcp);
+    if(chunks)    return chunks->read_flow(tcp);
+    if(tcp->fd<0) return 0;
+    if(tcp->compressor) return flow_compressor::decompress_file(tcp->flow_pathname,tcp->fd,tcp->compressor->method);
+    return sbuf_t::map_file(tcp->flow_pathname,tcp->fd);
+}
+
 void tcpdemux::remove_flow(const flow_addr &flow)
 {
     flow_map_t::iterator it = flow_map.find(flow);
@@ -221,10 +208,19 @@ void tcpdemux::remove_flow(const flow_addr &flow)
 
 void tcpdemux::remove_all_flows()
 {
+    std::vector<tcpip *> closing;
+    for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
+        closing.push_back(it->second);
+    }
+    stream_scanners::closing(closing);
     for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
         post_process(it->second);
     }
     flow_map.clear();
+    if(pool) pool->reap(true);          // the last <fileobject>s, in order
+    if(aio) aio->drain_all();           // finish the outstanding closes and timestamps
+    if(container) container->close();
+    if(chunks) chunks->close();
 }
 
 /****************************************************************
@@ -401,7 +397,16 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
              *
              */
             saved_flow_map_t::const_iterator it = saved_flow_map.find(this_flow);
-            if(it!=saved_flow_map.end()){
+            if(it!=saved_flow_map.end() && it->second->dropped) return 0; // nothing to match; stay dropped
+            if(it!=saved_flow_map.end() && it->second->compressed){
+                /* The file holds the compressed stream, which a packet can't be compared with.
+                 * Data that falls inside the saved flow is taken to be a retransmission of it;
+                 * anything past its end starts a new flow, as a mismatch would.
+                 */
+                uint32_t offset = seq - it->second->isn - 1;
+                if((uint64_t)offset + tcp_datalen <= it->second->last_byte) return 0;
+            }
+            else if(it!=saved_flow_map.end()){
                 uint32_t offset = seq - it->second->isn - 1;
                 bool data_match = false;
                 int fd = open(it->second->saved_filename.c_str(),O_RDONLY | O_BINARY);
@@ -679,13 +684,16 @@ int tcpdemux::process_pkt(const be13::packet_info &pi)
     if(tcp_timeout){
         /* Get a list of the flows that need to be closed.  */
         std::vector<flow_addr *> to_close;
+        std::vector<tcpip *> closing;
         for(flow_map_t::iterator it = flow_map.begin(); it!=flow_map.end(); it++){
             tcpip &tcp = *(it->second);
             uint32_t age = pi.ts.tv_sec - tcp.myflow.tlast.tv_sec;
             if (age > tcp_timeout){
                 to_close.push_back(&tcp.myflow);
+                closing.push_back(&tcp);
             }
         }
+        stream_scanners::closing(closing);
         /* Close them. This removes the flows from the flow_map(), which is why we need
          * to create the list first.
          */
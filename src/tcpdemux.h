@@ -21,10 +21,6 @@
 #include "dfxml/src/dfxml_writer.h"
 #include "dfxml/src/hash_t.h"
 
-#if defined(HAVE_SQLITE3_H)
-#include <sqlite3.h>
-#endif
-
 #if defined(HAVE_UNORDERED_MAP)
 # include <unordered_map>
 # include <unordered_set>
@@ -70,10 +66,6 @@ class tcpdemux {
 
 
     tcpdemux();
-#ifdef HAVE_SQLITE3
-    sqlite3 *db;
-    sqlite3_stmt *insert_flow;
-#endif
 
 public:
     static uint32_t tcp_timeout;
@@ -93,7 +85,7 @@ public:
                   max_bytes_per_flow(-1),
                   max_flows(0),suppress_header(0),
                   output_strip_nonprint(true),output_hex(false),use_color(0),
-                  output_packet_index(false),max_seek(MAX_SEEK) {
+                  output_packet_index(false),packet_index_text(false),classify(true),mmap_window(0),compress(0),compress_level(-1),max_seek(MAX_SEEK) {
         }
         bool    console_output;
         bool    console_output_nonewline;
@@ -109,6 +101,11 @@ public:
         bool    use_color;
         bool    output_packet_index;    // Generate a packet index file giving the timestamp and location
                                         // bytes written to the flow file.
+        bool    packet_index_text;      // write the index as offset|sec.usec|len lines instead of binary
+        bool    classify;               // name each flow's protocol from its first bytes
+        uint32_t mmap_window;           // write flow files through mmap windows of this size; 0 to use write()
+        int     compress;               // flow_compressor::method_t for flow files; 0 for none
+        int32_t compress_level;         // -1 for the library's default
         int32_t max_seek;               // signed becuase we compare with abs()
     };
 
@@ -118,7 +115,16 @@ public:
     uint64_t    flow_counter;           // how many flows have we seen?
     uint64_t    packet_counter;         // monotomically increasing 
     dfxml_writer  *xreport;               // DFXML output file
+    class flow_report *report;          // batches the <fileobject>s for xreport; 0 if there is none
+    class arrow_writer *arrow;          // a row per flow, as an Arrow file; 0 if there is none
+    class flow_db *flowdb;              // a row per flow, in SQLite; 0 if there is none
     pcap_writer *pwriter;               // where we should write packets
+    class async_io *aio;                // io_uring output backend; 0 for synchronous writes
+    class container_store *container;   // log-structured output store; 0 for one file per flow
+    class chunk_store *chunks;          // deduplicating chunk store; 0 for one file per flow
+    class console_writer *console;      // batches -c/-C/-s/-D output; 0 unless console_output
+    class post_pool *pool;              // runs the scanners on closed flows; 0 to run them in post_process
+    class retention_policy *retention;  // decides which flows are kept; 0 to keep them all
     unsigned int max_open_flows;        // how large did it ever get?
     unsigned int max_fds;               // maximum number of file descriptors for this tcpdemux
 
@@ -135,19 +141,10 @@ public:
     static uint32_t max_saved_flows;       // how many saved flows are kept in the saved_flow_map
     static tcpdemux *getInstance();
 
-    /* Databse */
-
-    void  openDB();                    // open the database file if we are using it in outdir directory.
-    void  write_flow_record(const std::string &starttime,const std::string &endtime,
-                            const std::string &src_ipn,const std::string &dst_ipn,
-                            const std::string &mac_daddr,const std::string &mac_saddr,
-                            uint64_t packets,uint16_t srcport,uint16_t dstport,
-                            const std::string &hashdigest_md5);
-
-
     void  save_unk_packets(const std::string &wfname,const std::string &ifname);
                                        // save unknown packets at this location
     void  post_process(tcpip *tcp);    // just before closing; writes XML and closes fd
+    class sbuf_t *read_flow(tcpip *tcp); // the flow's bytes, however it was stored; 0 if they can't be read
 
     /* management of open fds and in-process tcpip flows*/
     void  close_tcpip_fd(tcpip *);         
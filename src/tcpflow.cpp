@@ -15,6 +15,16 @@
 
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "async_io.h"
+#include "container_store.h"
+#include "flow_compressor.h"
+#include "chunk_store.h"
+#include "console_writer.h"
+#include "flow_report.h"
+#include "arrow_writer.h"
+#include "flow_db.h"
+#include "post_pool.h"
+#include "stream_scanner.h"
 #include "bulk_extractor_i.h"
 #include "iptree.h"
 
@@ -42,6 +52,36 @@ typedef struct {
 
 default_t defaults[] = {
     {"tdelta","0","Time delta in seconds"},
+    {"io_uring","0","Write flow files asynchronously with io_uring (Linux)"},
+    {"io_uring_depth","256","io_uring queue depth and number of 64KiB write buffers"},
+    {"stream_scan","1","Run scanners that can stream on each flow as it is written, not after it closes"},
+    {"post_threads","0","Threads that run the scanners on closed flows (0 to run them in the packet thread)"},
+    {"post_queue","0","Closed flows that may wait for the post-processing threads (0 for 8 per thread)"},
+    {"console_batch","1048576","Bytes of console output to collect before writing it (0 for live capture)"},
+    {"console_flush_ms","100","Write console output at least this often"},
+    {"chunk_store","0","Store flows as deduplicated content-defined chunks in outdir/chunks"},
+    {"chunk_avg","8192","Average chunk size for the chunk store (a power of two)"},
+    {"compress","","Compress flow files as they are written: gzip or zstd"},
+    {"compress_level","-1","Compression level; -1 for the default of the method"},
+    {"mmap","0","Write flow files through memory-mapped windows instead of write()"},
+    {"mmap_window_mb","8","Size of each flow's mapped window in MB"},
+    {"packet_index_text","0","Write -I index files as offset|sec.usec|len text instead of binary records"},
+    {"classify","1","Name each flow's protocol from its first bytes, for the report and the scanners"},
+    {"container","0","Append all flows to segment files in outdir/container instead of one file per flow"},
+    {"container_segment_mb","1024","Size of each container segment in MB"},
+    {"container_buffer","16384","Bytes of contiguous data staged per flow before it is appended to a segment"},
+    {"report_batch","1048576","Bytes of <fileobject>s to collect before writing them to the report (0 for live capture; 0 writes and flushes each one)"},
+    {"report_flush_ms","1000","Write the collected <fileobject>s at least this often"},
+    {"report_thread","0","Write the report from a thread of its own"},
+    {"arrow_report","","File to write a row per flow to, in the Arrow IPC (Feather) format"},
+    {"arrow_batch_rows","65536","Flows in each record batch of the Arrow file"},
+    {"flow_db","0","Write a row per flow to flows.sqlite3 in the output directory"},
+    {"flow_db_batch","1000","Flows to insert into the flow database in each transaction"},
+    {"flow_db_batch_ms","1000","Commit the flow database at least this often"},
+    {"flow_db_thread","1","Insert into the flow database from a thread of its own"},
+    {"flow_db_queue","16","Batches that may wait for the flow database thread"},
+    {"retention_rules","","File of rules that keep, truncate or drop each flow by its first bytes"},
+    {"retention_bytes","4096","Bytes at the start of each flow that the retention rules see"},
     {0,0,0}
 };
 
@@ -67,6 +107,8 @@ sem_t *semlock = 0;
 scanner_t *scanners_builtin[] = {
     scan_md5,
     scan_http,
+    scan_pattern,
+    scan_tls,
     scan_netviz,
     scan_tcpdemux,
 #ifdef USE_WIFI
@@ -95,7 +137,7 @@ static void usage(int level)
     std::cout << "   -h: print this help message (-hh for more help)\n";
     std::cout << "   -H: print detailed information about each scanner\n";
     std::cout << "   -i: network interface on which to listen\n";
-    std::cout << "   -I: generate temporal packet-> byte index files for each flow (.findex)\n";
+    std::cout << "   -I: generate temporal packet-> byte index files for each flow (.findx)\n";
     std::cout << "   -g: output each flow in alternating colors (note change!)\n";
     std::cout << "   -l: treat non-flag arguments as input files rather than a pcap expression\n";
     std::cout << "   -L  semlock - specifies that writes are locked using a named semaphore\n";
@@ -199,6 +241,12 @@ dfxml_writer *xreport = 0;
 void terminate(int sig)
 {
     DEBUG(1) ("terminating");
+    tcpdemux &demux = *tcpdemux::getInstance();
+    if(demux.console) demux.console->flush();
+    if(demux.report) demux.report->close();     // the <fileobject>s not written yet
+    if(demux.arrow) demux.arrow->close();       // the last batch and the footer, or it cannot be read
+    if(demux.flowdb) demux.flowdb->close();     // the queued rows, and the indexes
+    stream_scanners::restore();
     be13::plugin::phase_shutdown(*the_fs);	// give plugins a chance to do a clean shutdown
     exit(0); /* libpcap uses onexit to clean up */
 }
@@ -701,6 +749,186 @@ int main(int argc, char *argv[])
     demux.fs = &fs;
 
     si.get_config("tdelta",&datalink_tdelta,"Time offset for packets");
+    si.get_config("packet_index_text",&demux.opt.packet_index_text,"Write -I index files as text");
+    si.get_config("classify",&demux.opt.classify,"Name each flow's protocol from its first bytes");
+
+    /* Select the output backend. The synchronous one is the default. */
+    bool opt_io_uring = false;
+    uint32_t io_uring_depth = async_io::DEFAULT_DEPTH;
+    si.get_config("io_uring",&opt_io_uring,"Write flow files asynchronously with io_uring");
+    si.get_config("io_uring_depth",&io_uring_depth,"io_uring queue depth");
+    bool opt_container = false;
+    uint32_t container_segment_mb = container_store::DEFAULT_SEGMENT_MB;
+    uint32_t container_buffer = container_store::DEFAULT_BUFFER;
+    si.get_config("container",&opt_container,"Write flows to a log-structured container");
+    si.get_config("container_segment_mb",&container_segment_mb,"Container segment size in MB");
+    si.get_config("container_buffer",&container_buffer,"Per-flow container staging buffer");
+    if(opt_container && demux.opt.store_output && !demux.opt.console_output){
+        if(demux.opt.output_packet_index){
+            std::cerr << "-I is not supported with -S container=1; no packet index will be written\n";
+            demux.opt.output_packet_index = false;
+        }
+        if(opt_io_uring){
+            std::cerr << "-S io_uring=1 is ignored with -S container=1\n";
+            opt_io_uring = false;
+        }
+        if(container_segment_mb==0) container_segment_mb = container_store::DEFAULT_SEGMENT_MB;
+        demux.container = new container_store(demux.outdir,(uint64_t)container_segment_mb*1024*1024,
+                                              container_buffer);
+    }
+    bool opt_chunks = false;
+    uint32_t chunk_avg = chunk_store::DEFAULT_AVG_CHUNK;
+    si.get_config("chunk_store",&opt_chunks,"Store flows as deduplicated chunks");
+    si.get_config("chunk_avg",&chunk_avg,"Average chunk size");
+#ifndef HAVE_EVP_GET_DIGESTBYNAME
+    if(opt_chunks){                     // chunks are only found again by their digest
+        std::cerr << "-S chunk_store=1 requires OpenSSL; flows will be written as files\n";
+        opt_chunks = false;
+    }
+#endif
+    if(opt_chunks && demux.opt.store_output && !demux.opt.console_output && !demux.container){
+        if(demux.opt.output_packet_index){
+            std::cerr << "-I is not supported with -S chunk_store=1; no packet index will be written\n";
+            demux.opt.output_packet_index = false;
+        }
+        if(opt_io_uring){
+            std::cerr << "-S io_uring=1 is ignored with -S chunk_store=1\n";
+            opt_io_uring = false;
+        }
+        demux.chunks = new chunk_store(demux.outdir,chunk_avg);
+    }
+    std::string opt_compress;
+    si.get_config("compress",&opt_compress,"Compress flow files (gzip or zstd)");
+    si.get_config("compress_level",&demux.opt.compress_level,"Compression level");
+    if(opt_compress.size()>0 && demux.opt.store_output && !demux.opt.console_output
+       && !demux.container && !demux.chunks){
+        demux.opt.compress = flow_compressor::method_for(opt_compress);
+        if(demux.opt.compress==flow_compressor::NONE){
+            die("compression method '%s' is not available",opt_compress.c_str());
+        }
+    }
+    bool opt_mmap = false;
+    uint32_t mmap_window_mb = 8;
+    si.get_config("mmap",&opt_mmap,"Write flow files through mmap windows");
+    si.get_config("mmap_window_mb",&mmap_window_mb,"Size of the mmap window in MB");
+    if(opt_mmap && demux.opt.compress){
+        std::cerr << "-S mmap=1 is ignored with -S compress\n";
+        opt_mmap = false;
+    }
+    if(opt_io_uring && demux.opt.compress){
+        std::cerr << "-S io_uring=1 is ignored with -S compress\n";
+        opt_io_uring = false;
+    }
+    if(opt_mmap && demux.opt.store_output && !demux.opt.console_output
+       && !demux.container && !demux.chunks){
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+        if(opt_io_uring){
+            std::cerr << "-S io_uring=1 is ignored with -S mmap=1\n";
+            opt_io_uring = false;
+        }
+        if(mmap_window_mb==0) mmap_window_mb = 1;
+        if(mmap_window_mb>1024) mmap_window_mb = 1024;
+        demux.opt.mmap_window = mmap_window_mb*1024*1024; // a multiple of any page size
+#else
+        std::cerr << "mmap is not available; using write()\n";
+#endif
+    }
+    if(opt_io_uring && demux.opt.store_output && !demux.opt.console_output){
+        demux.aio = new async_io(io_uring_depth);
+        if(!demux.aio->ok()){
+            std::cerr << "io_uring is not available; using synchronous output\n";
+            delete demux.aio;
+            demux.aio = 0;
+        }
+    }
+
+    std::string retention_rules;
+    uint32_t retention_bytes = retention_policy::DEFAULT_HEAD_BYTES;
+    si.get_config("retention_rules",&retention_rules,"Retention rules file");
+    si.get_config("retention_bytes",&retention_bytes,"Bytes the retention rules see");
+    if(retention_rules.size()>0 && demux.opt.store_output && !demux.opt.console_output){
+        demux.retention = new retention_policy(retention_bytes);
+        std::string err;
+        if(!demux.retention->load(retention_rules,err)) die("%s",err.c_str());
+    }
+
+    if(xreport){
+        /* The <fileobject>s are inside <dfxml> and <configuration>. As with the
+         * console, a live capture writes each one at once unless asked to batch;
+         * then only the writer thread can flush on time when no flow closes.
+         */
+        bool live = rfiles.size()==0 && Rfiles.size()==0;
+        uint32_t report_batch = live ? 0 : flow_report::DEFAULT_BATCH;
+        uint32_t report_flush_ms = flow_report::DEFAULT_FLUSH_MS;
+        bool opt_report_thread = false;
+        si.get_config("report_batch",&report_batch,"Report batch size");
+        si.get_config("report_flush_ms",&report_flush_ms,"Report flush interval");
+        si.get_config("report_thread",&opt_report_thread,"Report writer thread");
+        if(live && report_batch>0) opt_report_thread = true;
+        demux.report = new flow_report(*xreport,2,report_batch,report_flush_ms,opt_report_thread);
+    }
+
+    std::string arrow_report;
+    uint32_t arrow_batch_rows = arrow_writer::DEFAULT_BATCH_ROWS;
+    si.get_config("arrow_report",&arrow_report,"Arrow flow file");
+    si.get_config("arrow_batch_rows",&arrow_batch_rows,"Arrow record batch rows");
+    if(arrow_report.size()>0){
+        demux.arrow = new arrow_writer(arrow_batch_rows);
+        tcpip::arrow_columns(*demux.arrow);
+        std::string err;
+        if(!demux.arrow->open(arrow_report,err)) die("%s",err.c_str());
+    }
+
+    bool opt_flow_db = false;
+    uint32_t flow_db_batch = flow_db::DEFAULT_BATCH_ROWS;
+    uint32_t flow_db_batch_ms = flow_db::DEFAULT_BATCH_MS;
+    bool opt_flow_db_thread = true;
+    uint32_t flow_db_queue = flow_db::DEFAULT_QUEUE_MAX;
+    si.get_config("flow_db",&opt_flow_db,"SQLite flow database");
+    si.get_config("flow_db_batch",&flow_db_batch,"Flow database transaction size");
+    si.get_config("flow_db_batch_ms",&flow_db_batch_ms,"Flow database commit interval");
+    si.get_config("flow_db_thread",&opt_flow_db_thread,"Flow database writer thread");
+    si.get_config("flow_db_queue",&flow_db_queue,"Flow database queue size");
+    if(opt_flow_db){
+        if(!flow_db::available()){
+            std::cerr << "SQLite is not available; no flow database will be written\n";
+        } else {
+            demux.flowdb = new flow_db(flow_db_batch,flow_db_batch_ms,opt_flow_db_thread,flow_db_queue);
+            std::string err;
+            if(!demux.flowdb->open(demux.outdir + "/" + flow_db::DEFAULT_FILENAME,err)) die("%s",err.c_str());
+        }
+    }
+
+    if(demux.opt.console_output){
+        /* When reading from files, collect the output into large writes. A live capture
+         * writes each packet as it arrives unless asked to batch.
+         */
+        uint32_t console_batch = (rfiles.size()==0 && Rfiles.size()==0) ? 0 : console_writer::DEFAULT_BATCH;
+        uint32_t console_flush_ms = console_writer::DEFAULT_FLUSH_MS;
+        si.get_config("console_batch",&console_batch,"Console output batch size");
+        si.get_config("console_flush_ms",&console_flush_ms,"Console output flush interval");
+        demux.console = new console_writer(console_batch,console_flush_ms);
+    }
+
+    if(demux.opt.post_processing){
+        bool opt_stream_scan = true;
+        uint32_t post_threads = 0;
+        uint32_t post_queue = 0;
+        si.get_config("stream_scan",&opt_stream_scan,"Streaming scanners");
+        si.get_config("post_threads",&post_threads,"Post-processing threads");
+        si.get_config("post_queue",&post_queue,"Post-processing queue size");
+        if(opt_stream_scan) stream_scanners::select();
+        if(post_threads>0 && stream_scanners::need_sbuf){
+#ifdef HAVE_PTHREAD
+            if(post_queue==0) post_queue = post_threads * post_pool::DEFAULT_QUEUE_PER_THREAD;
+            demux.pool = new post_pool(demux,post_threads,post_queue);
+            /* each worker may have an HTTP body file open */
+            if(demux.max_fds > demux.pool->threads*2) demux.max_fds -= demux.pool->threads;
+#else
+            std::cerr << "threads are not available; post-processing in the packet thread\n";
+#endif
+        }
+    }
 
     /* Record the configuration */
     if(xreport){
@@ -746,12 +974,52 @@ int main(int argc, char *argv[])
     DEBUG(2)("demux.max_open_flows:               %d",(int)demux.max_open_flows);
     DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map.size());
     DEBUG(2)("Flows seen:                         %d",(int)demux.flow_counter);
+    if(demux.aio){
+        DEBUG(2)("io_uring operations submitted:      %d",(int)demux.aio->ops_submitted);
+        DEBUG(2)("io_uring max operations in flight:  %d",(int)demux.aio->max_inflight);
+    }
+    if(demux.retention){
+        DEBUG(2)("flows kept/truncated/dropped:       %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                 demux.retention->kept,demux.retention->truncated,demux.retention->dropped);
+    }
+    if(demux.container){
+        DEBUG(2)("container extents written:          %d",(int)demux.container->extents_written);
+        DEBUG(2)("container bytes written:            %" PRId64,(int64_t)demux.container->bytes_written);
+    }
 
     int open_fds = (int)demux.open_flows.size();
     int flow_map_size = (int)demux.flow_map.size();
 
     demux.remove_all_flows();	// empty the map to capture the state
+    if(demux.pool){
+        DEBUG(2)("post-processing jobs:               %d",(int)demux.pool->jobs);
+        DEBUG(2)("post-processing queue stalls:       %d",(int)demux.pool->stalls);
+        delete demux.pool;              // the scanners must be idle before they shut down
+        demux.pool = 0;
+    }
+    if(demux.console) demux.console->flush();
+    if(demux.report){
+        demux.report->close();          // the last <fileobject>s, before the report is closed
+        DEBUG(2)("report fileobjects/writes:          %" PRIu64 "/%" PRIu64,demux.report->records,demux.report->writes);
+        delete demux.report;
+        demux.report = 0;
+    }
+    if(demux.arrow){
+        demux.arrow->close();
+        DEBUG(2)("arrow rows/record batches:          %" PRIu64 "/%" PRIu64,demux.arrow->rows,demux.arrow->batches);
+        delete demux.arrow;
+        demux.arrow = 0;
+    }
+    if(demux.flowdb){
+        demux.flowdb->close();          // the last rows, and the indexes
+        DEBUG(2)("flow database rows/transactions:    %" PRIu64 "/%" PRIu64,demux.flowdb->rows,demux.flowdb->transactions);
+        DEBUG(2)("flow database max batches queued:   %d",(int)demux.flowdb->max_queued);
+        DEBUG(2)("flow database queue stalls:         %d",(int)demux.flowdb->stalls);
+        delete demux.flowdb;
+        demux.flowdb = 0;
+    }
     std::stringstream ss;
+    stream_scanners::restore();         // the flows are all closed
     be13::plugin::phase_shutdown(fs,xreport ? &ss : 0);
 
     /*
@@ -771,6 +1039,25 @@ int main(int argc, char *argv[])
         xreport->xmlout("total_flows",demux.flow_counter);
         xreport->xmlout("flow_map_size",flow_map_size);
         xreport->xmlout("total_packets",demux.packet_counter);
+        if(demux.chunks){
+            std::stringstream cs;
+            cs << "chunks='" << demux.chunks->chunks << "' "
+               << "unique_chunks='" << demux.chunks->unique_chunks << "' "
+               << "logical_bytes='" << demux.chunks->logical_bytes << "' "
+               << "stored_bytes='" << demux.chunks->stored_bytes << "' "
+               << "dedup_ratio='" << std::fixed << std::setprecision(3)
+               << (demux.chunks->stored_bytes ? (double)demux.chunks->logical_bytes/demux.chunks->stored_bytes : 1.0)
+               << "'";
+            xreport->xmlout("chunk_store","",cs.str(),false);
+        }
+        if(demux.retention){
+            std::stringstream rs;
+            rs << "kept='" << demux.retention->kept << "' "
+               << "truncated='" << demux.retention->truncated << "' "
+               << "dropped='" << demux.retention->dropped << "' "
+               << "unwritten_bytes='" << demux.retention->unwritten_bytes << "'";
+            xreport->xmlout("retention","",rs.str(),false);
+        }
 	xreport->add_rusage();
 	xreport->pop();                 // bulk_extractor
 	xreport->close();
@@ -15,6 +15,19 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "async_io.h"
+#include "container_store.h"
+#include "flow_compressor.h"
+#include "chunk_store.h"
+#include "console_writer.h"
+#include "stream_scanner.h"
+#include "flow_report.h"
+#include "arrow_writer.h"
+#include "flow_db.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include <iostream>
 #include <sstream>
@@ -35,8 +48,14 @@
 tcpip::tcpip(tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_):
     demux(demux_),myflow(flow_),dir(unknown),isn(isn_),nsn(0),
     syn_count(0),fin_count(0),fin_size(0),pos(0),
-    flow_pathname(),fd(-1),file_created(false),
-    flow_index_pathname(),idx_file(),
+    flow_pathname(),fd(-1),file_created(false),write_limit(-1),
+    flow_index_pathname(),packet_index(),
+    aio_opening(false),aio_close_pending(false),aio_inflight(0),aio_connection_count(0),aio_waiting(),
+    map_base(0),map_start(0),map_end(0),map_alloc_start(0),map_alloc_end(0),
+    compressor(0),
+    container_state(0),chunk_state(0),
+    stream(0),
+    retention_head(0),retain_rule(0),retain_dropped(false),
     seen(new recon_set()),
     last_byte(),
     last_packet_number(),out_of_order_count(0),violations(0)
@@ -60,36 +79,146 @@ void tcpip::dump_seen()
     }
 }
 
-void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
+void tcpip::dump_xml(class flow_report &report,const std::string &xmladd)
+{
+    const std::string &in = report.indent;
+    std::string &o = report.begin();
+
+    o += in; o += "<fileobject>\n";
+    if(flow_pathname.size()){
+        o += in; o += "  <filename>"; flow_report::append_escaped(o,flow_pathname); o += "</filename>\n";
+    }
+    o += in; o += "  <filesize>"; flow_report::append_uint(o,last_byte); o += "</filesize>\n";
+    if(compressor){
+        o += in; o += "  <compressed_size method='"; o += flow_compressor::method_name(compressor->method); o += "'>";
+        flow_report::append_uint(o,compressor->compressed_bytes); o += "</compressed_size>\n";
+    }
+
+    o += in; o += "  <tcpflow startime='"; report.append_time(o,myflow.tstart);
+    o += "' endtime='"; report.append_time(o,myflow.tlast);
+    o += "' src_ipn='"; flow_report::append_ip(o,myflow.src.addr,myflow.family);
+    o += "' dst_ipn='"; flow_report::append_ip(o,myflow.dst.addr,myflow.family);
+    o += "' ";
+    if(myflow.has_mac_daddr()){ o += "mac_daddr='"; flow_report::append_mac(o,myflow.mac_daddr); o += "' "; }
+    if(myflow.has_mac_saddr()){ o += "mac_saddr='"; flow_report::append_mac(o,myflow.mac_saddr); o += "' "; }
+    o += "packets='"; flow_report::append_uint(o,myflow.packet_count);
+    o += "' srcport='"; flow_report::append_uint(o,myflow.sport);
+    o += "' dstport='"; flow_report::append_uint(o,myflow.dport);
+    o += "' family='"; flow_report::append_uint(o,myflow.family);
+    o += "' ";
+    if(myflow.protocol!=protocol_classifier::UNCLASSIFIED){
+        o += "protocol='"; o += protocol_classifier::name(myflow.protocol); o += "' ";
+    }
+    if(out_of_order_count){ o += "out_of_order_count='"; flow_report::append_uint(o,out_of_order_count); o += "' "; }
+    if(violations){ o += "violations='"; flow_report::append_uint(o,violations); o += "' "; }
+    if(demux.container || demux.chunks){ // key into the index or recipes
+        o += "flow_id='"; flow_report::append_uint(o,myflow.id); o += "' ";
+    }
+    o += "/>\n";
+    if(xmladd.size()>0){ o += in; o += "  "; o += xmladd; o += "\n"; }
+    o += in; o += "</fileobject>\n";
+    report.end();
+}
+
+void tcpip::arrow_columns(arrow_writer &w)
+{
+    w.add_column("filename",arrow_writer::UTF8);
+    w.add_column("filesize",arrow_writer::UINT64);
+    w.add_column("compression",arrow_writer::UTF8);
+    w.add_column("compressed_size",arrow_writer::UINT64);
+    w.add_column("startime",arrow_writer::TIMESTAMP_US);
+    w.add_column("endtime",arrow_writer::TIMESTAMP_US);
+    w.add_column("src_ipn",arrow_writer::UTF8);
+    w.add_column("dst_ipn",arrow_writer::UTF8);
+    w.add_column("mac_daddr",arrow_writer::UTF8);
+    w.add_column("mac_saddr",arrow_writer::UTF8);
+    w.add_column("packets",arrow_writer::UINT64);
+    w.add_column("srcport",arrow_writer::UINT16);
+    w.add_column("dstport",arrow_writer::UINT16);
+    w.add_column("family",arrow_writer::UINT8);
+    w.add_column("protocol",arrow_writer::UTF8);
+    w.add_column("out_of_order_count",arrow_writer::UINT64);
+    w.add_column("violations",arrow_writer::UINT64);
+    w.add_column("flow_id",arrow_writer::UINT64);
+    w.add_column("md5",arrow_writer::UTF8);
+    w.add_column("sha1",arrow_writer::UTF8);
+    w.add_column("sha256",arrow_writer::UTF8);
+}
+
+/* The text of <hashdigest type='type'> in xmladd, outside any <byte_runs>; "" if there is none */
+static std::string hashdigest(const std::string &xmladd,const char *type)
+{
+    const std::string open = std::string("<hashdigest type='") + type + "'>";
+    for(size_t pos=xmladd.find(open);pos!=std::string::npos;pos=xmladd.find(open,pos+open.size())){
+        size_t runs = xmladd.rfind("<byte_runs",pos);
+        if(runs!=std::string::npos && xmladd.find("</byte_runs>",runs)>pos) continue; // a digest of a run
+        size_t start = pos+open.size();
+        size_t end = xmladd.find("</hashdigest>",start);
+        if(end==std::string::npos) break;
+        return xmladd.substr(start,end-start);
+    }
+    return "";
+}
+
+void tcpip::dump_arrow(arrow_writer &w,const std::string &xmladd)
+{
+    std::string s;
+    if(flow_pathname.size()) w.put(flow_pathname); else w.put_null();
+    w.put(last_byte);
+    if(compressor){
+        w.put(std::string(flow_compressor::method_name(compressor->method)));
+        w.put(compressor->compressed_bytes);
+    } else {
+        w.put_null();
+        w.put_null();
+    }
+    w.put(myflow.tstart);
+    w.put(myflow.tlast);
+    flow_report::append_ip(s,myflow.src.addr,myflow.family);
+    w.put(s);
+    s.clear();
+    flow_report::append_ip(s,myflow.dst.addr,myflow.family);
+    w.put(s);
+    s.clear();
+    if(myflow.has_mac_daddr()){ flow_report::append_mac(s,myflow.mac_daddr); w.put(s); s.clear(); } else w.put_null();
+    if(myflow.has_mac_saddr()){ flow_report::append_mac(s,myflow.mac_saddr); w.put(s); s.clear(); } else w.put_null();
+    w.put(myflow.packet_count);
+    w.put(myflow.sport);
+    w.put(myflow.dport);
+    w.put(myflow.family);
+    if(myflow.protocol!=protocol_classifier::UNCLASSIFIED){
+        w.put(std::string(protocol_classifier::name(myflow.protocol)));
+    } else w.put_null();
+    w.put(out_of_order_count);
+    w.put(violations);
+    w.put(myflow.id);
+    static const char *digests[] = {"MD5","SHA1","SHA256"};
+    for(size_t i=0;i<3;i++){
+        std::string digest = xmladd.size() ? hashdigest(xmladd,digests[i]) : "";
+        if(digest.size()) w.put(digest); else w.put_null();
+    }
+    w.end_row();
+}
+
+void tcpip::dump_db(flow_db &db,const std::string &xmladd)
 {
-    static const std::string fileobject_str("fileobject");
-    static const std::string filesize_str("filesize");
-    static const std::string filename_str("filename");
-    static const std::string tcpflow_str("tcpflow");
-
-    xreport->push(fileobject_str);
-    if(flow_pathname.size()) xreport->xmlout(filename_str,flow_pathname);
-
-    xreport->xmlout(filesize_str,last_byte);
-	
-    std::stringstream attrs;
-    attrs << "startime='" << dfxml_writer::to8601(myflow.tstart) << "' ";
-    attrs << "endtime='"  << dfxml_writer::to8601(myflow.tlast)  << "' ";
-    attrs << "src_ipn='"  << ipaddr_prn(myflow.src, myflow.family) << "' ";
-    attrs << "dst_ipn='"  << ipaddr_prn(myflow.dst, myflow.family) << "' ";
-    if(myflow.has_mac_daddr()) attrs << "mac_daddr='" << macaddr(myflow.mac_daddr) << "' ";
-    if(myflow.has_mac_saddr()) attrs << "mac_saddr='" << macaddr(myflow.mac_saddr) << "' ";
-    attrs << "packets='"  << myflow.packet_count << "' ";
-    attrs << "srcport='"  << myflow.sport << "' ";
-    attrs << "dstport='"  << myflow.dport << "' ";
-    attrs << "family='"   << (int)myflow.family << "' ";
-    if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
-    if(violations)         attrs << "violations='" << violations << "' ";
-	
-    xreport->xmlout(tcpflow_str,"",attrs.str(),false);
-    if(xmladd.size()>0) xreport->xmlout("",xmladd,"",false);
-    xreport->pop();
-    xreport->flush();
+    flow_db::row &r = db.begin();
+    r.filename = flow_pathname;
+    r.filesize = last_byte;
+    r.starttime = myflow.tstart;
+    r.endtime = myflow.tlast;
+    flow_report::append_ip(r.src_ipn,myflow.src.addr,myflow.family);
+    flow_report::append_ip(r.dst_ipn,myflow.dst.addr,myflow.family);
+    if(myflow.has_mac_daddr()) flow_report::append_mac(r.mac_daddr,myflow.mac_daddr);
+    if(myflow.has_mac_saddr()) flow_report::append_mac(r.mac_saddr,myflow.mac_saddr);
+    r.packets = myflow.packet_count;
+    r.srcport = myflow.sport;
+    r.dstport = myflow.dport;
+    r.family = myflow.family;
+    r.protocol = protocol_classifier::name(myflow.protocol);
+    r.flow_id = myflow.id;
+    if(xmladd.size()) r.hashdigest_md5 = hashdigest(xmladd,"MD5");
+    db.end();
 }
 
 
@@ -103,6 +232,11 @@ tcpip::~tcpip()
 {
     assert(fd<0);                       // file must be closed
     if(seen) delete seen;
+    if(container_state) delete container_state;
+    if(chunk_state) delete chunk_state;
+    if(compressor) delete compressor;
+    if(stream) delete stream;
+    if(retention_head) delete retention_head;
 }
 
 #pragma GCC diagnostic warning "-Weffc++"
@@ -126,8 +260,22 @@ tcpip::~tcpip()
  */
 void tcpip::close_file()
 {
+    if (demux.container){
+        /* nothing is open; just push the staged data into the segment */
+        demux.container->flush(this);
+        return;
+    }
+    if (demux.chunks) return;           // nothing is open
+    if (demux.aio && (fd>=0 || aio_opening)){
+        /* the close, and the timestamp, are applied once the writes complete */
+        DEBUG(5) ("%s: closing file in tcpip::close_file (io_uring)", flow_pathname.c_str());
+        demux.aio->close(this);
+        fd = -1;
+        demux.open_flows.erase(this);
+    }
     if (fd>=0){
 	struct timeval times[2];
+	if(demux.opt.mmap_window) map_release(); // the evicted flow gives up its window too
 	times[0] = myflow.tstart;
 	times[1] = myflow.tstart;
 
@@ -152,13 +300,108 @@ void tcpip::close_file()
 	fd = -1;
 	demux.open_flows.erase(this);           // we are no longer open
     }
-    // Also close the flow_index file, if flow indexing is in use --GDD
-    if(demux.opt.output_packet_index && idx_file.is_open()){
-    	idx_file.close();
-    }
     //std::cerr << "close_file1 " << *this << "\n";
 }
 
+/*
+ * Memory-mapped output (-S mmap=1).
+ *
+ * The file is mapped one window of demux.opt.mmap_window bytes at a time;
+ * windows are aligned to their size. Mapping a window does not grow the
+ * file. Before each store, the MAP_ALLOC_STEP-aligned blocks it touches
+ * are allocated with posix_fallocate(), which also grows the file to
+ * cover them: a store into a sparse page when the disk is full would
+ * raise SIGBUS. Only what is written is allocated, a step at a time, so a
+ * flow that writes a few bytes holds a few blocks, not a window. If the
+ * blocks can't be allocated or the window can't be mapped, the data is
+ * written with pwrite() instead, which fails with an error. map_release()
+ * trims the file back to map_end, the end of the data actually written.
+ */
+void tcpip::map_pwrite(const u_char *data,uint32_t length,uint64_t offset)
+{
+    while(length>0){
+        ssize_t n = pwrite(fd,data,length,(off_t)offset);
+        if(n<=0){
+            DEBUG(1)("write to %s failed: %s",flow_pathname.c_str(),strerror(errno));
+            return;
+        }
+        data   += n;
+        offset += n;
+        length -= n;
+        if(offset>map_end) map_end = offset;
+    }
+}
+
+void tcpip::map_write(const u_char *data,uint32_t length,uint64_t offset)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    enum { MAP_ALLOC_STEP = 64 * 1024 }; // a multiple of any page size; divides every window
+    const uint64_t window = demux.opt.mmap_window;
+    while(length>0){
+        int r = 0;
+        if(map_base==0 || offset<map_start || offset>=map_start+window){
+            if(map_base) munmap(map_base,window);
+            map_base = 0;
+            map_start = offset - (offset % window);
+            map_alloc_start = map_alloc_end = map_start;
+            void *m = mmap(0,window,PROT_READ|PROT_WRITE,MAP_SHARED,fd,(off_t)map_start);
+            if(m==MAP_FAILED) r = errno;
+            else map_base = (uint8_t *)m;
+        }
+        uint32_t n = length;
+        if(offset+n > map_start+window) n = map_start+window-offset;
+        if(r==0 && (offset<map_alloc_start || offset+n>map_alloc_end)){
+            uint64_t start = offset - (offset % MAP_ALLOC_STEP);
+            uint64_t end = (offset+n+MAP_ALLOC_STEP-1) / MAP_ALLOC_STEP * MAP_ALLOC_STEP;
+            if(end > map_start+window) end = map_start+window;
+#ifdef HAVE_POSIX_FALLOCATE
+            r = posix_fallocate(fd,(off_t)start,(off_t)(end-start));
+#else
+            r = ENOSYS;
+#endif
+            if(r==0){
+                /* remember one allocated range; one that is not next to it is allocated again if stored to */
+                if(start<=map_alloc_end && end>=map_alloc_start && map_alloc_end>map_alloc_start){
+                    if(start<map_alloc_start) map_alloc_start = start;
+                    if(end>map_alloc_end) map_alloc_end = end;
+                } else {
+                    map_alloc_start = start;
+                    map_alloc_end = end;
+                }
+            }
+        }
+        if(r){
+            DEBUG(2)("cannot map %s: %s; writing it instead",flow_pathname.c_str(),strerror(r));
+            map_pwrite(data,length,offset);
+            return;
+        }
+        memcpy(map_base+(offset-map_start),data,n);
+        data   += n;
+        offset += n;
+        length -= n;
+        if(offset>map_end) map_end = offset;
+    }
+#endif
+}
+
+void tcpip::map_release()
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    if(map_base){
+        munmap(map_base,demux.opt.mmap_window);
+        map_base = 0;
+    }
+    if(fd>=0){
+        struct stat sb;
+        if(fstat(fd,&sb)==0 && (uint64_t)sb.st_size > map_end){
+            if(ftruncate(fd,(off_t)map_end)){
+                DEBUG(1)("ftruncate %s failed: %s",flow_pathname.c_str(),strerror(errno));
+            }
+        }
+    }
+#endif
+}
+
 /*
  * Opens the file transcript file (creating file if necessary).
  * Called by store_packet()
@@ -167,19 +410,46 @@ void tcpip::close_file()
 
 int tcpip::open_file()
 {
-	int create_idx_needed = false;
-    if(fd<0){
+    if(demux.container || demux.chunks){
+        /* container or chunk store: the flow is only a name in the index; no descriptor is used */
+        if(flow_pathname.size()==0){
+            flow_pathname = myflow.filename(0);
+            file_created = true;
+            DEBUG(5) ("%s: new flow in %s",flow_pathname.c_str(),demux.container ? "container" : "chunk store");
+        }
+        return 0;
+    }
+    if(fd<0 && demux.aio){
+        /* io_uring: submit the openat() and return; writes wait in the flow until it completes */
+        if(aio_opening) return 0;
+        if(flow_pathname.size()==0) {
+            aio_connection_count = 0;
+            flow_pathname = myflow.filename(0);
+            if(flow_pathname.find('/')!=std::string::npos) mkdirs_for_path(flow_pathname);
+            file_created = true;
+            demux.aio->open(this,flow_pathname,O_RDWR|O_BINARY|O_CREAT|O_EXCL);
+        } else {
+            demux.aio->open(this,flow_pathname,O_RDWR|O_BINARY|O_CREAT);
+        }
+        demux.open_flows.push_back(this);
+        if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
+    }
+    else if(fd<0){
         //std::cerr << "open_file0 " << ct << " " << *this << "\n";
         /* If we don't have a filename, create the flow */
         if(flow_pathname.size()==0) {
             flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
             file_created = true;		// remember we made it
-            create_idx_needed = true;	// We created a new stream, so we need to create a new flow file. --GDD
+            if(demux.opt.compress && fd>=0){
+                compressor = new flow_compressor((flow_compressor::method_t)demux.opt.compress,
+                                                 demux.opt.compress_level);
+            }
             DEBUG(5) ("%s: created new file",flow_pathname.c_str());
         } else {
             /* open an existing flow */
             fd = demux.retrying_open(flow_pathname,O_RDWR | O_BINARY | O_CREAT,0666);
-            lseek(fd,pos,SEEK_SET);  
+            if(compressor) lseek(fd,0,SEEK_END); // the compressed stream continues where it stopped
+            else lseek(fd,pos,SEEK_SET);  
             DEBUG(5) ("%s: opening existing file", flow_pathname.c_str());
         }
         
@@ -196,30 +466,6 @@ int tcpip::open_file()
         if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
         //std::cerr << "open_file1 " << *this << "\n";
     }
-    if(demux.opt.output_packet_index){
-    	//Open the file for the flow index.  We don't do this if the flow file could not be
-    	//	opened.  The file must be opened for append, in case this is a reopen.  The filename
-    	//	standard is the flow name followed by ".findx", which google currently says does not
-    	//	conflict with anything major.
-    	flow_index_pathname = flow_pathname + ".findx";
-    	DEBUG(10)("opening index file: %s",flow_index_pathname.c_str());
-    	if(create_idx_needed){
-    		//New flow file, even if there was an old one laying around --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::trunc|std::ios::in|std::ios::out);
-    	}else{
-    		//Use existing flow file --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::ate|std::ios::in|std::ios::out);
-    	}
-    	if(idx_file.bad()){
-    		perror(flow_index_pathname.c_str());
-    		// Be nice and be sure the flow has been closed in the demultiplexer.
-    		// demux.close_tcpip_fd(this);  Need to fix this.  Also, when called, it will
-    		// have to differentiate the fact that the open fd cound only needs to be
-    		// decremented by one and not by 2.--GDD
-    		return -1;
-    	}
-
-    }
     return 0;
 }
 
@@ -246,97 +492,31 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 	}
     }
 
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_wait(semlock)){
-	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
-
-    if (demux.opt.use_color) fputs(dir==dir_cs ? color[1] : color[2], stdout);
+    console_writer &out = *demux.console;
+    if (demux.opt.use_color) out.append(dir==dir_cs ? color[1] : color[2]);
     if (demux.opt.suppress_header == 0){
         if(flow_pathname.size()==0) flow_pathname = myflow.filename(0);
-        printf("%s: ", flow_pathname.c_str());
-        if(demux.opt.output_hex) putchar('\n');
+        out.append(flow_pathname);
+        out.append(": ",2);
+        if(demux.opt.output_hex) out.append('\n');
     }
 
-    size_t written = 0;
     if(demux.opt.output_hex){
-        const size_t bytes_per_line = 32;
-        size_t max_spaces = 0;
-        for(u_int i=0;i<length;i+=bytes_per_line){
-            size_t spaces=0;
-            
-            /* Print the offset */
-            char b[64];
-            size_t count = snprintf(b,sizeof(b),"%04x: ",(int)i);
-            if(fwrite(b,1,count,stdout)!=count){
-	      perror("fwrite");
-	    }
-            spaces += count;
-            
-            /* Print the hext bytes */
-            for(size_t j=0;j<bytes_per_line && i+j<length ;j++){
-                unsigned char ch = data[i+j];
-                fprintf(stdout,"%02x",ch);  spaces += 2;
-                if(j%2==1){
-                    fputc(' ',stdout);
-                    spaces += 1;
-                }
-            }
-            /* space out to where the ASCII region is */
-            if(spaces>max_spaces) max_spaces=spaces;
-            for(;spaces<max_spaces;spaces++){
-                fputc(' ',stdout);
-            }
-            putchar(' ');
-            /* Print the ascii */
-            for(size_t j=0;j<bytes_per_line && i+j<length;j++){
-                unsigned char ch = data[i+j];
-                if(ch>=' ' && ch<='~') fputc(ch,stdout);
-                else fputc('.',stdout);
-            }
-            fputc('\n',stdout);
-        }
-        written = length;               // just fake it.
+        out.append_hex(data,length);
     }
     else if(demux.opt.output_strip_nonprint){
-	for(const u_char *cc = data;cc<data+length;cc++){
-	    if(isprint(*cc) || (*cc=='\n') || (*cc=='\r')){
-                int ret = fputc(*cc,stdout);
-                if(ret==EOF){
-                    std::cerr << "EOF on write to stdout\n";
-                    exit(1);
-                
-                }
-	    }
-	    else fputc('.',stdout);
-            written += 1; // treat even unprintable characters as "written". It
-                          // really means "processed"
-	}
+        out.append_printable(data,length);
     }
     else {
-	written = fwrite(data,1,length,stdout);
-        if(length != written) std::cerr << "\nwrite error to stdout (" << length << "!=" << written << ") \n";
+        out.append((const char *)data,length);
     }
 
     last_byte += length;
 
-    if (demux.opt.use_color) printf("\033[0m");
+    if (demux.opt.use_color) out.append("\033[0m");
 
-    if (! demux.opt.console_output_nonewline) putchar('\n');
-    fflush(stdout);
-
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_post(semlock)){
-	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
+    if (! demux.opt.console_output_nonewline) out.append('\n');
+    out.end_packet();
 }
 
 /*
@@ -418,12 +598,29 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 	offset = 0;			// and write the data here
     }
 
+    /* Name the protocol from the segment that starts the flow */
+    if(offset==0 && myflow.protocol==protocol_classifier::UNCLASSIFIED && demux.opt.classify){
+        myflow.protocol = protocol_classifier::classify(data,length);
+    }
+
+    /* The retention policy sees the head of the flow before it is written,
+     * so a flow dropped on its first packet never has a file.
+     */
+    if(demux.retention && retain_rule==0){
+        if(retention_head==0) retention_head = new retention_probe(demux.retention->head_bytes);
+        if(insert_bytes>0) retention_head->shift(insert_bytes);
+        retention_head->sequence(data,length,offset);
+        if(retention_head->full()) retention_decide(false);
+    }
+
     /* reduce length to write if it goes beyond the number of bytes per flow,
      * but remember to seek out to the actual position after the truncated write...
      */
     uint32_t wlength = length;		// length to write
-    if (demux.opt.max_bytes_per_flow >= 0){
-        uint64_t max_bytes_per_flow = (uint64_t)demux.opt.max_bytes_per_flow;
+    int64_t  limit = demux.opt.max_bytes_per_flow;
+    if (write_limit>=0 && (limit<0 || write_limit<limit)) limit = write_limit;
+    if (limit >= 0){
+        uint64_t max_bytes_per_flow = (uint64_t)limit;
 
 	if(offset >= max_bytes_per_flow){
 	    wlength = 0;
@@ -433,13 +630,14 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 	    wlength = max_bytes_per_flow - offset;
 	}
     }
+    if (retain_rule && retain_rule->action!=retention_policy::KEEP) demux.retention->unwritten_bytes += length-wlength;
 
     /* if we don't have a file open for this flow, try to open it.
      * return if the open fails.  Note that we don't have to explicitly
      * save the return value because open_tcpfile() puts the file pointer
-     * into the structure for us.
+     * into the structure for us. A dropped flow has no file.
      */
-    if (fd < 0) {
+    if (fd < 0 && !retain_dropped) {
 	if (open_file()) {
 	    DEBUG(1)("unable to open TCP file %s  fd=%d  wlength=%d",
                      flow_pathname.c_str(),fd,(int)wlength);
@@ -450,9 +648,18 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
     /* Shift the file now if we were going shift it */
 
     if(insert_bytes>0){
-	if(fd>=0) shift_file(fd,insert_bytes);
+	if(demux.aio) demux.aio->drain(this); // shift_file() needs the data on disk and the fd
+	if(demux.container) demux.container->shift(this,insert_bytes); // only the extent offsets move
+	if(demux.chunks) demux.chunks->shift(this,insert_bytes);
+	if(demux.opt.mmap_window) map_release(); // shift_file() must see the true file size
+	if(stream) stream->shift(insert_bytes);
+	if(compressor) compressor->shift(insert_bytes); // compressed output can't be shifted
+	else if(fd>=0) shift_file(fd,insert_bytes);
+	if(map_end) map_end += insert_bytes;
 	isn -= insert_bytes;		// it's really earlier
-	lseek(fd,(off_t)0,SEEK_SET);	// put at the beginning
+	if(fd>=0 && !demux.aio && !demux.opt.mmap_window && !compressor){
+	    lseek(fd,(off_t)0,SEEK_SET); // put at the beginning; a compressed stream only grows at its end
+	}
 	pos = 0;
 	nsn = isn+1;
 	out_of_order_count++;
@@ -475,7 +682,7 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
             return;
         }
 
-	if(fd>=0) lseek(fd,(off_t)delta,SEEK_CUR);
+	if(fd>=0 && !demux.aio && !demux.opt.mmap_window && !compressor) lseek(fd,(off_t)delta,SEEK_CUR); // these writes carry their offset
 	if(delta<0) out_of_order_count++; // only increment for backwards seeks
 	DEBUG(25)("%s: lseek(%d,%d,SEEK_CUR) offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
 		  flow_pathname.c_str(), fd,(int)delta,offset,pos,out_of_order_count);
@@ -486,31 +693,41 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
     /* write the data into the file */
     DEBUG(25) ("%s: %s write %ld bytes @%" PRId64,
                flow_pathname.c_str(),
-               fd>=0 ? "will" : "won't",
+               (fd>=0 || demux.aio || demux.container || demux.chunks) ? "will" : "won't",
                (long) wlength, offset);
     
-    if(fd>=0){
-      if ((uint32_t)write(fd,data, wlength) != wlength) {
+    if(!retain_dropped && (fd>=0 || demux.aio || demux.container || demux.chunks)){
+      if(demux.container){
+	if(wlength>0) demux.container->write(this,data,wlength,offset);
+      } else if(demux.chunks){
+	demux.chunks->write(this,data,wlength,offset);
+      } else if(compressor){
+	compressor->write(fd,data,wlength,offset);
+      } else if(demux.opt.mmap_window){
+	map_write(data,wlength,offset);
+      } else if(demux.aio){
+	if(wlength>0) demux.aio->write(this,data,wlength,offset); // queued; the data is copied
+      } else if ((uint32_t)write(fd,data, wlength) != wlength) {
 	    DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
 	    if (debug >= 1) perror("");
 	}
-	// Write to the index file if needed.  Note, index file is sorted before close, so no need to jump around --GDD
-		if (demux.opt.output_packet_index && idx_file.is_open()) {
-			idx_file << offset << "|" << ts.tv_sec << "." << std::setw(6) << std::setfill('0') << ts.tv_usec << "|"
-					<< wlength << "\n";
-			if (idx_file.bad()){
-				DEBUG(1)("write to index file %s failed: ",flow_index_pathname.c_str());
-				if(debug >= 1){
-					perror("");
-				}
-			}
-		}
-	if(wlength != length){
+	// Remember the packet for the index; it is sorted and written when the flow is finished
+	if (demux.opt.output_packet_index) packet_index.push_back(packet_index_entry(offset,ts,wlength));
+	if(wlength != length && fd>=0 && !demux.aio && !demux.opt.mmap_window && !compressor){
 	    off_t p = lseek(fd,length-wlength,SEEK_CUR); // seek out the space we didn't write
             DEBUG(100)("   lseek(%" PRId64 ",SEEK_CUR)=%" PRId64,(int64_t)(length-wlength),(int64_t)p);
 	}
     }
 
+    /* The streaming scanners see what went into the flow file */
+    if(stream_scanners::active.size()>0 && wlength>0){
+        if(stream==0){
+            stream = new stream_feed(*this);
+            if(retention_head) stream->hold(); // until the policy says how much of the flow is kept
+        }
+        stream->sequence(data,wlength,offset);
+    }
+
     /* Update the database of bytes that we've seen */
     if(seen) update_seen(seen,pos,length);
 
@@ -520,7 +737,7 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 
     if(pos>last_byte) last_byte = pos;
 
-    if(debug>=100){
+    if(debug>=100 && fd>=0 && !demux.aio && !demux.opt.mmap_window && !compressor){
         uint64_t rpos = lseek(fd,(off_t)0,SEEK_CUR);
         DEBUG(100)("    pos=%" PRId64 "  lseek(fd,0,SEEK_CUR)=%" PRId64,pos,rpos);
         assert(pos==rpos);
@@ -533,62 +750,153 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 }
 
 /*
- * Compare two index strings and return the result.  Called by
- * the vector::sort in sort_index.
- * --GDD
+ * Apply the retention policy to the head of the flow, once it has
+ * retention_bytes of it, or when it closes with fewer.
  */
-bool tcpip::compare(std::string a, std::string b){
-	std::stringstream ss_a(a),ss_b(b);
-	long a_l,b_l;
+void tcpip::retention_decide(bool closing)
+{
+    if(closing) retention_head->drain(true); // gaps read as zeros, as in the file
+    const std::vector<uint8_t> &head = retention_head->head;
+    retain_rule = demux.retention->decide(head.size() ? &head[0] : 0,head.size(),myflow.protocol);
+    delete retention_head;
+    retention_head = 0;
+    DEBUG(10)("%s: %s, by rule at line %d",flow_pathname.c_str(),retain_rule->action_name(),retain_rule->line);
+
+    switch(retain_rule->action){
+    case retention_policy::KEEP:
+        demux.retention->kept++;
+        break;
+    case retention_policy::TRUNCATE:
+        demux.retention->truncated++;
+        limit_writes(retain_rule->limit);
+        break;
+    case retention_policy::DROP:
+        demux.retention->dropped++;
+        write_limit = 0;
+        if(demux.container || demux.chunks) break; // nothing can be unlinked; just stop writing
+        retain_dropped = true;
+        if(stream){                     // its scanners would report on part of a flow
+            delete stream;
+            stream = 0;
+        }
+        if(compressor){
+            delete compressor;
+            compressor = 0;
+        }
+        close_file();
+        if(file_created && unlink(flow_pathname.c_str())){
+            DEBUG(1)("unlink %s failed: %s",flow_pathname.c_str(),strerror(errno));
+        }
+        packet_index.clear();
+        break;
+    }
+    if(stream) stream->release();       // what it held, cut to the limit just set
+}
 
-	ss_a >> a_l;
-	ss_b >> b_l;
-	return a_l < b_l;
+/*
+ * Write no more than the first limit bytes of the flow, for the retention
+ * policy or a scanner that has seen all it wants. What is already written
+ * past the limit is cut from a plain flow file; compressed and stored
+ * flows only stop growing.
+ */
+void tcpip::limit_writes(uint64_t limit)
+{
+    if(write_limit>=0 && (uint64_t)write_limit<=limit) return;
+    write_limit = limit;
+    if(file_created && !compressor && !demux.container && !demux.chunks){
+        if(demux.aio) demux.aio->drain(this);
+        if(demux.opt.mmap_window){
+            if(map_end>limit) map_end = limit;
+            map_release();
+        }
+        struct stat st;
+        if((fd>=0 ? fstat(fd,&st) : stat(flow_pathname.c_str(),&st))==0 && (uint64_t)st.st_size>limit){
+            int r = fd>=0 ? ftruncate(fd,(off_t)limit) : truncate(flow_pathname.c_str(),(off_t)limit);
+            if(r) DEBUG(1)("truncate %s failed: %s",flow_pathname.c_str(),strerror(errno));
+        }
+    }
 }
 
 /*
- * Sort an index file (presumably from this object) if file indexing is
- * turned on and the file exists.  Index files may be out of order due
+ * Sort the packet index by offset. Index entries may be out of order due
  * to the arrival of out of order packets.  It is cheaper to reorder them
  * one time at the end of processing than it is to continually keep them
  * in order.
- * --GDD
+ *
+ * This is an LSD radix sort, one byte of the offset per pass. It is stable,
+ * so packets written to the same offset stay in arrival order. Passes in which
+ * every offset has the same byte are skipped, so a flow under 64KB takes two.
  */
-void tcpip::sort_index(std::fstream *ix_file) {
-
-	std::vector<std::string> idx;
-	std::string line;
-
-	if (demux.opt.output_packet_index) {
-		if (!(idx_file.good() && idx_file.is_open())) {
-			DEBUG(5)("Skipping index file sort.  Unusual behavior.\n");
-			return; //Nothing to do
-		}
-		//Make sure we are at the beginning.
-		ix_file->clear();
-		ix_file->seekg(0);
-		do {
-			*ix_file >> line;
-			if (!ix_file->eof()) {
-				idx.push_back(line);
-			}
-		} while (ix_file->good());
-		std::sort(idx.begin(), idx.end(), &tcpip::compare);
-		ix_file->clear();
-		ix_file->seekg(0);
-		for (std::vector<std::string>::iterator s = idx.begin(); s != idx.end();
-				s++) {
-			*ix_file << *s << "\n";
-		}
-	}
+void tcpip::sort_index()
+{
+    size_t n = packet_index.size();
+    if(n<2) return;
+
+    size_t count[8][256];
+    memset(count,0,sizeof(count));
+    for(packet_index_t::const_iterator e=packet_index.begin();e!=packet_index.end();e++){
+        for(int b=0;b<8;b++) count[b][(e->offset >> (b*8)) & 0xff]++;
+    }
+
+    packet_index_t tmp(packet_index);
+    packet_index_t *src = &packet_index;
+    packet_index_t *dst = &tmp;
+    for(int b=0;b<8;b++){
+        if(count[b][(packet_index[0].offset >> (b*8)) & 0xff]==n) continue; // nothing to do for this byte
+        size_t start[256];
+        size_t total = 0;
+        for(int i=0;i<256;i++){
+            start[i] = total;
+            total += count[b][i];
+        }
+        for(packet_index_t::const_iterator e=src->begin();e!=src->end();e++){
+            (*dst)[start[(e->offset >> (b*8)) & 0xff]++] = *e;
+        }
+        std::swap(src,dst);
+    }
+    if(src!=&packet_index) packet_index.swap(tmp);
 }
 
 /*
- * Convenience function to cause the local index file to be sorted.
- * --GDD
+ * Write the packet index for the flow as flow_pathname.findx, once, when the flow
+ * is finished. The default is the binary format described with packet_index_entry;
+ * -S packet_index_text=1 writes the original offset|sec.usec|len lines.
  */
-void tcpip::sort_index(){
-	tcpip::sort_index(&(this->idx_file));
+void tcpip::write_index()
+{
+    if(packet_index.size()==0 || flow_pathname.size()==0) return;
+    sort_index();
+    flow_index_pathname = flow_pathname + ".findx";
+    DEBUG(10)("writing index file: %s",flow_index_pathname.c_str());
+
+    std::string buf;
+    if(demux.opt.packet_index_text){
+        char line[64];
+        for(packet_index_t::const_iterator e=packet_index.begin();e!=packet_index.end();e++){
+            snprintf(line,sizeof(line),"%" PRIu64 "|%" PRIu64 ".%06u|%u\n",
+                     e->offset,e->sec,(unsigned int)e->usec,(unsigned int)e->len);
+            buf.append(line);
+        }
+    } else {
+        buf.reserve(packet_index.size()*24);
+        for(packet_index_t::const_iterator e=packet_index.begin();e!=packet_index.end();e++){
+            for(int i=0;i<8;i++) buf.push_back((char)((e->offset >> (i*8)) & 0xff));
+            for(int i=0;i<8;i++) buf.push_back((char)((e->sec >> (i*8)) & 0xff));
+            for(int i=0;i<4;i++) buf.push_back((char)((e->usec >> (i*8)) & 0xff));
+            for(int i=0;i<4;i++) buf.push_back((char)((e->len >> (i*8)) & 0xff));
+        }
+    }
+    int ifd = ::open(flow_index_pathname.c_str(),O_WRONLY|O_BINARY|O_CREAT|O_TRUNC,0666);
+    if(ifd<0){
+        perror(flow_index_pathname.c_str());
+    } else {
+        if(::write(ifd,buf.data(),buf.size())!=(ssize_t)buf.size()){
+            DEBUG(1)("write to index file %s failed: ",flow_index_pathname.c_str());
+            if(debug >= 1) perror("");
+        }
+        ::close(ifd);
+    }
+    packet_index.clear();
 }
 
 #pragma GCC diagnostic ignored "-Weffc++"
@@ -2,8 +2,10 @@
 #define TCPIP_H
 
 #include <fstream>
+#include <vector>
 
 #include "inet_ntop.h"
+#include "protocol_classifier.h"
 
 /** On windows, there is no in_addr_t; this is from
  * /usr/include/netinet/in.h
@@ -158,13 +160,13 @@ public:;
     static void usage();			// print information on flow notation
     static std::string filename_template;	// 
     static std::string outdir;                  // where the output gets written
-    flow():id(),vlan(),mac_daddr(),mac_saddr(),tstart(),tlast(),packet_count(){};
+    flow():id(),vlan(),mac_daddr(),mac_saddr(),tstart(),tlast(),packet_count(),protocol(protocol_classifier::UNCLASSIFIED){};
     flow(const flow_addr &flow_addr_,uint64_t id_,const be13::packet_info &pi):
 	flow_addr(flow_addr_),id(id_),vlan(pi.vlan()),
         mac_daddr(),
         mac_saddr(),
         tstart(pi.ts),tlast(pi.ts),
-	packet_count(0){
+	packet_count(0),protocol(protocol_classifier::UNCLASSIFIED){
         if(pi.pcap_hdr){
             memcpy(mac_daddr,pi.get_ether_dhost(),sizeof(mac_daddr));
             memcpy(mac_saddr,pi.get_ether_shost(),sizeof(mac_saddr));
@@ -178,6 +180,7 @@ public:;
     struct timeval tstart;		// when first seen
     struct timeval tlast;		// when last seen
     uint64_t packet_count;		// packet count
+    protocol_classifier::protocol_t protocol; // from the first bytes of this direction
 
     // return a filename for a flow based on the template and the connection count
     std::string filename(uint32_t connection_count); 
@@ -233,6 +236,22 @@ public:
 };
 
 
+/*
+ * One entry of the packet index (-I): where in the flow the data of a
+ * packet was written, and when the packet arrived.
+ * The binary .findx file is an array of these, little-endian, sorted by offset.
+ */
+class packet_index_entry {
+public:
+    packet_index_entry(uint64_t offset_,const struct timeval &ts,uint32_t len_):
+        offset(offset_),sec(ts.tv_sec),usec(ts.tv_usec),len(len_){}
+    uint64_t offset;
+    uint64_t sec;
+    uint32_t usec;
+    uint32_t len;
+};
+typedef std::vector<packet_index_entry> packet_index_t;
+
 /*
  * The tcpip class is a passive tcp/ip implementation.
  * It can reconstruct flows!
@@ -257,6 +276,7 @@ typedef boost::icl::interval_set<uint64_t> recon_set; // Boost interval set of b
 #endif
 
 #include "intrusive_list.h"
+#include "retention.h"
 
 #pragma GCC diagnostic warning "-Weffc++"
 #pragma GCC diagnostic warning "-Wshadow"
@@ -300,10 +320,40 @@ public:;
     std::string flow_pathname;		// path where flow is saved
     int		fd;			// file descriptor for file storing this flow's data 
     bool	file_created;		// true if file was created
+    int64_t     write_limit;            // bytes to write, like max_bytes_per_flow; -1 for all. See limit_writes()
 
     /* Flow Index information - only used if flow packet/data indexing is requested --GDD */
     std::string flow_index_pathname;	// Path for the flow index file
-    std::fstream		idx_file;				// File descriptor for storing the flow index data
+    packet_index_t packet_index;        // accumulated in memory; written once by write_index()
+
+    /* Asynchronous output state - only used with the io_uring backend (async_io.h) */
+    bool        aio_opening;            // openat() submitted but not yet completed
+    bool        aio_close_pending;      // close_file() was called while the open was in flight
+    uint32_t    aio_inflight;           // operations issued for this flow that have not completed
+    uint32_t    aio_connection_count;   // connection count of the name being tried by openat()
+    std::vector<class aio_op *> aio_waiting; // writes waiting for the openat() to complete
+
+    /* Memory-mapped output state - only used with -S mmap=1 */
+    uint8_t     *map_base;              // window of the flow file mapped for writing; 0 if none
+    uint64_t    map_start;              // file offset of map_base[0]
+    uint64_t    map_end;                // end of the data written through a window; the true file size
+    uint64_t    map_alloc_start;        // blocks of the window known to be allocated
+    uint64_t    map_alloc_end;
+
+    /* Compressed output state - only used with -S compress=... */
+    class flow_compressor *compressor;  // created with the flow file
+
+    /* Container output state - only used with the log-structured store (container_store.h) */
+    class container_flow *container_state; // extents and staged data; 0 until the first write
+    class chunk_flow *chunk_state;      // chunker and chunk references for the chunk store
+
+    /* Streaming scanners - only used when an enabled scanner streams (stream_scanner.h) */
+    class stream_feed *stream;          // created with the first byte written
+
+    /* Retention policy state - only used with -S retention_rules (retention.h) */
+    class retention_probe *retention_head; // the flow so far, until the policy decides
+    const retention_policy::rule *retain_rule; // the decision; 0 until it is made
+    bool        retain_dropped;         // nothing more is written for the flow
 
     /* Stats */
     recon_set   *seen;                  // what we've seen; it must be * due to boost lossage
@@ -317,16 +367,23 @@ public:;
 
     /* Methods */
     void close_file();			// close fd
+    void map_write(const u_char *data,uint32_t length,uint64_t offset); // copy into the mapped windows
+    void map_pwrite(const u_char *data,uint32_t length,uint64_t offset); // where a window cannot be mapped
+    void map_release();                 // unmap the window and trim the file to map_end
     int  open_file();                   // opens save file; return -1 if failure, 0 if success
     void print_packet(const u_char *data, uint32_t length);
     void store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
     void process_packet(const struct timeval &ts,const int32_t delta,const u_char *data,const uint32_t length);
     uint32_t seen_bytes();
     void dump_seen();
-    void dump_xml(class dfxml_writer *xmlreport,const std::string &xmladd);
-    static bool compare(std::string a, std::string b);
-    void sort_index(std::fstream *idx_file);
-    void sort_index();
+    void dump_xml(class flow_report &report,const std::string &xmladd); // the <fileobject>
+    static void arrow_columns(class arrow_writer &w); // the columns of dump_arrow()
+    void dump_arrow(class arrow_writer &w,const std::string &xmladd); // the same fields, as a row
+    void dump_db(class flow_db &db,const std::string &xmladd); // the row of the connections table
+    void sort_index();                  // radix sort packet_index by offset
+    void write_index();                 // sort and write the .findx file
+    void retention_decide(bool closing); // apply the policy to the head of the flow
+    void limit_writes(uint64_t limit);  // write no more than the first limit bytes of the flow
 };
 
 /* print a tcpip data structure. Largely for debugging */
@@ -352,11 +409,17 @@ class saved_flow  {
 public:
     saved_flow(tcpip *tcp):addr(tcp->myflow),
                            saved_filename(tcp->flow_pathname),
-                           isn(tcp->isn) {}
+                           isn(tcp->isn),
+                           dropped(tcp->retain_dropped),
+                           compressed(tcp->compressor!=0),
+                           last_byte(tcp->last_byte) {}
                            
     flow_addr         addr;                  // flow address
     std::string       saved_filename;        // where the flow was saved
     be13::tcp_seq     isn;                    // the flow's ISN
+    bool              dropped;               // by the retention policy; there is no file
+    bool              compressed;            // the file can't be compared with packets
+    uint64_t          last_byte;             // length of the flow
     virtual ~saved_flow(){};
 };
 
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Time scan_http on a synthetic keep-alive connection carrying many
+# pipelined requests and responses, and count heap allocations per
+# response when valgrind is installed.
+# Not run by make check. Usage: bench-http.sh [responses]
+#
+
+. $srcdir/test-subs.sh
+
+N=${1:-10000}
+OUT=/tmp/bench$$
+PCAP=/tmp/bench$$.pcap
+
+# Write a pcap with one connection: N GETs from the client, N responses from the server
+python3 - $N $PCAP <<'EOF'
+import struct,sys
+n,path = int(sys.argv[1]),sys.argv[2]
+cli,srv = bytes([10,0,0,1]),bytes([10,0,0,2])
+f = open(path,'wb')
+f.write(struct.pack('<IHHiIII',0xa1b2c3d4,2,4,0,0,65535,1))
+t = [0]
+def pkt(src,dst,sport,dport,seq,ack,flags,data=b''):
+    tcp = struct.pack('!HHIIBBHHH',sport,dport,seq,ack,5<<4,flags,65535,0,0)
+    ip  = struct.pack('!BBHHHBBH4s4s',0x45,0,20+len(tcp)+len(data),0,0,64,6,0,src,dst)
+    frame = b'\0'*12 + b'\x08\x00' + ip + tcp + data
+    t[0] += 1
+    f.write(struct.pack('<IIII',t[0]//1000000,t[0]%1000000,len(frame),len(frame)))
+    f.write(frame)
+def send(src,dst,sport,dport,seq,data):
+    for i in range(0,len(data),1400):
+        pkt(src,dst,sport,dport,seq+i,0,0x18,data[i:i+1400])
+    return seq+len(data)
+body = b'x'*512
+req = b''.join(b'GET /obj/%d.html HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: bench\r\n'
+               b'Accept: */*\r\nAccept-Encoding: identity\r\nConnection: keep-alive\r\n\r\n' % i for i in range(n))
+rsp = b''.join(b'HTTP/1.1 200 OK\r\nDate: Mon, 01 Jan 2024 00:00:00 GMT\r\nServer: bench\r\n'
+               b'Content-Type: text/html; charset=utf-8\r\nCache-Control: no-cache\r\n'
+               b'Connection: keep-alive\r\nContent-Length: %d\r\n\r\n' % len(body) + body for i in range(n))
+pkt(cli,srv,40000,80,1000,0,0x02)
+pkt(srv,cli,80,40000,5000,1001,0x12)
+cseq,sseq = 1001,5001
+for i in range(0,n,50):                 # interleave the directions as a real connection would
+    cseq = send(cli,srv,40000,80,cseq,req[len(req)*i//n:len(req)*min(i+50,n)//n])
+    sseq = send(srv,cli,80,40000,sseq,rsp[len(rsp)*i//n:len(rsp)*min(i+50,n)//n])
+pkt(cli,srv,40000,80,cseq,0,0x11)
+pkt(srv,cli,80,40000,sseq,0,0x11)
+EOF
+
+run()
+{
+  /bin/rm -rf $OUT
+  mkdir $OUT
+  start=`date +%s.%N`
+  if ! $TCPFLOW -e http -o $OUT $1 -r $PCAP ; then echo failed; exit 1; fi
+  end=`date +%s.%N`
+  echo "$1: `echo "$end - $start" | bc` seconds for $N responses"
+  bodies=`ls $OUT | grep -c HTTPBODY`
+  if [ $bodies -ne $N ] ; then echo "expected $N bodies, got $bodies"; exit 1; fi
+}
+
+run ""
+run "-S stream_scan=0"
+
+if which valgrind >/dev/null 2>&1 ; then
+  /bin/rm -rf $OUT
+  mkdir $OUT
+  allocs=`valgrind $TCPFLOW -e http -o $OUT -r $PCAP 2>&1 | sed -n 's/.*total heap usage: \([0-9,]*\) allocs.*/\1/p' | tr -d ,`
+  echo "heap allocations: $allocs (`expr $allocs / $N` per response)"
+fi
+/bin/rm -rf $OUT $PCAP
+exit 0
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Compare the write() and mmap (-S mmap=1) output paths on shuffled traces.
+# Not run by make check. Usage: bench-mmap.sh [iterations]
+#
+
+. $srcdir/test-subs.sh
+
+ITER=${1:-20}
+OUT=/tmp/bench$$
+
+bench()
+{
+  start=`date +%s.%N`
+  i=0
+  while [ $i -lt $ITER ] ; do
+    /bin/rm -rf $OUT/$1
+    if ! $TCPFLOW -o $OUT/$1 $2 -r $3 ; then echo failed; exit 1; fi
+    i=`expr $i + 1`
+  done
+  end=`date +%s.%N`
+  echo "$3 $1: `echo "$end - $start" | bc` seconds for $ITER runs"
+}
+
+for t in test5-lines-randomized test5-lines-randomized2 test1-out-of-order
+do
+  DMPFILE=$DMPDIR/$t.pcap
+  if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+  bench write "" $DMPFILE
+  bench mmap "-S mmap=1" $DMPFILE
+  # both paths must produce the same flows
+  if ! diff -r -x report.xml $OUT/write $OUT/mmap ; then
+    echo mmap output differs from write output for $t
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT
+exit 0
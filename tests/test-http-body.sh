@@ -0,0 +1,13 @@
+#!/bin/sh
+#
+# test that an HTTP body that arrives in several packets is written whole
+# when it is copied out of the flow file as the flow streams (the default)
+#
+
+. $srcdir/test-subs.sh
+
+/bin/rm -rf out
+cmd "$TCPFLOW -e http -o out -r $DMPDIR/http-multipacket.pcap"
+checkmd5 out/"010.000.000.002.00080-010.000.000.001.40000-HTTPBODY-001.txt" "c0ced2a72902e6c7ccbfd025f6d9f347" "4700"
+/bin/rm -rf out
+exit 0
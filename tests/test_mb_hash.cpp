@@ -0,0 +1,184 @@
+/*
+ * test_mb_hash:
+ * Check the multi-buffer MD5 and SHA-256 engines against known digests
+ * and against each other.
+ *
+ * With -b [flows] [bytes], time hashing that many flows of up to that
+ * many bytes each: one flow at a time (with OpenSSL, as scan_md5 does
+ * for a single flow, if tcpflow was built with it) and in batches with
+ * each engine the CPU has. The benchmark is not run by make check.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mb_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+#include <openssl/evp.h>
+#endif
+
+static const char *engine_names[] = {"scalar","avx2","avx512"};
+static int failures = 0;
+
+static std::string hex(const uint8_t *d,size_t len)
+{
+    std::string s;
+    char buf[3];
+    for(size_t i=0;i<len;i++){
+        snprintf(buf,sizeof(buf),"%02x",d[i]);
+        s += buf;
+    }
+    return s;
+}
+
+static void expect(mb_hash::alg_t alg,const char *msg,const char *want)
+{
+    uint8_t d[32];
+    std::vector<mb_hash::job> jobs;
+    jobs.push_back(mb_hash::job(reinterpret_cast<const uint8_t *>(msg),strlen(msg),d));
+    mb_hash::digest(alg,jobs);
+    std::string got = hex(d,mb_hash::digest_size(alg));
+    if(got!=want){
+        fprintf(stderr,"%s %s('%s') = %s, expected %s\n",mb_hash::engine(),alg==mb_hash::MD5 ? "md5" : "sha256",
+                msg,got.c_str(),want);
+        failures++;
+    }
+}
+
+/* flows of random lengths up to max_len, in one buffer */
+static void make_flows(size_t n,size_t max_len,std::vector<uint8_t> &buf,std::vector<size_t> &offsets,
+                       std::vector<size_t> &lens)
+{
+    size_t total = 0;
+    for(size_t i=0;i<n;i++){
+        size_t len = max_len ? random() % (max_len+1) : 0;
+        offsets.push_back(total);
+        lens.push_back(len);
+        total += len;
+    }
+    buf.resize(total+1);
+    for(size_t i=0;i<total;i++) buf[i] = random();
+}
+
+static void hash_all(mb_hash::alg_t alg,const std::vector<uint8_t> &buf,const std::vector<size_t> &offsets,
+                     const std::vector<size_t> &lens,std::vector<uint8_t> &digests)
+{
+    const unsigned int ds = mb_hash::digest_size(alg);
+    digests.assign(lens.size()*ds,0);
+    std::vector<mb_hash::job> jobs;
+    for(size_t i=0;i<lens.size();i++){
+        jobs.push_back(mb_hash::job(&buf[offsets[i]],lens[i],&digests[i*ds]));
+    }
+    mb_hash::digest(alg,jobs);
+}
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t,0);
+    return t.tv_sec + t.tv_usec/1e6;
+}
+
+static int bench(size_t flows,size_t max_len)
+{
+    std::vector<uint8_t> buf;
+    std::vector<size_t> offsets,lens;
+    make_flows(flows,max_len,buf,offsets,lens);
+    const double gb = (buf.size()-1)/1e9;
+    printf("%zu flows of up to %zu bytes, %.1f MB\n",flows,max_len,gb*1000);
+
+    for(int a=0;a<2;a++){
+        mb_hash::alg_t alg = a==0 ? mb_hash::MD5 : mb_hash::SHA256;
+        const char *name = a==0 ? "md5" : "sha256";
+#ifdef HAVE_EVP_GET_DIGESTBYNAME
+        {
+            double t0 = now();
+            EVP_MD_CTX *c = EVP_MD_CTX_create();
+            for(size_t i=0;i<flows;i++){
+                uint8_t md[EVP_MAX_MD_SIZE];
+                unsigned int mdlen;
+                EVP_DigestInit_ex(c,a==0 ? EVP_md5() : EVP_sha256(),NULL);
+                EVP_DigestUpdate(c,&buf[offsets[i]],lens[i]);
+                EVP_DigestFinal_ex(c,md,&mdlen);
+            }
+            EVP_MD_CTX_destroy(c);
+            double t = now()-t0;
+            printf("%-7s per-flow openssl: %6.3f s  %6.2f GB/s\n",name,t,gb/t);
+        }
+#endif
+        for(size_t e=0;e<sizeof(engine_names)/sizeof(engine_names[0]);e++){
+            if(!mb_hash::use_engine(engine_names[e])) continue;
+            std::vector<uint8_t> digests;
+            double t0 = now();
+            if(mb_hash::lanes()==1){
+                /* one flow at a time */
+                for(size_t i=0;i<flows;i++){
+                    uint8_t md[32];
+                    std::vector<mb_hash::job> one(1,mb_hash::job(&buf[offsets[i]],lens[i],md));
+                    mb_hash::digest(alg,one);
+                }
+            } else {
+                hash_all(alg,buf,offsets,lens,digests);
+            }
+            double t = now()-t0;
+            printf("%-7s %-6s x%-2u      : %6.3f s  %6.2f GB/s\n",name,mb_hash::engine(),mb_hash::lanes(),t,gb/t);
+        }
+    }
+    return 0;
+}
+
+int main(int argc,char **argv)
+{
+    if(argc>1 && strcmp(argv[1],"-b")==0){
+        return bench(argc>2 ? atol(argv[2]) : 100000,argc>3 ? atol(argv[3]) : 4096);
+    }
+
+    static const char *abc56 = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    for(size_t e=0;e<sizeof(engine_names)/sizeof(engine_names[0]);e++){
+        if(!mb_hash::use_engine(engine_names[e])) continue;
+        expect(mb_hash::MD5,"","d41d8cd98f00b204e9800998ecf8427e");
+        expect(mb_hash::MD5,"abc","900150983cd24fb0d6963f7d28e17f72");
+        expect(mb_hash::MD5,abc56,"8215ef0796a20bcaaae116d3876c664a");
+        expect(mb_hash::SHA256,"","e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+        expect(mb_hash::SHA256,"abc","ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        expect(mb_hash::SHA256,abc56,"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    }
+
+    /* Every engine must agree with the scalar one on messages of all lengths */
+    std::vector<uint8_t> buf;
+    std::vector<size_t> offsets,lens;
+    make_flows(200,300,buf,offsets,lens);
+    make_flows(50,5000,buf,offsets,lens);
+    for(int a=0;a<2;a++){
+        mb_hash::alg_t alg = a==0 ? mb_hash::MD5 : mb_hash::SHA256;
+        std::vector<uint8_t> want,got;
+        mb_hash::use_engine("scalar");
+        hash_all(alg,buf,offsets,lens,want);
+        for(size_t e=1;e<sizeof(engine_names)/sizeof(engine_names[0]);e++){
+            if(!mb_hash::use_engine(engine_names[e])) continue;
+            hash_all(alg,buf,offsets,lens,got);
+            if(got!=want){
+                fprintf(stderr,"%s disagrees with scalar\n",engine_names[e]);
+                failures++;
+            }
+        }
+    }
+
+    if(failures){
+        fprintf(stderr,"%d failures\n",failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * test_mime_map:
+ * Check the MIME type table and its lookup.
+ *
+ * With -b [n], time n lookups of a mix of known and unknown types
+ * instead. The benchmark is not run by make check.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "mime_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static int failures = 0;
+
+static void expect(const char *type, const char *ext)
+{
+    const char *got = mime_extension(type, strlen(type));
+    if ((got==0) != (ext==0) || (got && strcmp(got, ext))) {
+        fprintf(stderr, "'%s': expected %s, got %s\n", type, ext ? ext : "none", got ? got : "none");
+        failures++;
+    }
+}
+
+static int bench(long n)
+{
+    static const char *types[] = {
+        "text/html; charset=utf-8", "image/png", "application/javascript",
+        "APPLICATION/JSON", "video/mp4", "application/x-unknown-thing",
+        "text/plain;format=flowed", "x-conference/x-cooltalk",
+    };
+    const size_t ntypes = sizeof(types)/sizeof(types[0]);
+    size_t lens[sizeof(types)/sizeof(types[0])];
+    for (size_t i=0; i<ntypes; i++) lens[i] = strlen(types[i]);
+
+    struct timeval t0, t1;
+    size_t found = 0;
+    gettimeofday(&t0, 0);
+    for (long i=0; i<n; i++) {
+        if (mime_extension(types[i%ntypes], lens[i%ntypes])) found++;
+    }
+    gettimeofday(&t1, 0);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1e6;
+    printf("%ld lookups (%zu found) in %.3f seconds: %.1f ns/lookup\n", n, found, secs, secs*1e9/n);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc>1 && strcmp(argv[1], "-b")==0) {
+        return bench(argc>2 ? atol(argv[2]) : 10000000);
+    }
+
+    /* The table must stay sorted and in lower case for the search to work */
+    for (size_t i=0; i<mime_types_count; i++) {
+        if (i>0 && strcmp(mime_types[i-1].type, mime_types[i].type) >= 0) {
+            fprintf(stderr, "mime_types out of order at %s\n", mime_types[i].type);
+            failures++;
+        }
+        for (const char *cc=mime_types[i].type; *cc; cc++) {
+            if (*cc>='A' && *cc<='Z') {
+                fprintf(stderr, "mime_types has upper case in %s\n", mime_types[i].type);
+                failures++;
+                break;
+            }
+        }
+        expect(mime_types[i].type, mime_types[i].ext);
+    }
+
+    expect("text/html", "html");
+    expect("TEXT/HTML", "html");
+    expect("text/html; charset=utf-8", "html");
+    expect(" image/png ;q=1", "png");
+    expect("application/andrew-inset", "ez");          // first
+    expect("x-conference/x-cooltalk", "ice");          // last
+    expect("", 0);
+    expect(";", 0);
+    expect("text", 0);
+    expect("text/htm", 0);
+    expect("text/htmlx", 0);
+    expect("zzz/zzz", 0);
+
+    /* Looking up an unknown type must not add it */
+    size_t count = mime_types_count;
+    expect("application/x-not-a-type", 0);
+    expect("application/x-not-a-type", 0);
+    if (get_extension_for_mime_type("application/x-not-a-type").size() != 0 || mime_types_count != count) failures++;
+    if (get_extension_for_mime_type("Image/JPEG") != "jpg") {
+        fprintf(stderr, "get_extension_for_mime_type(Image/JPEG) is %s\n", get_extension_for_mime_type("Image/JPEG").c_str());
+        failures++;
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
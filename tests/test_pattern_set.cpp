@@ -0,0 +1,203 @@
+/*
+ * test_pattern_set:
+ * Check pattern_set against a naive search, with the data scanned whole
+ * and in pieces.
+ *
+ * With -b [patterns] [MB], time scanning that much random data for that
+ * many random patterns. The benchmark is not run by make check.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "pattern_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+static int failures = 0;
+
+typedef std::vector<std::pair<size_t,uint32_t> > found_t; // end offset, pattern
+
+static bool same_byte(uint8_t a,uint8_t b,bool nocase)
+{
+    if(nocase){
+        if(a>='A' && a<='Z') a += 'a'-'A';
+        if(b>='A' && b<='Z') b += 'a'-'A';
+    }
+    return a==b;
+}
+
+static found_t naive(const pattern_set &ps,const std::string &data,bool nocase)
+{
+    found_t found;
+    for(size_t end=1;end<=data.size();end++){
+        for(uint32_t p=0;p<ps.size();p++){
+            const std::string &pat = ps.pattern(p);
+            if(pat.size()==0 || pat.size()>end) continue;
+            size_t i;
+            for(i=0;i<pat.size();i++){
+                if(!same_byte(pat[i],data[end-pat.size()+i],nocase)) break;
+            }
+            if(i==pat.size()) found.push_back(std::make_pair(end,p));
+        }
+    }
+    std::sort(found.begin(),found.end());
+    return found;
+}
+
+/* scan in pieces of at most piece bytes, carrying the state */
+static found_t scan(const pattern_set &ps,const std::string &data,size_t piece)
+{
+    found_t found;
+    std::vector<pattern_set::hit> hits;
+    pattern_set::stream st;
+    for(size_t off=0;off<data.size();off+=piece){
+        size_t len = std::min(piece,data.size()-off);
+        hits.clear();
+        ps.scan(st,reinterpret_cast<const uint8_t *>(data.data())+off,len,hits);
+        for(size_t i=0;i<hits.size();i++) found.push_back(std::make_pair(off+hits[i].end,hits[i].pattern));
+    }
+    std::sort(found.begin(),found.end());
+    return found;
+}
+
+static void check(const char *what,const std::vector<std::string> &patterns,const std::string &data,bool nocase)
+{
+    static const size_t pieces[] = {1000000,1,2,3,7,64};
+    pattern_set ps;
+    for(size_t i=0;i<patterns.size();i++) ps.add(patterns[i]);
+    ps.compile(nocase);
+    found_t want = naive(ps,data,nocase);
+    for(size_t p=0;p<sizeof(pieces)/sizeof(pieces[0]);p++){
+        if(scan(ps,data,pieces[p])!=want){
+            fprintf(stderr,"%s: wrong matches in pieces of %zu\n",what,pieces[p]);
+            failures++;
+        }
+    }
+}
+
+static std::string random_string(size_t len,const char *alphabet)
+{
+    std::string s;
+    const size_t n = strlen(alphabet);
+    for(size_t i=0;i<len;i++) s.push_back(alphabet[random()%n]);
+    return s;
+}
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t,0);
+    return t.tv_sec + t.tv_usec/1e6;
+}
+
+static int bench(size_t npatterns,size_t mb)
+{
+    pattern_set ps;
+    for(size_t i=0;i<npatterns;i++){
+        std::string p;
+        for(size_t len=8+random()%24;p.size()<len;) p.push_back(random());
+        ps.add(p);
+    }
+    double t0 = now();
+    ps.compile(false);
+    printf("%zu patterns: %u byte window, %zu KB filter, compiled in %.3f s\n",
+           ps.size(),ps.window_size(),ps.filter_bytes()/1024,now()-t0);
+
+    /* random bytes, and text */
+    for(int kind=0;kind<2;kind++){
+        std::string data;
+        if(kind==0){
+            data.resize(mb*1000000);
+            for(size_t i=0;i<data.size();i++) data[i] = random();
+        } else {
+            data = random_string(mb*1000000,"abcdefghijklmnopqrstuvwxyz ");
+        }
+        for(size_t off=0;off+32<data.size();off+=65536){ // something to find
+            const std::string &p = ps.pattern(random()%ps.size());
+            data.replace(off,p.size(),p);
+        }
+        std::vector<pattern_set::hit> hits;
+        t0 = now();
+        pattern_set::stream st;
+        for(size_t off=0;off<data.size();off+=1448){ // segment by segment
+            ps.scan(st,reinterpret_cast<const uint8_t *>(data.data())+off,
+                            std::min((size_t)1448,data.size()-off),hits);
+        }
+        double t = now()-t0;
+        printf("%-6s %zu MB: %.3f s, %.0f MB/s, %zu hits\n",kind==0 ? "binary" : "text",mb,t,mb/t,hits.size());
+    }
+    return 0;
+}
+
+int main(int argc,char **argv)
+{
+    if(argc>1 && strcmp(argv[1],"-b")==0){
+        return bench(argc>2 ? atol(argv[2]) : 20000,argc>3 ? atol(argv[3]) : 200);
+    }
+
+    std::vector<std::string> patterns;
+    patterns.push_back("he");
+    patterns.push_back("she");
+    patterns.push_back("his");
+    patterns.push_back("hers");
+    patterns.push_back("");
+    patterns.push_back("s");
+    patterns.push_back("she");                  // twice
+    check("hers",patterns,"ushers she sells hishers",false);
+    check("hers nocase",patterns,"uSHErs ShE sells HIShers",true);
+
+    patterns.clear();
+    patterns.push_back(std::string("\0\0\xff",3));
+    patterns.push_back(std::string("\xff\0",2));
+    check("binary",patterns,std::string("\0\0\0\xff\0\0\xff\xff",8),false);
+
+    /* overlapping patterns over a small alphabet, so failure links are taken */
+    patterns.clear();
+    for(int i=0;i<200;i++) patterns.push_back(random_string(1+random()%8,"abc"));
+    check("random",patterns,random_string(3000,"abcd"),false);
+    check("random nocase",patterns,random_string(3000,"aBcDAbC"),true);
+
+    /* the pattern file format */
+    char fname[] = "/tmp/test_pattern_set.XXXXXX";
+    int fd = mkstemp(fname);
+    const char *file = "# comment\n\nplain\r\n\\x23hash\n\\\\back\\x00\\xFf\n";
+    if(fd<0 || write(fd,file,strlen(file))!=(ssize_t)strlen(file)){
+        perror(fname);
+        return 1;
+    }
+    close(fd);
+    pattern_set ps;
+    std::string err;
+    if(!ps.load(fname,err) || ps.size()!=3 || ps.pattern(0)!="plain" || ps.pattern(1)!="#hash"
+       || ps.pattern(2)!=std::string("\\back\0\xff",7)){
+        fprintf(stderr,"pattern file not read as expected: %s\n",err.c_str());
+        failures++;
+    }
+    fd = open(fname,O_WRONLY|O_TRUNC);
+    if(fd<0 || write(fd,"ok\nbad\\q\n",9)!=9){
+        perror(fname);
+        return 1;
+    }
+    close(fd);
+    pattern_set bad;
+    if(bad.load(fname,err) || err.find(":2:")==std::string::npos){
+        fprintf(stderr,"bad escape not reported: %s\n",err.c_str());
+        failures++;
+    }
+    unlink(fname);
+
+    if(failures){
+        fprintf(stderr,"%d failures\n",failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * test_protocol_classifier:
+ * Check that the first bytes of some common protocols are named, and
+ * that near misses are not.
+ *
+ * With -b [flows], time classifying that many flow heads. The benchmark
+ * is not run by make check.
+ *
+ * This file is part of tcpflow. This source code is under the GNU
+ * Public License (GPL) version 3. See COPYING for details.
+ */
+
+#include "protocol_classifier.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+static int failures = 0;
+
+static void check(const std::string &head,protocol_classifier::protocol_t want)
+{
+    protocol_classifier::protocol_t got =
+        protocol_classifier::classify(reinterpret_cast<const uint8_t *>(head.data()),head.size());
+    if(got!=want){
+        fprintf(stderr,"%zu bytes starting '%.8s': got '%s', wanted '%s'\n",head.size(),head.c_str(),
+                protocol_classifier::name(got),protocol_classifier::name(want));
+        failures++;
+    }
+}
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t,0);
+    return t.tv_sec + t.tv_usec/1e6;
+}
+
+static std::vector<std::string> heads()
+{
+    std::vector<std::string> h;
+    h.push_back("GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n");
+    h.push_back("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    h.push_back(std::string("\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03",11));
+    h.push_back("SSH-2.0-OpenSSH_9.6\r\n");
+    h.push_back(std::string("\x00\x00\x00\x85\xffSMBr\x00\x00\x00\x00",13));
+    h.push_back(std::string("\x00\x19\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x03www\x03" "com\x00\x00\x01\x00\x01",27));
+    h.push_back("random bytes that are no protocol at all");
+    return h;
+}
+
+static int bench(size_t flows)
+{
+    std::vector<std::string> h = heads();
+    size_t counts[protocol_classifier::NPROTOCOLS] = {0};
+    double t0 = now();
+    for(size_t i=0;i<flows;i++){
+        const std::string &s = h[i%h.size()];
+        counts[protocol_classifier::classify(reinterpret_cast<const uint8_t *>(s.data()),s.size())]++;
+    }
+    double t = now()-t0;
+    printf("%zu flows: %.3f s, %.0f ns per flow (%zu unknown)\n",flows,t,t*1e9/flows,
+           counts[protocol_classifier::UNKNOWN]);
+    return 0;
+}
+
+int main(int argc,char **argv)
+{
+    if(argc>1 && strcmp(argv[1],"-b")==0) return bench(argc>2 ? atol(argv[2]) : 10000000);
+
+    std::vector<std::string> h = heads();
+    check(h[0],protocol_classifier::HTTP);
+    check(h[1],protocol_classifier::HTTP);
+    check(h[2],protocol_classifier::TLS);
+    check(h[3],protocol_classifier::SSH);
+    check(h[4],protocol_classifier::SMB);
+    check(h[5],protocol_classifier::DNS);
+    check(h[6],protocol_classifier::UNKNOWN);
+    check("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",protocol_classifier::HTTP2);
+    check("OPTIONS * HTTP/1.1\r\n",protocol_classifier::HTTP);
+    check("OPTIONS rtsp://cam/ RTSP/1.0\r\n",protocol_classifier::RTSP); // the longest signature wins
+    check("OPTIONS sip:bob@example.com SIP/2.0\r\n",protocol_classifier::SIP);
+    check(std::string("\x00\x00\x00\x40\xfeSMB",8),protocol_classifier::SMB);
+    check(std::string("\x03\x00\x00\x2c\x27\xe0\x00\x00",8),protocol_classifier::RDP);
+    check("\x13" "BitTorrent protocol",protocol_classifier::BITTORRENT);
+    check("EHLO mail.example.com\r\n",protocol_classifier::SMTP);
+    check("+OK POP3 ready\r\n",protocol_classifier::POP3);
+    check("* OK IMAP4rev1\r\n",protocol_classifier::IMAP);
+
+    /* near misses */
+    check("GET",protocol_classifier::UNKNOWN);
+    check("GETX / HTTP/1.1\r\n",protocol_classifier::UNKNOWN);
+    check(std::string("\x16\x03\x09\x00\x10",5),protocol_classifier::UNKNOWN);
+    check(std::string("\x00\x00\x00\x85\xffSMX",8),protocol_classifier::UNKNOWN);
+    check(std::string("\x00\x19\x12\x34\x01\x00\x00\x02\x00\x00\x00\x00\x00\x00\x03www\x03" "com\x00\x00\x01\x00\x01",27),
+          protocol_classifier::UNKNOWN); // two questions
+    check("",protocol_classifier::UNKNOWN);
+
+    for(int p=protocol_classifier::UNKNOWN;p<protocol_classifier::NPROTOCOLS;p++){
+        if(protocol_classifier::lookup(protocol_classifier::name((protocol_classifier::protocol_t)p))!=p){
+            fprintf(stderr,"lookup(%s) failed\n",protocol_classifier::name((protocol_classifier::protocol_t)p));
+            failures++;
+        }
+    }
+    if(protocol_classifier::lookup("gopher")!=protocol_classifier::NPROTOCOLS){
+        fprintf(stderr,"lookup(gopher) did not fail\n");
+        failures++;
+    }
+
+    if(failures){
+        fprintf(stderr,"%d failures\n",failures);
+        return 1;
+    }
+    return 0;
+}